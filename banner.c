@@ -0,0 +1,67 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#include <string.h>
+#include "banner.h"
+
+/* Whether the line of len bytes, without its newline, identifies an SSH
+ * server: SSH-, a protocol version of two numbers, -, and a software
+ * version.
+ */
+static int is_ident(const char *line, size_t len)
+{
+  size_t i=4;
+  int dots=0,digits=0;
+  if (len&&(line[len-1]=='\r')) --len;
+  if ((len<4)||memcmp(line,"SSH-",4)) return 0;
+  for (;(i<len)&&(line[i]!='-');++i) {
+    if (line[i]=='.') {
+      if (!digits) return 0;
+      ++dots;
+      digits=0;
+    } else if ((line[i]>='0')&&(line[i]<='9')) {
+      ++digits;
+    } else {
+      return 0;
+    }
+  }
+  return (dots==1)&&digits&&(i+1<len);
+}
+
+int banner_check(const char *buf, size_t len)
+{
+  size_t line=0,i;
+  for (i=0;i<len;++i) {
+    unsigned char c=buf[i];
+    if (c=='\n') {
+      if (is_ident(buf+line,i-line)) return i+1;
+      /* Other lines may come first, but not broken identifications */
+      if ((i-line>=4)&&!memcmp(buf+line,"SSH-",4)) return -1;
+      line=i+1;
+      continue;
+    }
+    /* Text only, which rules out binary protocols */
+    if (((c<32)&&(c!='\r')&&(c!='\t'))||(c==127)) return -1;
+    /* An HTTP server or proxy, most likely a captive portal */
+    if ((i-line==4)&&!memcmp(buf+line,"HTTP/",5)) return -1;
+  }
+  return (len>=SSH_BANNER_MAX)?-1:0;
+}
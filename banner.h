@@ -0,0 +1,44 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+/*
+    Checking what a server sends before the SSH client gets to see it.
+    RFC 4253 has the server send its identification line,
+    "SSH-protoversion-softwareversion", possibly after other lines of
+    text. Captive portals, HTTP proxies and whatever else answers on
+    an unexpected address don't.
+ */
+
+#ifndef BANNER_H
+#define BANNER_H
+
+#include <stddef.h>
+
+/* The most that is read waiting for the identification line */
+#define SSH_BANNER_MAX 512
+
+/* Check the len bytes a server has sent so far. Returns how many bytes
+ * up to and including the identification line once it has arrived, 0
+ * if more is needed and -1 if this is not an SSH server.
+ */
+int banner_check(const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,625 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+    Benchmarks for ssh-multipath-proxy, run with "make bench".
+
+    A number of fake SSH servers are started on the loopback interface
+    and the real proxy binary is run against them, so the whole path
+    through main() and wait_for_reply() is measured:
+
+    - Time to first byte, from starting the proxy until the first byte
+      of the banner comes out on its stdout, for several orderings of
+      servers which answer at once, answer late, never answer, reset
+      the connection or answer with something that isn't SSH.
+
+    - Relay throughput, pushing data through the proxy in each direction
+      with the ordinary relay and with -s, reporting MB/s and the CPU
+      time the proxy used per megabyte.
+
+    - With -p and the ssh-multipath-peer binary, clean ends of bonded
+      sessions which can be resumed: data is sent over two paths to a
+      peer in front of the sink, and the runs in which the proxy took
+      the end of the session for a lost path are counted.
+
+    - With -f, instead of the above, the memory footprint: as many
+      proxies as given are started and left idle in the relay, and
+      their resident and proportional set sizes are read from /proc,
+      so it shows what every further session costs a jump host.
+
+    Usage: bench [-n runs] [-b bytes] [-p peer] [-f proxies] proxy
+                 [proxy options]
+
+    The proxy is run without the user's config file and environment
+    options, so the numbers only depend on the options given here.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static const char banner[]="SSH-2.0-bench\r\n";
+
+enum server_mode {
+  INSTANT,
+  DELAYED,
+  BLACKHOLE,
+  RESET,
+  GARBAGE,
+  SINK,
+  SOURCE,
+  /* ssh-multipath-peer in front of the sink, with -p */
+  PEER,
+  NR_MODES
+};
+
+static const char *mode_names[NR_MODES]={
+  "instant","delayed","blackhole","reset","garbage","sink","source","peer"
+};
+
+static int ports[NR_MODES];
+static pid_t servers[NR_MODES];
+static long long bytes=1LL<<30;
+static int runs=10;
+static int footprint=0;
+static const char *peer=NULL;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+  while (len) {
+    ssize_t r=write(fd,buf,len);
+    if (r<1) return;
+    buf+=r;
+    len-=r;
+  }
+}
+
+static void discard(int fd)
+{
+  char buf[65536];
+  while (read(fd,buf,sizeof(buf))>0);
+}
+
+/* Handle one connection to a server of the given mode */
+static void serve(int fd, enum server_mode mode)
+{
+  static char buf[65536];
+  struct linger lin;
+  long long left;
+  switch(mode) {
+  case DELAYED:
+    usleep(200000);
+    /* fall through */
+  case INSTANT:
+  case SINK:
+    write_all(fd,banner,sizeof(banner)-1);
+    discard(fd);
+    break;
+  case BLACKHOLE:
+    /* The connect succeeds, but nothing ever comes back */
+    discard(fd);
+    break;
+  case RESET:
+    lin.l_onoff=1;
+    lin.l_linger=0;
+    setsockopt(fd,SOL_SOCKET,SO_LINGER,&lin,sizeof(lin));
+    break;
+  case GARBAGE:
+    write_all(fd,"HTTP/1.1 400 Bad Request\r\n\r\n",28);
+    discard(fd);
+    break;
+  case SOURCE:
+    write_all(fd,banner,sizeof(banner)-1);
+    memset(buf,'x',sizeof(buf));
+    for (left=bytes;left>0;left-=sizeof(buf))
+      write_all(fd,buf,(left<(long long)sizeof(buf))?left:(long long)sizeof(buf));
+    break;
+  default:
+    break;
+  }
+  close(fd);
+}
+
+static int start_server(enum server_mode mode)
+{
+  struct sockaddr_in sin;
+  socklen_t len=sizeof(sin);
+  int fd=socket(AF_INET,SOCK_STREAM,0);
+  int one=1;
+  pid_t pid;
+
+  setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+  memset(&sin,0,sizeof(sin));
+  sin.sin_family=AF_INET;
+  sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if (bind(fd,(struct sockaddr *)&sin,sizeof(sin))||listen(fd,64)||
+      getsockname(fd,(struct sockaddr *)&sin,&len)) {
+    perror("listen");
+    return -1;
+  }
+  ports[mode]=ntohs(sin.sin_port);
+
+  pid=fork();
+  if (pid==-1) {
+    perror("fork");
+    return -1;
+  }
+  if (!pid) {
+    signal(SIGCHLD,SIG_IGN);
+    while (1) {
+      int c=accept(fd,NULL,NULL);
+      if (c==-1) continue;
+      if (!fork()) {
+        close(fd);
+        serve(c,mode);
+        _exit(0);
+      }
+      close(c);
+    }
+  }
+  close(fd);
+  servers[mode]=pid;
+  return 0;
+}
+
+/* Start the peer on a free port of the loopback interface, relaying
+ * to the sink.
+ */
+static int start_peer(void)
+{
+  struct sockaddr_in sin;
+  socklen_t len=sizeof(sin);
+  char listen[32],target[32];
+  int fd=socket(AF_INET,SOCK_STREAM,0);
+  pid_t pid;
+
+  /* Find a port nobody uses, the peer binds it again right away */
+  memset(&sin,0,sizeof(sin));
+  sin.sin_family=AF_INET;
+  sin.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if (bind(fd,(struct sockaddr *)&sin,sizeof(sin))||
+      getsockname(fd,(struct sockaddr *)&sin,&len)) {
+    perror("bind");
+    return -1;
+  }
+  close(fd);
+  ports[PEER]=ntohs(sin.sin_port);
+  snprintf(listen,sizeof(listen),"127.0.0.1:%d",ports[PEER]);
+  snprintf(target,sizeof(target),"127.0.0.1:%d",ports[SINK]);
+
+  pid=fork();
+  if (pid==-1) {
+    perror("fork");
+    return -1;
+  }
+  if (!pid) {
+    freopen("/dev/null","w",stderr);
+    execl(peer,peer,"-l",listen,"-t",target,(char *)NULL);
+    _exit(127);
+  }
+  servers[PEER]=pid;
+  /* Until it listens */
+  usleep(200000);
+  return 0;
+}
+
+static void stop_servers(void)
+{
+  int i;
+  for (i=0;i<NR_MODES;++i)
+    if (servers[i]>0) {
+      kill(servers[i],SIGTERM);
+      waitpid(servers[i],NULL,0);
+      servers[i]=0;
+    }
+}
+
+/* Start the proxy with pipes for its stdin and stdout, with the NULL
+ * terminated extra options and one argument for each of the n servers
+ * in hosts. Its stderr goes to a pipe too if err is not NULL.
+ */
+static pid_t start_proxy(char **proxy, int nr_options, char **extra,
+                         const enum server_mode *hosts, int n,
+                         int *to, int *from, int *err)
+{
+  char addr[NR_MODES][32];
+  char *argv[64];
+  int in[2],out[2],errp[2]={-1,-1};
+  int i,argc=0;
+  pid_t pid;
+
+  for (i=0;i<=nr_options;++i) argv[argc++]=proxy[i];
+  for (i=0;extra&&extra[i];++i) argv[argc++]=extra[i];
+  for (i=0;i<n;++i) {
+    snprintf(addr[i],sizeof(addr[i]),"127.0.0.1:%d",ports[hosts[i]]);
+    argv[argc++]=addr[i];
+  }
+  /* The proxy wants at least two arguments */
+  if (n==1) argv[argc++]=addr[0];
+  argv[argc]=NULL;
+
+  if (pipe(in)||pipe(out)||(err&&pipe(errp))) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  pid=fork();
+  if (pid==-1) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (!pid) {
+    dup2(in[0],0);
+    dup2(out[1],1);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    /* The proxy tells which host it used on stderr every time */
+    if (err) {
+      dup2(errp[1],2);
+      close(errp[0]);
+      close(errp[1]);
+    } else {
+      freopen("/dev/null","w",stderr);
+    }
+    execv(argv[0],argv);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  *to=in[1];
+  *from=out[0];
+  if (err) {
+    close(errp[1]);
+    *err=errp[0];
+  }
+  return pid;
+}
+
+static int compare(const void *a, const void *b)
+{
+  double x=*(const double *)a,y=*(const double *)b;
+  return (x>y)-(x<y);
+}
+
+static void bench_ttfb(char **proxy, int nr_options,
+                       const enum server_mode *hosts, int n)
+{
+  double t[1000];
+  char name[256]="";
+  int i;
+
+  for (i=0;i<n;++i) {
+    if (i) strcat(name," ");
+    strcat(name,mode_names[hosts[i]]);
+  }
+  for (i=0;i<runs;++i) {
+    int to,from;
+    char c;
+    double start=now();
+    pid_t pid=start_proxy(proxy,nr_options,NULL,hosts,n,&to,&from,NULL);
+    t[i]=(read(from,&c,1)==1)?(now()-start)*1000:-1;
+    kill(pid,SIGTERM);
+    waitpid(pid,NULL,0);
+    close(to);
+    close(from);
+  }
+  qsort(t,runs,sizeof(t[0]),compare);
+  if (t[0]<0)
+    printf("  %-36s failed\n",name);
+  else
+    printf("  %-36s %9.2f %9.2f %9.2f\n",name,t[0],t[runs/2],t[runs-1]);
+}
+
+/* Send bytes through the proxy to the sink, or receive them from the
+ * source, and report the rate and the CPU time the proxy used.
+ */
+static void bench_relay(char **proxy, int nr_options, char **extra,
+                        enum server_mode mode)
+{
+  static char buf[65536];
+  struct rusage ru;
+  long long sent=0,received=0;
+  double start,t,cpu;
+  int to,from,status;
+  pid_t pid;
+
+  memset(buf,'x',sizeof(buf));
+  start=now();
+  pid=start_proxy(proxy,nr_options,extra,&mode,1,&to,&from,NULL);
+  if (mode==SOURCE) {
+    close(to);
+    to=-1;
+  }
+  while (from!=-1) {
+    struct pollfd p[2];
+    int np=0;
+    p[np].fd=from;
+    p[np++].events=POLLIN;
+    if (to!=-1) {
+      p[np].fd=to;
+      p[np++].events=POLLOUT;
+    }
+    if (poll(p,np,-1)<1) continue;
+    if (p[0].revents) {
+      ssize_t r=read(from,buf,sizeof(buf));
+      if (r<1) {
+        close(from);
+        from=-1;
+      } else {
+        received+=r;
+      }
+    }
+    if ((np>1)&&p[1].revents) {
+      long long left=bytes-sent;
+      ssize_t r=write(to,buf,(left<(long long)sizeof(buf))?left:(long long)sizeof(buf));
+      if (r>0) sent+=r;
+      if ((r<1)||(sent==bytes)) {
+        close(to);
+        to=-1;
+      }
+    }
+  }
+  if (to!=-1) close(to);
+  wait4(pid,&status,0,&ru);
+  t=now()-start;
+  cpu=ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6+
+    ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6;
+  if ((mode==SOURCE)?(received<bytes):(sent<bytes)) {
+    printf("  %-10s %-8s failed\n",mode==SOURCE?"download":"upload",
+           extra?"splice":"copy");
+    return;
+  }
+  printf("  %-10s %-8s %9.1f MB/s %9.3f ms CPU/MB\n",
+         mode==SOURCE?"download":"upload",extra?"splice":"copy",
+         bytes/t/1e6,cpu*1000/(bytes/1e6));
+}
+
+/* Send a megabyte, or bytes if less, over two paths of a resumable
+ * session to the peer and read what the proxy said about it. The end
+ * of a session must not look like a lost path, which would make it
+ * connect again after all was done.
+ */
+static void bench_resume(char **proxy, int nr_options)
+{
+  static const enum server_mode hosts[2]={PEER,PEER};
+  static char *options[]={"--bond=2","--resume",NULL};
+  static char buf[65536];
+  double t[1000];
+  long long size=(bytes<(1<<20))?bytes:(1<<20);
+  int i,lost=0,failed=0;
+
+  memset(buf,'x',sizeof(buf));
+  for (i=0;i<runs;++i) {
+    char msg[4096];
+    size_t len=0;
+    ssize_t r;
+    long long left;
+    int to,from,err,status;
+    double start=now();
+    pid_t pid=start_proxy(proxy,nr_options,options,hosts,2,&to,&from,&err);
+    for (left=size;left>0;left-=sizeof(buf))
+      write_all(to,buf,(left<(long long)sizeof(buf))?left:(long long)sizeof(buf));
+    close(to);
+    discard(from);
+    close(from);
+    while ((len<sizeof(msg)-1)&&((r=read(err,msg+len,sizeof(msg)-1-len))>0))
+      len+=r;
+    msg[len]=0;
+    discard(err);
+    close(err);
+    waitpid(pid,&status,0);
+    t[i]=(now()-start)*1000;
+    if (strstr(msg,"Lost a path")) ++lost;
+    if (!WIFEXITED(status)||WEXITSTATUS(status)) ++failed;
+  }
+  qsort(t,runs,sizeof(t[0]),compare);
+  printf("Resumable bonded sessions, %lld bytes, %d runs\n",size,runs);
+  printf("  %-36s %9s %9s %9s\n","","min","median","max");
+  printf("  %-36s %9.2f %9.2f %9.2f\n","two paths to the peer",
+         t[0],t[runs/2],t[runs-1]);
+  printf("  lost a path at the end in %d, failed in %d\n",lost,failed);
+}
+
+/* The value of field, in kB, from a /proc file of process pid, or -1 */
+static long proc_kb(pid_t pid, const char *file, const char *field)
+{
+  char path[64],line[256];
+  size_t len=strlen(field);
+  long kb=-1;
+  FILE *f;
+  snprintf(path,sizeof(path),"/proc/%d/%s",(int)pid,file);
+  f=fopen(path,"r");
+  if (!f) return -1;
+  while (fgets(line,sizeof(line),f))
+    if (!strncmp(line,field,len)&&(line[len]==':')) {
+      kb=atol(line+len+1);
+      break;
+    }
+  fclose(f);
+  return kb;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+  long x=*(const long *)a,y=*(const long *)b;
+  return (x>y)-(x<y);
+}
+
+static void print_kb(const char *name, long *kb, int n)
+{
+  long total=0;
+  int i;
+  if (kb[0]<0) {
+    printf("  %-6s not available\n",name);
+    return;
+  }
+  for (i=0;i<n;++i) total+=kb[i];
+  qsort(kb,n,sizeof(kb[0]),compare_long);
+  printf("  %-6s %9ld %9ld %9ld %9ld\n",name,kb[0],kb[n/2],kb[n-1],total);
+}
+
+/* Start n proxies against the instant server and wait for the banner
+ * from each, so they all sit in the relay, then read their memory use.
+ */
+static void bench_footprint(char **proxy, int nr_options, int n)
+{
+  enum server_mode mode=INSTANT;
+  pid_t *pids=calloc(n,sizeof(*pids));
+  int *fds=calloc(2*n,sizeof(*fds));
+  long *rss=calloc(n,sizeof(*rss));
+  long *pss=calloc(n,sizeof(*pss));
+  int i;
+
+  if (!pids||!fds||!rss||!pss) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i=0;i<n;++i) {
+    char c;
+    pids[i]=start_proxy(proxy,nr_options,NULL,&mode,1,fds+2*i,fds+2*i+1,
+                        NULL);
+    if (read(fds[2*i+1],&c,1)!=1) {
+      printf("  proxy %d failed\n",i);
+      n=i+1;
+      break;
+    }
+  }
+  /* Let the resolver threads and whatever else was started settle */
+  usleep(200000);
+  for (i=0;i<n;++i) {
+    rss[i]=proc_kb(pids[i],"status","VmRSS");
+    pss[i]=proc_kb(pids[i],"smaps_rollup","Pss");
+  }
+  printf("Memory of %d idle relays in kB\n",n);
+  printf("  %-6s %9s %9s %9s %9s\n","","min","median","max","total");
+  print_kb("RSS",rss,n);
+  print_kb("PSS",pss,n);
+  for (i=0;i<n;++i) {
+    kill(pids[i],SIGTERM);
+    waitpid(pids[i],NULL,0);
+    close(fds[2*i]);
+    close(fds[2*i+1]);
+  }
+  free(pids);
+  free(fds);
+  free(rss);
+  free(pss);
+}
+
+int main(int argc, char **argv)
+{
+  static const enum server_mode orderings[][4]={
+    {INSTANT,NR_MODES},
+    {DELAYED,NR_MODES},
+    {INSTANT,INSTANT,NR_MODES},
+    {DELAYED,INSTANT,NR_MODES},
+    {BLACKHOLE,INSTANT,NR_MODES},
+    {RESET,INSTANT,NR_MODES},
+    {GARBAGE,INSTANT,NR_MODES},
+    {BLACKHOLE,BLACKHOLE,INSTANT,NR_MODES},
+  };
+  static char *splice[]={"-s",NULL};
+  int c,i,n;
+
+  while ((c=getopt(argc,argv,"+n:b:p:f:"))!=-1) {
+    switch(c) {
+    case 'n':
+      runs=atoi(optarg);
+      break;
+    case 'b':
+      bytes=atoll(optarg);
+      break;
+    case 'p':
+      peer=optarg;
+      break;
+    case 'f':
+      footprint=atoi(optarg);
+      if (footprint<1) argc=0;
+      break;
+    default:
+      argc=0;
+    }
+  }
+  if ((optind>=argc)||(runs<1)||(runs>1000)||(bytes<1)) {
+    fprintf(stderr,"Usage: %s [-n runs] [-b bytes] [-p peer] [-f proxies] "
+            "proxy [proxy options]\n",argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  argv+=optind;
+  argc-=optind;
+
+  unsetenv("SSH_MULTIPATH_PROXY_OPTIONS");
+  setenv("HOME","/nonexistent",1);
+  signal(SIGPIPE,SIG_IGN);
+  for (i=0;i<PEER;++i)
+    if (start_server(i)) {
+      stop_servers();
+      exit(EXIT_FAILURE);
+    }
+
+  if (peer&&start_peer()) {
+    stop_servers();
+    exit(EXIT_FAILURE);
+  }
+
+  if (footprint) {
+    bench_footprint(argv,argc-1,footprint);
+    stop_servers();
+    return 0;
+  }
+
+  printf("Time to first byte in ms, %d runs\n",runs);
+  printf("  %-36s %9s %9s %9s\n","","min","median","max");
+  for (i=0;i<(int)(sizeof(orderings)/sizeof(orderings[0]));++i) {
+    for (n=0;orderings[i][n]!=NR_MODES;++n);
+    bench_ttfb(argv,argc-1,orderings[i],n);
+  }
+
+  printf("Relay throughput, %lld bytes\n",bytes);
+  bench_relay(argv,argc-1,NULL,SINK);
+  bench_relay(argv,argc-1,NULL,SOURCE);
+  bench_relay(argv,argc-1,splice,SINK);
+  bench_relay(argv,argc-1,splice,SOURCE);
+
+  if (peer) bench_resume(argv,argc-1);
+
+  stop_servers();
+  return 0;
+}
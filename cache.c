@@ -0,0 +1,309 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "cache.h"
+
+#define CACHE_MAGIC 0x43504d53 /* "SMPC" */
+#define CACHE_VERSION 3
+#define CACHE_SLOTS 256
+#define CACHE_DEAD_SLOTS 64
+/* How far to look for a name before giving up, and how far to look for
+ * the least recently used slot to replace when adding a new one.
+ */
+#define CACHE_PROBE 16
+/* How long an address which failed is passed over, doubling with every
+ * failure in a row up to the maximum, in seconds.
+ */
+#define DEAD_MIN 10
+#define DEAD_MAX 600
+
+/* An address which failed recently, connecting from via */
+struct dead_entry {
+  struct sockaddr_storage addr;
+  char via[CACHE_VIA_MAX];
+  uint32_t addr_len;
+  uint32_t hash;
+  /* Failures in a row */
+  uint32_t strikes;
+  uint32_t pad;
+  /* Passed over until then, seconds since 1970 */
+  int64_t until;
+};
+
+struct cache_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t entry_size;
+};
+
+struct cache_file {
+  struct cache_header header;
+  struct cache_entry entries[CACHE_SLOTS];
+  struct dead_entry dead[CACHE_DEAD_SLOTS];
+};
+
+struct cache {
+  int fd;
+  struct cache_file *map;
+};
+
+static uint32_t hash_bytes(const void *p, size_t len)
+{
+  const unsigned char *b=p;
+  uint32_t h=2166136261u;
+  while (len--) {
+    h^=*b++;
+    h*=16777619u;
+  }
+  return h?h:1;
+}
+
+static uint32_t hash_name(const char *name)
+{
+  return hash_bytes(name,strlen(name));
+}
+
+char *cache_default_file(void)
+{
+  const char *dir=getenv("XDG_RUNTIME_DIR");
+  char *file=malloc(64+(dir?strlen(dir):0));
+  if (!file) return NULL;
+  if (dir&&*dir)
+    sprintf(file,"%s/ssh-multipath-proxy.cache",dir);
+  else
+    sprintf(file,"/tmp/ssh-multipath-proxy-%ld.cache",(long)getuid());
+  return file;
+}
+
+struct cache *cache_open(const char *file)
+{
+  struct cache *c;
+  struct stat st;
+  int fd=open(file,O_RDWR|O_CREAT|O_CLOEXEC|O_NOFOLLOW,0600);
+  if (fd==-1) {
+    perror(file);
+    return NULL;
+  }
+  c=malloc(sizeof(*c));
+  if (!c) {
+    close(fd);
+    return NULL;
+  }
+  c->fd=fd;
+
+  /* Someone else could feed us addresses through a file they own or can
+   * write to, in a shared /tmp for instance
+   */
+  if (fstat(fd,&st)||(st.st_uid!=getuid())||(st.st_mode&(S_IWGRP|S_IWOTH))) {
+    fprintf(stderr,"%s: Not a private file of ours, not used\n",file);
+    goto fail_unlocked;
+  }
+
+  /* Start over with an empty table if the file is not one of ours */
+  flock(fd,LOCK_EX);
+  if (fstat(fd,&st)||(st.st_size!=sizeof(struct cache_file))) {
+    if (ftruncate(fd,0)||ftruncate(fd,sizeof(struct cache_file))) {
+      perror(file);
+      goto fail;
+    }
+  }
+  c->map=mmap(NULL,sizeof(struct cache_file),PROT_READ|PROT_WRITE,
+	      MAP_SHARED,fd,0);
+  if (c->map==MAP_FAILED) {
+    perror("mmap");
+    goto fail;
+  }
+  if ((c->map->header.magic!=CACHE_MAGIC)||
+      (c->map->header.version!=CACHE_VERSION)||
+      (c->map->header.slots!=CACHE_SLOTS)||
+      (c->map->header.entry_size!=sizeof(struct cache_entry))) {
+    memset(c->map,0,sizeof(struct cache_file));
+    c->map->header.magic=CACHE_MAGIC;
+    c->map->header.version=CACHE_VERSION;
+    c->map->header.slots=CACHE_SLOTS;
+    c->map->header.entry_size=sizeof(struct cache_entry);
+  }
+  flock(fd,LOCK_UN);
+  return c;
+
+ fail:
+  flock(fd,LOCK_UN);
+ fail_unlocked:
+  close(fd);
+  free(c);
+  return NULL;
+}
+
+void cache_close(struct cache *c)
+{
+  if (!c) return;
+  munmap(c->map,sizeof(struct cache_file));
+  close(c->fd);
+  free(c);
+}
+
+/* Find the slot for name, or if create is set the slot to use for it.
+ * Must be called with the file locked.
+ */
+static struct cache_entry *cache_find(struct cache *c, const char *name,
+				      int create)
+{
+  uint32_t h=hash_name(name);
+  struct cache_entry *victim=NULL;
+  int i;
+  if (strlen(name)>=CACHE_NAME_MAX) return NULL;
+  for (i=0;i<CACHE_PROBE;++i) {
+    struct cache_entry *e=c->map->entries+(h+i)%CACHE_SLOTS;
+    if ((e->hash==h)&&!strcmp(e->name,name)) return e;
+    if (!victim||(e->last_used<victim->last_used)) victim=e;
+    if (!e->hash) break;
+  }
+  if (!create) return NULL;
+  memset(victim,0,sizeof(*victim));
+  victim->hash=h;
+  strcpy(victim->name,name);
+  return victim;
+}
+
+int cache_get(struct cache *c, const char *name, struct cache_entry *e)
+{
+  struct cache_entry *found;
+  flock(c->fd,LOCK_SH);
+  found=cache_find(c,name,0);
+  if (found) *e=*found;
+  flock(c->fd,LOCK_UN);
+  return found?0:-1;
+}
+
+void cache_success(struct cache *c, const char *name,
+		   const struct sockaddr *addr, socklen_t addr_len,
+		   uint32_t rtt)
+{
+  struct cache_entry *e;
+  if (addr_len>sizeof(e->addr)) return;
+  flock(c->fd,LOCK_EX);
+  e=cache_find(c,name,1);
+  if (e) {
+    memcpy(&e->addr,addr,addr_len);
+    e->addr_len=addr_len;
+    e->rtt=rtt;
+    e->failures=0;
+    e->last_success=e->last_used=time(NULL);
+  }
+  flock(c->fd,LOCK_UN);
+}
+
+void cache_failure(struct cache *c, const char *name)
+{
+  struct cache_entry *e;
+  flock(c->fd,LOCK_EX);
+  e=cache_find(c,name,1);
+  if (e) {
+    ++e->failures;
+    e->last_used=time(NULL);
+  }
+  flock(c->fd,LOCK_UN);
+}
+
+/* Find the slot of addr, or if create is set the slot to use for it.
+ * Must be called with the file locked.
+ */
+static struct dead_entry *dead_find(struct cache *c,
+				    const struct sockaddr *addr,
+				    socklen_t addr_len, const char *via,
+				    int create)
+{
+  uint32_t h;
+  struct dead_entry *victim=NULL;
+  int i;
+  if (!via) via="";
+  if ((addr_len>sizeof(victim->addr))||(strlen(via)>=CACHE_VIA_MAX))
+    return NULL;
+  h=hash_bytes(addr,addr_len)^hash_name(via);
+  for (i=0;i<CACHE_PROBE;++i) {
+    struct dead_entry *e=c->map->dead+(h+i)%CACHE_DEAD_SLOTS;
+    if ((e->hash==h)&&(e->addr_len==addr_len)&&
+	!memcmp(&e->addr,addr,addr_len)&&!strcmp(e->via,via))
+      return e;
+    if (!victim||(e->until<victim->until)) victim=e;
+    if (!e->hash) break;
+  }
+  if (!create) return NULL;
+  memset(victim,0,sizeof(*victim));
+  victim->hash=h;
+  memcpy(&victim->addr,addr,addr_len);
+  victim->addr_len=addr_len;
+  strcpy(victim->via,via);
+  return victim;
+}
+
+int cache_is_dead(struct cache *c, const struct sockaddr *addr,
+		  socklen_t addr_len, const char *via)
+{
+  struct dead_entry *e;
+  int dead;
+  flock(c->fd,LOCK_SH);
+  e=dead_find(c,addr,addr_len,via,0);
+  dead=e&&(e->until>time(NULL));
+  flock(c->fd,LOCK_UN);
+  return dead;
+}
+
+void cache_dead(struct cache *c, const struct sockaddr *addr,
+		socklen_t addr_len, const char *via)
+{
+  struct dead_entry *e;
+  int64_t now=time(NULL);
+  flock(c->fd,LOCK_EX);
+  e=dead_find(c,addr,addr_len,via,1);
+  if (e) {
+    int64_t t=DEAD_MIN;
+    uint32_t i;
+    /* Long enough ago to start over */
+    if (e->until+DEAD_MAX<now) e->strikes=0;
+    ++e->strikes;
+    for (i=1;(i<e->strikes)&&(t<DEAD_MAX);++i) t*=2;
+    e->until=now+((t<DEAD_MAX)?t:DEAD_MAX);
+  }
+  flock(c->fd,LOCK_UN);
+}
+
+void cache_alive(struct cache *c, const struct sockaddr *addr,
+		 socklen_t addr_len, const char *via)
+{
+  struct dead_entry *e;
+  flock(c->fd,LOCK_EX);
+  e=dead_find(c,addr,addr_len,via,0);
+  /* Keep the slot, later entries of the probe sequence may need it */
+  if (e) e->strikes=e->until=0;
+  flock(c->fd,LOCK_UN);
+}
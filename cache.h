@@ -0,0 +1,84 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+    Persistent history of earlier races, shared by all instances of the
+    proxy run by the same user. It is a small fixed size hash table in
+    a file which every process maps and updates under flock(). A second
+    table holds the addresses which failed recently.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define CACHE_NAME_MAX 128
+
+struct cache_entry {
+  char name[CACHE_NAME_MAX];
+  /* The address this name connected to the last time it won a race */
+  struct sockaddr_storage addr;
+  uint32_t addr_len;
+  /* Time from connect to SSH banner of that connection, in us */
+  uint32_t rtt;
+  /* Races this name took part in without winning since it last won */
+  uint32_t failures;
+  uint32_t hash;
+  /* When the entry was last won and last updated, seconds since 1970 */
+  int64_t last_success;
+  int64_t last_used;
+};
+
+struct cache;
+
+/* The default file, in $XDG_RUNTIME_DIR if it is set. The returned
+ * string must be freed.
+ */
+char *cache_default_file(void);
+
+struct cache *cache_open(const char *file);
+void cache_close(struct cache *c);
+
+/* Copy the entry for name into e, returns -1 if there is none */
+int cache_get(struct cache *c, const char *name, struct cache_entry *e);
+
+void cache_success(struct cache *c, const char *name,
+		   const struct sockaddr *addr, socklen_t addr_len,
+		   uint32_t rtt);
+void cache_failure(struct cache *c, const char *name);
+
+#define CACHE_VIA_MAX 64
+
+/* Whether addr failed recently enough to be passed over, when
+ * connecting from via, the source of the host or NULL.
+ */
+int cache_is_dead(struct cache *c, const struct sockaddr *addr,
+		  socklen_t addr_len, const char *via);
+/* addr failed, pass it over for 10s, twice as long with every failure
+ * in a row, up to 10 minutes.
+ */
+void cache_dead(struct cache *c, const struct sockaddr *addr,
+		socklen_t addr_len, const char *via);
+void cache_alive(struct cache *c, const struct sockaddr *addr,
+		 socklen_t addr_len, const char *via);
+
+#endif
@@ -0,0 +1,1014 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+#include "event.h"
+#include "daemon.h"
+
+/* A request is a header, then the key and the arguments, each
+ * terminated by a zero byte. Stdin, stdout and stderr of the client
+ * come along with it.
+ */
+struct request_header {
+  uint32_t len;
+  uint32_t argc;
+};
+
+#define MAX_REQUEST 65536
+/* Clients whose request is still on its way, and how long it may take */
+#define MAX_CLIENTS 64
+#define CLIENT_TIMEOUT 1000000
+
+/* Sent by a session child when it has a winner */
+struct notice {
+  int host;
+  uint32_t addr_len;
+  struct sockaddr_storage addr;
+};
+
+#define MAX_DESTINATIONS 64
+/* After the network changed, how long to wait for it to settle before
+ * probing, and how recently a destination must have been used to be
+ * probed.
+ */
+#define PROBE_DELAY 1000000
+#define PROBE_IDLE 3600000000LL
+
+/* A connection opened ahead of time, and what it has received so far.
+ * Once ready its SSH identification line has arrived.
+ */
+struct spare {
+  int fd;
+  int64_t created;
+  int ready;
+  char banner[DAEMON_BANNER_MAX];
+  size_t banner_len;
+};
+
+/* What we know about one list of hosts */
+struct destination {
+  char *key;
+  /* The arguments of the session which last found a winner */
+  char **argv;
+  int argc;
+  int host;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  struct spare spares[DAEMON_POOL_MAX];
+  int nr_spares;
+  int64_t last_used;
+};
+
+/* A client which has connected, but whose request has not all arrived.
+ * buf is NULL until the header with the client's stdio has.
+ */
+struct client {
+  int conn;
+  int64_t accepted;
+  int fds[3];
+  struct request_header header;
+  char *buf;
+  size_t got;
+};
+
+/* conn is -1 for a probe, which has no client */
+struct session {
+  pid_t pid;
+  int conn;
+  int notify;
+  char *key;
+  char **argv;
+  int argc;
+};
+
+static struct event_loop *ev;
+static int listen_fd=-1;
+static int sigchld_pipe[2]={-1,-1};
+static struct destination destinations[MAX_DESTINATIONS];
+static int nr_destinations=0;
+static struct session *sessions=NULL;
+static int nr_sessions=0;
+static int sessions_size=0;
+static struct client clients[MAX_CLIENTS];
+static int nr_clients=0;
+static struct pool_options pool;
+static int (*connect_standby)(const struct sockaddr *, socklen_t);
+/* Tells about changes of addresses and routes, and when to probe */
+static int monitor_fd=-1;
+static int64_t probe_at=0;
+
+static int64_t now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*(int64_t)1000000+tv.tv_usec;
+}
+
+char *daemon_default_socket(void)
+{
+  const char *dir=getenv("XDG_RUNTIME_DIR");
+  char *file=malloc(64+(dir?strlen(dir):0));
+  if (!file) return NULL;
+  if (dir&&*dir)
+    sprintf(file,"%s/ssh-multipath-proxy.sock",dir);
+  else
+    sprintf(file,"/tmp/ssh-multipath-proxy-%ld.sock",(long)getuid());
+  return file;
+}
+
+static int make_address(const char *path, struct sockaddr_un *sun)
+{
+  if (strlen(path)>=sizeof(sun->sun_path)) {
+    fprintf(stderr,"%s: Path too long\n",path);
+    return -1;
+  }
+  memset(sun,0,sizeof(*sun));
+  sun->sun_family=AF_UNIX;
+  strcpy(sun->sun_path,path);
+  return 0;
+}
+
+/* A copy of argv in one block, to be freed with free() */
+static char **copy_argv(int argc, char **argv)
+{
+  size_t len=(argc+1)*sizeof(*argv);
+  char **copy;
+  char *p;
+  int i;
+  for (i=0;i<argc;++i) len+=strlen(argv[i])+1;
+  copy=malloc(len);
+  if (!copy) return NULL;
+  p=(char *)(copy+argc+1);
+  for (i=0;i<argc;++i) {
+    copy[i]=strcpy(p,argv[i]);
+    p+=strlen(p)+1;
+  }
+  copy[argc]=NULL;
+  return copy;
+}
+
+/* Remove spare k of d from the pool, closing it unless keep is set */
+static void remove_spare(struct destination *d, int k, int keep)
+{
+  ev_del(ev,d->spares[k].fd);
+  if (!keep) close(d->spares[k].fd);
+  d->spares[k]=d->spares[--d->nr_spares];
+}
+
+/* Let the kernel probe idle spares, so a path that has gone away is
+ * noticed before a session gets handed a dead connection.
+ */
+static void set_health_check(int fd)
+{
+  int one=1;
+  int secs=(pool.check+999999)/1000000;
+  int count=2;
+  if (!pool.check) return;
+  setsockopt(fd,SOL_SOCKET,SO_KEEPALIVE,&one,sizeof(one));
+#if defined(TCP_KEEPIDLE)
+  setsockopt(fd,IPPROTO_TCP,TCP_KEEPIDLE,&secs,sizeof(secs));
+#elif defined(TCP_KEEPALIVE)
+  setsockopt(fd,IPPROTO_TCP,TCP_KEEPALIVE,&secs,sizeof(secs));
+#endif
+#ifdef TCP_KEEPINTVL
+  setsockopt(fd,IPPROTO_TCP,TCP_KEEPINTVL,&secs,sizeof(secs));
+#endif
+#ifdef TCP_KEEPCNT
+  setsockopt(fd,IPPROTO_TCP,TCP_KEEPCNT,&count,sizeof(count));
+#endif
+  (void)secs;
+  (void)count;
+}
+
+/* Open connections to the last winner of d until the pool is full */
+static void fill_pool(struct destination *d, int64_t now)
+{
+  while (d->addr_len&&(d->nr_spares<pool.size)) {
+    struct spare *sp=d->spares+d->nr_spares;
+    sp->fd=connect_standby((struct sockaddr *)&d->addr,d->addr_len);
+    if (sp->fd==-1) return;
+    set_health_check(sp->fd);
+    /* Readable when the banner arrives, and when the connection fails
+     * or the server closes it.
+     */
+    if (ev_add(ev,sp->fd,EV_READ)) {
+      close(sp->fd);
+      return;
+    }
+    sp->created=now;
+    sp->ready=0;
+    sp->banner_len=0;
+    ++d->nr_spares;
+  }
+}
+
+/* Something arrived on a spare. It should be the banner, anything else
+ * including the server closing the connection means the spare is no
+ * good.
+ */
+static void spare_event(struct destination *d, int k)
+{
+  struct spare *sp=d->spares+k;
+  int check;
+  ssize_t r=read(sp->fd,sp->banner+sp->banner_len,
+		 sizeof(sp->banner)-sp->banner_len);
+  if ((r==-1)&&(errno==EAGAIN)) return;
+  if (r<1) {
+    remove_spare(d,k,0);
+    return;
+  }
+  sp->banner_len+=r;
+  check=banner_check(sp->banner,sp->banner_len);
+  if (check<0) {
+    remove_spare(d,k,0);
+    return;
+  }
+  if (check>0) sp->ready=1;
+  /* The rest waits in the socket, from now on only a hangup counts */
+  if (sp->banner_len==sizeof(sp->banner)) ev_mod(ev,sp->fd,0);
+}
+
+/* Find the destination for key. With create, the least recently used
+ * one is replaced if the table is full.
+ */
+static struct destination *find_destination(const char *key, int create)
+{
+  struct destination *d;
+  int i;
+  for (i=0;i<nr_destinations;++i)
+    if (!strcmp(destinations[i].key,key)) return destinations+i;
+  if (!create) return NULL;
+  if (nr_destinations<MAX_DESTINATIONS) {
+    d=destinations+nr_destinations++;
+  } else {
+    d=destinations;
+    for (i=1;i<nr_destinations;++i)
+      if (destinations[i].last_used<d->last_used) d=destinations+i;
+    while (d->nr_spares) remove_spare(d,0,0);
+    free(d->key);
+    free(d->argv);
+  }
+  memset(d,0,sizeof(*d));
+  d->key=strdup(key);
+  if (!d->key) {
+    *d=destinations[--nr_destinations];
+    return NULL;
+  }
+  return d;
+}
+
+/* Take the best spare of d for a session: one whose banner has arrived
+ * if there is one, and the youngest among equals. Returns its fd or -1.
+ */
+static int take_spare(struct destination *d, struct daemon_session *session)
+{
+  int best=-1;
+  int k,fd;
+  for (k=0;k<d->nr_spares;++k) {
+    struct spare *sp=d->spares+k;
+    if ((best==-1)||(sp->ready>d->spares[best].ready)||
+	((sp->ready==d->spares[best].ready)&&
+	 (sp->created>d->spares[best].created)))
+      best=k;
+  }
+  if (best==-1) return -1;
+  fd=d->spares[best].fd;
+  session->banner_len=d->spares[best].banner_len;
+  memcpy(session->banner,d->spares[best].banner,session->banner_len);
+  remove_spare(d,best,1);
+  return fd;
+}
+
+/* Close spares which have reached the TTL. They are replaced if the
+ * destination has been used since they were opened, so the pool of a
+ * destination drains once it has not been used for a whole TTL.
+ */
+static void expire_spares(int64_t now)
+{
+  int i,k;
+  for (i=0;i<nr_destinations;++i) {
+    struct destination *d=destinations+i;
+    int refill=0;
+    for (k=0;k<d->nr_spares;++k)
+      if (now-d->spares[k].created>=pool.ttl) {
+	if (d->last_used>=d->spares[k].created) refill=1;
+	remove_spare(d,k--,0);
+      }
+    if (refill) fill_pool(d,now);
+  }
+}
+
+/* Microseconds until the next spare or client expires or the next
+ * probe, or -1
+ */
+static int64_t next_expiry(int64_t now)
+{
+  int64_t timeout=-1;
+  int i,k;
+  if (probe_at) timeout=(probe_at>now)?probe_at-now:1;
+  for (i=0;i<nr_clients;++i) {
+    int64_t t=clients[i].accepted+CLIENT_TIMEOUT-now;
+    if (t<1) t=1;
+    if ((timeout==-1)||(t<timeout)) timeout=t;
+  }
+  for (i=0;i<nr_destinations;++i)
+    for (k=0;k<destinations[i].nr_spares;++k) {
+      int64_t t=destinations[i].spares[k].created+pool.ttl-now;
+      if (t<1) t=1;
+      if ((timeout==-1)||(t<timeout)) timeout=t;
+    }
+  return timeout;
+}
+
+static void sigchld_handler(int sig)
+{
+  int saved=errno;
+  (void)sig;
+  write(sigchld_pipe[1],"",1);
+  errno=saved;
+}
+
+static void drop_client(int i)
+{
+  struct client *c=clients+i;
+  int k;
+  ev_del(ev,c->conn);
+  close(c->conn);
+  for (k=0;k<3;++k)
+    if (c->fds[k]!=-1) close(c->fds[k]);
+  free(c->buf);
+  clients[i]=clients[--nr_clients];
+}
+
+/* Clients which don't send their request right away are broken */
+static void expire_clients(int64_t now)
+{
+  int i;
+  for (i=0;i<nr_clients;++i)
+    if (now-clients[i].accepted>=CLIENT_TIMEOUT) drop_client(i--);
+}
+
+/* Take a new client, which is heard from once its request arrives */
+static void accept_client(void)
+{
+  struct client *c;
+  int conn=accept(listen_fd,NULL,NULL);
+  if (conn==-1) return;
+  fcntl(conn,F_SETFL,O_NONBLOCK);
+  fcntl(conn,F_SETFD,FD_CLOEXEC);
+  if ((nr_clients==MAX_CLIENTS)||ev_add(ev,conn,EV_READ)) {
+    close(conn);
+    return;
+  }
+  c=clients+nr_clients++;
+  c->conn=conn;
+  c->accepted=now_us();
+  c->fds[0]=c->fds[1]=c->fds[2]=-1;
+  c->buf=NULL;
+  c->got=0;
+}
+
+/* Read what has arrived of the request of c. Returns 1 once it is all
+ * there, with the client's stdio in c->fds, 0 if more is to come and
+ * -1 if the client is broken.
+ */
+static int read_request(struct client *c)
+{
+  union {
+    struct cmsghdr h;
+    char space[CMSG_SPACE(3*sizeof(int))];
+  } control;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  ssize_t r;
+
+  if (!c->buf) {
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base=&c->header;
+    iov.iov_len=sizeof(c->header);
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=control.space;
+    msg.msg_controllen=sizeof(control.space);
+    r=recvmsg(c->conn,&msg,MSG_CMSG_CLOEXEC);
+    if ((r==-1)&&((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)))
+      return 0;
+    for (cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg))
+      if ((cmsg->cmsg_level==SOL_SOCKET)&&(cmsg->cmsg_type==SCM_RIGHTS)&&
+	  (cmsg->cmsg_len==CMSG_LEN(3*sizeof(int))))
+	memcpy(c->fds,CMSG_DATA(cmsg),3*sizeof(int));
+    /* The header and the descriptors are sent in one go */
+    if ((r!=sizeof(c->header))||(c->fds[0]==-1)||!c->header.len||
+	(c->header.len>MAX_REQUEST)||!c->header.argc)
+      return -1;
+    c->buf=malloc(c->header.len);
+    if (!c->buf) return -1;
+  }
+  while (c->got<c->header.len) {
+    r=read(c->conn,c->buf+c->got,c->header.len-c->got);
+    if ((r==-1)&&((errno==EAGAIN)||(errno==EWOULDBLOCK)||(errno==EINTR)))
+      return 0;
+    if (r<1) return -1;
+    c->got+=r;
+  }
+  return 1;
+}
+
+/* Split the request in buf into the key, then exactly argc arguments.
+ * *argv points into buf.
+ */
+static int parse_request(char *buf, const struct request_header *header,
+			 char **key, int *argc, char ***argv)
+{
+  char *p=buf,*end=buf+header->len;
+  int i;
+  if (end[-1]) return -1;
+  *argv=malloc((header->argc+1)*sizeof(**argv));
+  if (!*argv) return -1;
+  *key=p;
+  p+=strlen(p)+1;
+  for (i=0;i<(int)header->argc;++i) {
+    if (p>=end) break;
+    (*argv)[i]=p;
+    p+=strlen(p)+1;
+  }
+  if ((i<(int)header->argc)||(p!=end)) {
+    free(*argv);
+    return -1;
+  }
+  (*argv)[i]=NULL;
+  *argc=header->argc;
+  return 0;
+}
+
+/* In the session child, drop everything belonging to the daemon and
+ * put the client's stdio in place.
+ */
+static void enter_session(int *fds, int conn)
+{
+  int i,k;
+  signal(SIGCHLD,SIG_DFL);
+  signal(SIGPIPE,SIG_DFL);
+  ev_free(ev);
+  close(listen_fd);
+  close(sigchld_pipe[0]);
+  close(sigchld_pipe[1]);
+  for (i=0;i<nr_sessions;++i) {
+    if (sessions[i].conn!=-1) close(sessions[i].conn);
+    if (sessions[i].notify!=-1) close(sessions[i].notify);
+  }
+  for (i=0;i<nr_clients;++i) {
+    close(clients[i].conn);
+    for (k=0;k<3;++k)
+      if (clients[i].fds[k]!=-1) close(clients[i].fds[k]);
+  }
+  if (monitor_fd!=-1) close(monitor_fd);
+  for (i=0;i<nr_destinations;++i)
+    for (k=0;k<destinations[i].nr_spares;++k)
+      close(destinations[i].spares[k].fd);
+  if (conn!=-1) close(conn);
+  /* The daemon keeps 0, 1 and 2 open, so none of fds is below 3 */
+  for (i=0;i<3;++i) {
+    dup2(fds[i],i);
+    close(fds[i]);
+  }
+}
+
+/* More of the request of client c has arrived, start its session once
+ * it is all there. Returns 1 in the child.
+ */
+static int start_session(struct daemon_session *session, int c)
+{
+  struct destination *d;
+  struct session *s;
+  char *buf,*key;
+  char **argv;
+  int fds[3];
+  int notify[2];
+  int conn,argc,i;
+  pid_t pid;
+
+  switch (read_request(clients+c)) {
+  case 0:
+    return 0;
+  case -1:
+    drop_client(c);
+    return 0;
+  }
+  if (parse_request(clients[c].buf,&clients[c].header,&key,&argc,&argv)) {
+    drop_client(c);
+    return 0;
+  }
+  /* The session has them now */
+  conn=clients[c].conn;
+  buf=clients[c].buf;
+  memcpy(fds,clients[c].fds,sizeof(fds));
+  ev_del(ev,conn);
+  clients[c]=clients[--nr_clients];
+
+  if (nr_sessions==sessions_size) {
+    int size=sessions_size?2*sessions_size:8;
+    s=realloc(sessions,size*sizeof(*s));
+    if (!s) goto fail;
+    sessions=s;
+    sessions_size=size;
+  }
+  if (pipe(notify)) goto fail;
+  fcntl(notify[0],F_SETFD,FD_CLOEXEC);
+  fcntl(notify[1],F_SETFD,FD_CLOEXEC);
+
+  session->standby_fd=-1;
+  session->standby_host=-1;
+  session->banner_len=0;
+  session->probe=0;
+  d=find_destination(key,0);
+  if (d) {
+    d->last_used=now_us();
+    expire_spares(d->last_used);
+    session->standby_fd=take_spare(d,session);
+    session->standby_host=d->host;
+  }
+
+  pid=fork();
+  if (pid==-1) {
+    perror("fork");
+    close(notify[0]);
+    close(notify[1]);
+    if (session->standby_fd!=-1) close(session->standby_fd);
+    goto fail;
+  }
+  if (!pid) {
+    enter_session(fds,conn);
+    close(notify[0]);
+    session->argc=argc;
+    session->argv=argv;
+    session->notify_fd=notify[1];
+    return 1;
+  }
+
+  for (i=0;i<3;++i) close(fds[i]);
+  if (session->standby_fd!=-1) close(session->standby_fd);
+  close(notify[1]);
+  if (d) fill_pool(d,d->last_used);
+  s=sessions+nr_sessions;
+  s->pid=pid;
+  s->conn=conn;
+  s->notify=notify[0];
+  s->key=strdup(key);
+  s->argv=copy_argv(argc,argv);
+  s->argc=argc;
+  if (!s->key||ev_add(ev,s->notify,EV_READ)) {
+    /* The session still runs, we just won't learn about its winner */
+    close(s->notify);
+    s->notify=-1;
+  }
+  ++nr_sessions;
+  free(buf);
+  free(argv);
+  return 0;
+
+ fail:
+  for (i=0;i<3;++i) close(fds[i]);
+  close(conn);
+  free(buf);
+  free(argv);
+  return 0;
+}
+
+/* A session found a winner, fill the pool of its hosts with
+ * connections to it for the next sessions to the same hosts.
+ */
+static void read_notice(struct session *s)
+{
+  struct destination *d;
+  struct notice n;
+  ssize_t r=read(s->notify,&n,sizeof(n));
+  ev_del(ev,s->notify);
+  close(s->notify);
+  s->notify=-1;
+  if ((r!=sizeof(n))||(n.addr_len>sizeof(n.addr))||!s->key) return;
+  d=find_destination(s->key,1);
+  if (!d) return;
+  /* Probes leave the arguments of the session they repeat */
+  if (s->argv) {
+    free(d->argv);
+    d->argv=s->argv;
+    d->argc=s->argc;
+    s->argv=NULL;
+  }
+  d->host=n.host;
+  memcpy(&d->addr,&n.addr,n.addr_len);
+  d->addr_len=n.addr_len;
+  d->last_used=now_us();
+  fill_pool(d,d->last_used);
+}
+
+/* Tell the clients of finished sessions how they went */
+static void reap_sessions(void)
+{
+  char drain[64];
+  int status;
+  pid_t pid;
+  while (read(sigchld_pipe[0],drain,sizeof(drain))>0);
+  while ((pid=waitpid(-1,&status,WNOHANG))>0) {
+    int i;
+    for (i=0;i<nr_sessions;++i)
+      if (sessions[i].pid==pid) break;
+    if (i==nr_sessions) continue;
+    status=WIFEXITED(status)?WEXITSTATUS(status):128+WTERMSIG(status);
+    if (sessions[i].conn!=-1) {
+      write(sessions[i].conn,&status,sizeof(status));
+      close(sessions[i].conn);
+    }
+    /* The notice may still be waiting in the pipe */
+    if (sessions[i].notify!=-1) read_notice(sessions+i);
+    free(sessions[i].key);
+    free(sessions[i].argv);
+    sessions[i]=sessions[--nr_sessions];
+  }
+}
+
+/* Subscribe to changes of links, addresses and routes, returns -1 where
+ * that isn't supported.
+ */
+static int open_monitor(void)
+{
+  int fd;
+#ifdef __linux__
+  struct sockaddr_nl snl;
+  fd=socket(AF_NETLINK,SOCK_RAW,NETLINK_ROUTE);
+  if (fd==-1) return -1;
+  memset(&snl,0,sizeof(snl));
+  snl.nl_family=AF_NETLINK;
+  snl.nl_groups=RTMGRP_LINK|RTMGRP_IPV4_IFADDR|RTMGRP_IPV6_IFADDR|
+    RTMGRP_IPV4_ROUTE|RTMGRP_IPV6_ROUTE;
+  if (bind(fd,(struct sockaddr *)&snl,sizeof(snl))) {
+    close(fd);
+    return -1;
+  }
+#elif defined(PF_ROUTE)
+  /* BSD routing socket, everything on it is a change */
+  fd=socket(PF_ROUTE,SOCK_RAW,AF_UNSPEC);
+  if (fd==-1) return -1;
+#else
+  return -1;
+#endif
+  fcntl(fd,F_SETFL,O_NONBLOCK);
+  fcntl(fd,F_SETFD,FD_CLOEXEC);
+  return fd;
+}
+
+/* Read what the monitor has, and schedule a probe if the network
+ * changed. Changes come in bursts, the probe waits for the first one
+ * to settle.
+ */
+static void monitor_event(void)
+{
+  char buf[8192];
+  int changed=0;
+  ssize_t r;
+  while ((r=recv(monitor_fd,buf,sizeof(buf),0))!=0) {
+#ifdef __linux__
+    struct nlmsghdr *h;
+    int len=r;
+    if (r==-1) {
+      /* Missed some, which surely means something changed */
+      if (errno==ENOBUFS) changed=1;
+      if ((errno==ENOBUFS)||(errno==EINTR)) continue;
+      break;
+    }
+    for (h=(struct nlmsghdr *)buf;NLMSG_OK(h,len);h=NLMSG_NEXT(h,len))
+      switch (h->nlmsg_type) {
+      case RTM_NEWLINK: case RTM_DELLINK:
+      case RTM_NEWADDR: case RTM_DELADDR:
+      case RTM_NEWROUTE: case RTM_DELROUTE:
+	changed=1;
+      }
+#else
+    if (r==-1) break;
+    changed=1;
+#endif
+  }
+  if (changed&&!probe_at) probe_at=now_us()+PROBE_DELAY;
+}
+
+/* Run the last session of d again in the background, without a
+ * client, so that the cache and the pool are up to date when the next
+ * session starts. The spares of d were opened over the old network and
+ * are dropped. Returns 1 in the child.
+ */
+static int start_probe(struct destination *d, struct daemon_session *session)
+{
+  struct session *s;
+  int fds[3]={-1,-1,-1};
+  int notify[2];
+  int i;
+  pid_t pid;
+
+  while (d->nr_spares) remove_spare(d,0,0);
+  if (nr_sessions==sessions_size) {
+    int size=sessions_size?2*sessions_size:8;
+    s=realloc(sessions,size*sizeof(*s));
+    if (!s) return 0;
+    sessions=s;
+    sessions_size=size;
+  }
+  for (i=0;i<3;++i)
+    if ((fds[i]=open("/dev/null",O_RDWR))==-1) goto fail;
+  if (pipe(notify)) goto fail;
+  fcntl(notify[0],F_SETFD,FD_CLOEXEC);
+  fcntl(notify[1],F_SETFD,FD_CLOEXEC);
+
+  pid=fork();
+  if (pid==-1) {
+    perror("fork");
+    close(notify[0]);
+    close(notify[1]);
+    goto fail;
+  }
+  if (!pid) {
+    enter_session(fds,-1);
+    close(notify[0]);
+    memset(session,0,sizeof(*session));
+    session->argc=d->argc;
+    session->argv=d->argv;
+    session->standby_fd=-1;
+    session->standby_host=-1;
+    session->notify_fd=notify[1];
+    session->probe=1;
+    return 1;
+  }
+
+  for (i=0;i<3;++i) close(fds[i]);
+  close(notify[1]);
+  s=sessions+nr_sessions;
+  s->pid=pid;
+  s->conn=-1;
+  s->notify=notify[0];
+  s->key=strdup(d->key);
+  s->argv=NULL;
+  if (!s->key||ev_add(ev,s->notify,EV_READ)) {
+    close(s->notify);
+    s->notify=-1;
+  }
+  ++nr_sessions;
+  return 0;
+
+ fail:
+  for (i=0;i<3;++i)
+    if (fds[i]!=-1) close(fds[i]);
+  return 0;
+}
+
+/* Probe every destination used lately. Returns 1 in a probe child. */
+static int run_probes(int64_t now, struct daemon_session *session)
+{
+  int i;
+  probe_at=0;
+  for (i=0;i<nr_destinations;++i) {
+    struct destination *d=destinations+i;
+    if (!d->argv||(now-d->last_used>PROBE_IDLE)) continue;
+    if (start_probe(d,session)) return 1;
+  }
+  return 0;
+}
+
+/* Listen on path, replacing a stale socket left by a daemon which is
+ * no longer running, but not one which is.
+ */
+static int open_listener(const char *path)
+{
+  struct sockaddr_un sun;
+  mode_t mask;
+  int fd;
+
+  if (make_address(path,&sun)) return -1;
+  fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if (fd==-1) {
+    perror("socket");
+    return -1;
+  }
+  if (!connect(fd,(struct sockaddr *)&sun,sizeof(sun))) {
+    fprintf(stderr,"%s: A daemon is already running\n",path);
+    close(fd);
+    return -1;
+  }
+  if (errno==ECONNREFUSED) unlink(path);
+  mask=umask(077);
+  if (bind(fd,(struct sockaddr *)&sun,sizeof(sun))||listen(fd,64)) {
+    perror(path);
+    umask(mask);
+    close(fd);
+    return -1;
+  }
+  umask(mask);
+  fcntl(fd,F_SETFL,O_NONBLOCK);
+  fcntl(fd,F_SETFD,FD_CLOEXEC);
+  return fd;
+}
+
+int daemon_run(const char *path, const struct pool_options *options,
+	       struct daemon_session *session,
+	       int (*connect_addr)(const struct sockaddr *, socklen_t))
+{
+  int fd;
+
+  /* Keep 0, 1 and 2 taken, so descriptors from clients never land on
+   * them before they are moved there.
+   */
+  while ((fd=open("/dev/null",O_RDWR))>=0&&(fd<3));
+  if (fd>2) close(fd);
+
+  pool=*options;
+  if (pool.size>DAEMON_POOL_MAX) pool.size=DAEMON_POOL_MAX;
+  connect_standby=connect_addr;
+  listen_fd=open_listener(path);
+  if (listen_fd==-1) return -1;
+  ev=ev_new();
+  if (!ev||pipe(sigchld_pipe)) {
+    perror("daemon");
+    return -1;
+  }
+  fcntl(sigchld_pipe[0],F_SETFL,O_NONBLOCK);
+  fcntl(sigchld_pipe[1],F_SETFL,O_NONBLOCK);
+  fcntl(sigchld_pipe[0],F_SETFD,FD_CLOEXEC);
+  fcntl(sigchld_pipe[1],F_SETFD,FD_CLOEXEC);
+  if (ev_add(ev,listen_fd,EV_READ)||ev_add(ev,sigchld_pipe[0],EV_READ)) {
+    perror("event loop");
+    return -1;
+  }
+  if (pool.monitor) {
+    monitor_fd=open_monitor();
+    if ((monitor_fd==-1)||ev_add(ev,monitor_fd,EV_READ)) {
+      perror("monitor");
+      return -1;
+    }
+  }
+  signal(SIGCHLD,sigchld_handler);
+  signal(SIGPIPE,SIG_IGN);
+
+  while (1) {
+    struct ev_event events[16];
+    int i,j,k,n;
+    n=ev_wait(ev,events,16,next_expiry(now_us()));
+    expire_spares(now_us());
+    expire_clients(now_us());
+    if (probe_at&&(probe_at<=now_us())&&run_probes(now_us(),session))
+      return 0;
+    for (j=0;j<n;++j) {
+      if (events[j].fd==listen_fd) {
+	accept_client();
+      } else if (events[j].fd==sigchld_pipe[0]) {
+	reap_sessions();
+      } else if (events[j].fd==monitor_fd) {
+	monitor_event();
+      } else {
+	for (i=0;i<nr_clients;++i)
+	  if (clients[i].conn==events[j].fd) {
+	    if (start_session(session,i)) return 0;
+	    goto next;
+	  }
+	for (i=0;i<nr_sessions;++i)
+	  if (sessions[i].notify==events[j].fd) {
+	    read_notice(sessions+i);
+	    break;
+	  }
+	for (i=0;i<nr_destinations;++i)
+	  for (k=0;k<destinations[i].nr_spares;++k)
+	    if (destinations[i].spares[k].fd==events[j].fd) {
+	      spare_event(destinations+i,k);
+	      goto next;
+	    }
+      }
+    next:
+      ;
+    }
+  }
+}
+
+int daemon_client(const char *path, const char *key, int argc, char **argv)
+{
+  union {
+    struct cmsghdr h;
+    char space[CMSG_SPACE(3*sizeof(int))];
+  } control;
+  struct request_header header;
+  struct sockaddr_un sun;
+  struct msghdr msg;
+  struct iovec iov[2];
+  struct cmsghdr *cmsg;
+  struct stat st;
+  int fds[3]={0,1,2};
+  char *buf,*p;
+  size_t len;
+  int fd,i,status;
+  ssize_t r;
+
+  /* Only talk to a daemon run by ourselves */
+  if (stat(path,&st)||!S_ISSOCK(st.st_mode)||(st.st_uid!=getuid()))
+    return -1;
+  if (make_address(path,&sun)) return -1;
+
+  len=strlen(key)+1;
+  for (i=0;i<argc;++i) len+=strlen(argv[i])+1;
+  if (len>MAX_REQUEST) return -1;
+  buf=malloc(len);
+  if (!buf) return -1;
+  p=buf;
+  strcpy(p,key);
+  p+=strlen(p)+1;
+  for (i=0;i<argc;++i) {
+    strcpy(p,argv[i]);
+    p+=strlen(p)+1;
+  }
+  header.len=len;
+  header.argc=argc;
+
+  fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if ((fd==-1)||connect(fd,(struct sockaddr *)&sun,sizeof(sun))) {
+    if (fd!=-1) close(fd);
+    free(buf);
+    return -1;
+  }
+
+  memset(&msg,0,sizeof(msg));
+  iov[0].iov_base=&header;
+  iov[0].iov_len=sizeof(header);
+  iov[1].iov_base=buf;
+  iov[1].iov_len=len;
+  msg.msg_iov=iov;
+  msg.msg_iovlen=2;
+  msg.msg_control=control.space;
+  msg.msg_controllen=sizeof(control.space);
+  cmsg=CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level=SOL_SOCKET;
+  cmsg->cmsg_type=SCM_RIGHTS;
+  cmsg->cmsg_len=CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg),fds,sizeof(fds));
+  r=sendmsg(fd,&msg,0);
+  free(buf);
+  if (r!=(ssize_t)(sizeof(header)+len)) {
+    close(fd);
+    return -1;
+  }
+
+  /* The daemon has the only other copies now, so ssh sees the end of
+   * the connection as soon as the session closes them.
+   */
+  close(0);
+  close(1);
+  do {
+    r=read(fd,&status,sizeof(status));
+  } while ((r==-1)&&(errno==EINTR));
+  close(fd);
+  return (r==sizeof(status))?status:EXIT_FAILURE;
+}
+
+void daemon_notify(int fd, int host, const struct sockaddr *addr,
+		   socklen_t addr_len)
+{
+  struct notice n;
+  memset(&n,0,sizeof(n));
+  n.host=host;
+  n.addr_len=addr_len;
+  memcpy(&n.addr,addr,addr_len);
+  write(fd,&n,sizeof(n));
+  close(fd);
+}
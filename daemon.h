@@ -0,0 +1,103 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+    Daemon mode. A long running instance listens on a unix socket, and
+    a proxy started with --use-daemon hands its stdio over to it instead
+    of racing on its own. Every session runs in a child of the daemon,
+    so it shares the cache with earlier sessions. For every list of
+    hosts the daemon keeps a pool of spare connections to the address
+    that won the last session, so a session can usually start out with
+    a connection whose banner has already arrived. With the monitor
+    on, a change of the network makes the daemon run the last session
+    of every list of hosts again in the background, to learn which of
+    them works best now.
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "banner.h"
+
+#define DAEMON_POOL_MAX 16
+#define DAEMON_BANNER_MAX SSH_BANNER_MAX
+
+struct pool_options {
+  /* Spare connections per list of hosts */
+  int size;
+  /* How long a spare is kept, in microseconds */
+  int64_t ttl;
+  /* Interval between keepalive probes of idle spares, 0 for none */
+  int64_t check;
+  /* Probe the destinations again when the network changes */
+  int monitor;
+};
+
+/* What a session child gets from the daemon */
+struct daemon_session {
+  int argc;
+  char **argv;
+  /* A connection in progress or established to host number
+   * standby_host, or -1.
+   */
+  int standby_fd;
+  int standby_host;
+  /* What the standby connection has received so far, which looks like
+   * the start of an SSH banner.
+   */
+  char banner[DAEMON_BANNER_MAX];
+  size_t banner_len;
+  /* Tell the daemon about the winner with daemon_notify */
+  int notify_fd;
+  /* Set for a probe after the network changed. There is no client,
+   * stdio is /dev/null, and the session should stop once it has told
+   * the daemon about the winner.
+   */
+  int probe;
+};
+
+/* The default socket, next to the default cache file. The returned
+ * string must be freed.
+ */
+char *daemon_default_socket(void);
+
+/* Run the daemon on the socket path. Returns -1 if that fails, and 0
+ * in a session child once its stdio has been replaced by the client's.
+ * connect_addr is used for spare connections, it returns the socket of
+ * a non-blocking connect or -1.
+ */
+int daemon_run(const char *path, const struct pool_options *pool,
+	       struct daemon_session *session,
+	       int (*connect_addr)(const struct sockaddr *, socklen_t));
+
+/* Hand stdio and the arguments over to the daemon, and wait for the
+ * session to finish. key tells the daemon which standby connection
+ * the session can use. Returns the exit status of the session, or -1
+ * if the daemon could not be reached, in which case nothing happened.
+ */
+int daemon_client(const char *path, const char *key, int argc, char **argv);
+
+void daemon_notify(int fd, int host, const struct sockaddr *addr,
+		   socklen_t addr_len);
+
+#endif
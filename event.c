@@ -0,0 +1,321 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include "event.h"
+
+#if defined(EV_USE_POLL)
+#elif defined(__linux__)
+#define EV_USE_EPOLL
+#include <sys/epoll.h>
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || \
+      defined(__DragonFly__) || defined(__APPLE__)
+#define EV_USE_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#else
+#define EV_USE_POLL
+#endif
+
+struct event_loop {
+#ifndef EV_USE_POLL
+  int kfd;
+#endif
+  /* With the poll backend this holds every descriptor. With epoll it
+   * holds the descriptors epoll refuses, which are always ready.
+   */
+  struct pollfd *pfd;
+  int nfds;
+  int cap;
+};
+
+static short to_poll(int events)
+{
+  return ((events&EV_READ)?POLLIN:0)|((events&EV_WRITE)?POLLOUT:0);
+}
+
+static int from_poll(short revents, short registered)
+{
+  if (revents&(POLLERR|POLLHUP|POLLNVAL)) revents|=registered;
+  return ((revents&POLLIN)?EV_READ:0)|((revents&POLLOUT)?EV_WRITE:0);
+}
+
+/* Descriptors without any events are stored complemented, so poll()
+ * ignores them instead of reporting hangups over and over.
+ */
+static void pfd_set(struct pollfd *p, int fd, int events)
+{
+  p->fd=(events&(EV_READ|EV_WRITE))?fd:~fd;
+  p->events=to_poll(events);
+  p->revents=0;
+}
+
+static int pfd_find(struct event_loop *ev, int fd)
+{
+  int i;
+  for (i=0;i<ev->nfds;++i)
+    if ((ev->pfd[i].fd==fd)||(ev->pfd[i].fd==~fd)) return i;
+  return -1;
+}
+
+static int pfd_add(struct event_loop *ev, int fd, int events)
+{
+  if (ev->nfds==ev->cap) {
+    int cap=ev->cap?2*ev->cap:8;
+    struct pollfd *p=realloc(ev->pfd,cap*sizeof(*p));
+    if (!p) return -1;
+    ev->pfd=p;
+    ev->cap=cap;
+  }
+  pfd_set(ev->pfd+ev->nfds,fd,events);
+  ++ev->nfds;
+  return 0;
+}
+
+static int pfd_del(struct event_loop *ev, int fd)
+{
+  int i=pfd_find(ev,fd);
+  if (i==-1) return -1;
+  ev->pfd[i]=ev->pfd[--ev->nfds];
+  return 0;
+}
+
+static int64_t timeout_ms(int64_t timeout)
+{
+  /* Round up, we would rather wake up late than spin */
+  return (timeout<0)?-1:(timeout+999)/1000;
+}
+
+struct event_loop *ev_new(void)
+{
+  struct event_loop *ev=calloc(1,sizeof(*ev));
+  if (!ev) return NULL;
+#ifdef EV_USE_EPOLL
+  ev->kfd=epoll_create1(EPOLL_CLOEXEC);
+#endif
+#ifdef EV_USE_KQUEUE
+  ev->kfd=kqueue();
+  if (ev->kfd!=-1) fcntl(ev->kfd,F_SETFD,FD_CLOEXEC);
+#endif
+#ifndef EV_USE_POLL
+  if (ev->kfd==-1) {
+    free(ev);
+    return NULL;
+  }
+#endif
+  return ev;
+}
+
+void ev_free(struct event_loop *ev)
+{
+  if (!ev) return;
+#ifndef EV_USE_POLL
+  close(ev->kfd);
+#endif
+  free(ev->pfd);
+  free(ev);
+}
+
+int ev_has_edge(struct event_loop *ev)
+{
+#ifdef EV_USE_POLL
+  (void)ev;
+  return 0;
+#else
+  (void)ev;
+  return 1;
+#endif
+}
+
+#ifdef EV_USE_EPOLL
+
+static int epoll_update(struct event_loop *ev, int op, int fd, int events)
+{
+  struct epoll_event e;
+  memset(&e,0,sizeof(e));
+  e.events=((events&EV_READ)?EPOLLIN:0)|((events&EV_WRITE)?EPOLLOUT:0)|
+    ((events&EV_EDGE)?EPOLLET:0);
+  /* Hangups are reported even when no events are wanted, make sure we
+   * only hear about them once.
+   */
+  if (!(events&(EV_READ|EV_WRITE))) e.events|=EPOLLET;
+  e.data.fd=fd;
+  return epoll_ctl(ev->kfd,op,fd,&e);
+}
+
+int ev_add(struct event_loop *ev, int fd, int events)
+{
+  if (!epoll_update(ev,EPOLL_CTL_ADD,fd,events)) return 0;
+  /* Regular files can't be polled, but they never block either */
+  if (errno==EPERM) return pfd_add(ev,fd,events);
+  return -1;
+}
+
+int ev_mod(struct event_loop *ev, int fd, int events)
+{
+  int i=pfd_find(ev,fd);
+  if (i!=-1) {
+    pfd_set(ev->pfd+i,fd,events);
+    return 0;
+  }
+  return epoll_update(ev,EPOLL_CTL_MOD,fd,events);
+}
+
+void ev_del(struct event_loop *ev, int fd)
+{
+  if (pfd_del(ev,fd)) epoll_ctl(ev->kfd,EPOLL_CTL_DEL,fd,NULL);
+}
+
+int ev_wait(struct event_loop *ev, struct ev_event *events, int max,
+	    int64_t timeout)
+{
+  struct epoll_event e[64];
+  int i,n,count=0;
+  if (max>64) max=64;
+  /* Descriptors epoll refused are always ready, don't sleep if any of
+   * them is waiting for something.
+   */
+  for (i=0;i<ev->nfds;++i)
+    if (ev->pfd[i].events) timeout=0;
+  n=epoll_wait(ev->kfd,e,max,timeout_ms(timeout));
+  if (n==-1) return -1;
+  for (i=0;i<n;++i) {
+    uint32_t r=e[i].events;
+    events[count].fd=e[i].data.fd;
+    if (r&(EPOLLERR|EPOLLHUP)) r|=EPOLLIN|EPOLLOUT;
+    events[count].events=((r&EPOLLIN)?EV_READ:0)|((r&EPOLLOUT)?EV_WRITE:0);
+    ++count;
+  }
+  for (i=0;(i<ev->nfds)&&(count<max);++i)
+    if (ev->pfd[i].events) {
+      events[count].fd=ev->pfd[i].fd;
+      events[count].events=from_poll(ev->pfd[i].events,0);
+      ++count;
+    }
+  return count;
+}
+
+#endif
+
+#ifdef EV_USE_KQUEUE
+
+/* Filters are only added while they are wanted, some descriptor types
+ * refuse filters that make no sense for them, like EVFILT_WRITE on the
+ * reading end of a pipe.
+ */
+static int kqueue_filter(struct event_loop *ev, int fd, short filter,
+			 int on, int edge)
+{
+  struct kevent k;
+  EV_SET(&k,fd,filter,on?(EV_ADD|EV_ENABLE|(edge?EV_CLEAR:0)):EV_DELETE,
+	 0,0,NULL);
+  if ((kevent(ev->kfd,&k,1,NULL,0,NULL)==-1)&&(on||(errno!=ENOENT)))
+    return -1;
+  return 0;
+}
+
+static int kqueue_update(struct event_loop *ev, int fd, int events)
+{
+  if (kqueue_filter(ev,fd,EVFILT_READ,events&EV_READ,events&EV_EDGE))
+    return -1;
+  return kqueue_filter(ev,fd,EVFILT_WRITE,events&EV_WRITE,events&EV_EDGE);
+}
+
+int ev_add(struct event_loop *ev, int fd, int events)
+{
+  return kqueue_update(ev,fd,events);
+}
+
+int ev_mod(struct event_loop *ev, int fd, int events)
+{
+  return kqueue_update(ev,fd,events);
+}
+
+void ev_del(struct event_loop *ev, int fd)
+{
+  kqueue_update(ev,fd,0);
+}
+
+int ev_wait(struct event_loop *ev, struct ev_event *events, int max,
+	    int64_t timeout)
+{
+  struct kevent k[64];
+  struct timespec ts;
+  int i,n;
+  if (max>64) max=64;
+  if (timeout>=0) {
+    ts.tv_sec=timeout/1000000;
+    ts.tv_nsec=(timeout%1000000)*1000;
+  }
+  n=kevent(ev->kfd,NULL,0,k,max,(timeout>=0)?&ts:NULL);
+  if (n==-1) return -1;
+  for (i=0;i<n;++i) {
+    events[i].fd=k[i].ident;
+    events[i].events=(k[i].filter==EVFILT_WRITE)?EV_WRITE:EV_READ;
+  }
+  return n;
+}
+
+#endif
+
+#ifdef EV_USE_POLL
+
+int ev_add(struct event_loop *ev, int fd, int events)
+{
+  return pfd_add(ev,fd,events);
+}
+
+int ev_mod(struct event_loop *ev, int fd, int events)
+{
+  int i=pfd_find(ev,fd);
+  if (i==-1) return -1;
+  pfd_set(ev->pfd+i,fd,events);
+  return 0;
+}
+
+void ev_del(struct event_loop *ev, int fd)
+{
+  pfd_del(ev,fd);
+}
+
+int ev_wait(struct event_loop *ev, struct ev_event *events, int max,
+	    int64_t timeout)
+{
+  int i,n,count=0;
+  n=poll(ev->pfd,ev->nfds,timeout_ms(timeout));
+  if (n==-1) return -1;
+  for (i=0;(i<ev->nfds)&&(count<max)&&n;++i)
+    if (ev->pfd[i].revents) {
+      int e=from_poll(ev->pfd[i].revents,ev->pfd[i].events);
+      --n;
+      if (!e) continue;
+      events[count].fd=ev->pfd[i].fd;
+      events[count].events=e;
+      ++count;
+    }
+  return count;
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+    Minimal event notification layer. Descriptors are registered once
+    and stay registered until removed, so waiting does not cost
+    anything per descriptor and there is no FD_SETSIZE limit.
+
+    The backend is epoll on Linux, kqueue on the BSDs and Mac OS X and
+    poll() everywhere else. Define EV_USE_POLL to force the poll()
+    backend.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdint.h>
+
+#define EV_READ  1
+#define EV_WRITE 2
+/* Only report a descriptor when it becomes ready, rather than for as
+ * long as it is ready. Ignored unless ev_has_edge() is true.
+ */
+#define EV_EDGE  4
+
+struct ev_event {
+  int fd;
+  int events;
+};
+
+struct event_loop;
+
+struct event_loop *ev_new(void);
+void ev_free(struct event_loop *ev);
+
+/* True if the backend honours EV_EDGE */
+int ev_has_edge(struct event_loop *ev);
+
+/* events is a combination of EV_READ, EV_WRITE and EV_EDGE. ev_mod
+ * replaces the previous set of events, including EV_EDGE. A descriptor
+ * must be removed with ev_del before it is closed.
+ */
+int ev_add(struct event_loop *ev, int fd, int events);
+int ev_mod(struct event_loop *ev, int fd, int events);
+void ev_del(struct event_loop *ev, int fd);
+
+/* Wait up to timeout microseconds, or forever if timeout is negative.
+ * Returns the number of entries stored in events, 0 on timeout and -1
+ * on error, including EINTR so the caller can recompute its timeout
+ * after a signal. The same descriptor may be reported in more than one
+ * entry. Errors and hangups are reported as every event the descriptor
+ * was registered for, so the next read or write will see them.
+ */
+int ev_wait(struct event_loop *ev, struct ev_event *events, int max,
+	    int64_t timeout);
+
+#endif
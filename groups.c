@@ -0,0 +1,333 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "groups.h"
+
+#define GROUPS_MAGIC 0x47504d53 /* "SMPG" */
+#define GROUPS_VERSION 2
+
+/* Followed by the table of buckets, each the offset of an entry or 0,
+ * and the entries: the hash of the name, then the name and the words
+ * of the group as one string, each NUL terminated, padded to 4 bytes.
+ */
+struct groups_header {
+  uint32_t magic;
+  uint32_t version;
+  /* Of the groups file it was compiled from, an edit within the same
+   * second or a file put in place by rename still shows
+   */
+  int64_t source_mtime;
+  int64_t source_mtime_nsec;
+  int64_t source_size;
+  uint64_t source_ino;
+  uint32_t buckets;
+  uint32_t size;
+};
+
+struct group {
+  char *name;
+  char *words;
+  uint32_t hash;
+};
+
+static uint32_t hash_name(const char *name)
+{
+  uint32_t h=2166136261u;
+  while (*name) {
+    h^=(unsigned char)*name++;
+    h*=16777619u;
+  }
+  return h?h:1;
+}
+
+static char *index_name(const char *file)
+{
+  char *index=malloc(strlen(file)+sizeof(".idx"));
+  if (index) sprintf(index,"%s.idx",file);
+  return index;
+}
+
+/* Turn line into a name and its words separated by single spaces, in
+ * place. Returns -1 for a comment or an empty line.
+ */
+static int parse_line(char *line, struct group *g)
+{
+  char *p=line;
+  char *out;
+  p+=strspn(p," \t\r\n");
+  if (!*p||(*p=='#')) return -1;
+  g->name=p;
+  p+=strcspn(p," \t\r\n");
+  if (*p) *p++=0;
+  g->words=out=p;
+  while (*(p+=strspn(p," \t\r\n"))) {
+    size_t len=strcspn(p," \t\r\n");
+    if (out!=g->words) *out++=' ';
+    memmove(out,p,len);
+    out+=len;
+    p+=len;
+  }
+  *out=0;
+  g->hash=hash_name(g->name);
+  return 0;
+}
+
+/* Read all groups of file, in order. The strings point into *text. */
+static int read_groups(const char *file, struct stat *st, char **text,
+		       struct group **groups, int *nr_groups)
+{
+  FILE *f=fopen(file,"r");
+  char *line,*next;
+  int n=0,size=0;
+  *groups=NULL;
+  *text=NULL;
+  if (!f) return -1;
+  if (fstat(fileno(f),st)||!(*text=malloc(st->st_size+1))||
+      (fread(*text,1,st->st_size,f)!=(size_t)st->st_size)) {
+    fclose(f);
+    free(*text);
+    return -1;
+  }
+  fclose(f);
+  (*text)[st->st_size]=0;
+  for (line=*text;line;line=next) {
+    struct group g;
+    next=strchr(line,'\n');
+    if (next) *next++=0;
+    if (parse_line(line,&g)) continue;
+    if (n==size) {
+      struct group *p;
+      size=size?2*size:64;
+      p=realloc(*groups,size*sizeof(*p));
+      if (!p) {
+	free(*groups);
+	free(*text);
+	return -1;
+      }
+      *groups=p;
+    }
+    (*groups)[n++]=g;
+  }
+  *nr_groups=n;
+  return 0;
+}
+
+/* Compile file into its index. When quiet a directory we may not write
+ * to is no error worth telling, the file is searched instead.
+ */
+static int compile_index(const char *file, int quiet)
+{
+  struct groups_header *h;
+  struct group *groups;
+  struct stat st;
+  char *text,*index,*tmp=NULL;
+  unsigned char *buf=NULL;
+  uint32_t *table;
+  size_t size,pos;
+  int n,i,fd=-1,result=-1;
+
+  if (read_groups(file,&st,&text,&groups,&n)) {
+    perror(file);
+    return -1;
+  }
+  index=index_name(file);
+  if (!index) goto out;
+  h=calloc(1,sizeof(*h));
+  if (!h) goto out;
+  h->magic=GROUPS_MAGIC;
+  h->version=GROUPS_VERSION;
+  h->source_mtime=st.st_mtim.tv_sec;
+  h->source_mtime_nsec=st.st_mtim.tv_nsec;
+  h->source_size=st.st_size;
+  h->source_ino=st.st_ino;
+  for (h->buckets=16;h->buckets<2*(uint32_t)n;h->buckets*=2);
+  size=sizeof(*h)+h->buckets*sizeof(uint32_t);
+  for (i=0;i<n;++i)
+    size+=(4+strlen(groups[i].name)+strlen(groups[i].words)+2+3)&~3;
+  h->size=size;
+  buf=calloc(1,size);
+  if (!buf) {
+    free(h);
+    goto out;
+  }
+  memcpy(buf,h,sizeof(*h));
+  table=(uint32_t *)(buf+sizeof(*h));
+  pos=sizeof(*h)+h->buckets*sizeof(uint32_t);
+  for (i=0;i<n;++i) {
+    uint32_t b=groups[i].hash&(h->buckets-1);
+    size_t name_len=strlen(groups[i].name)+1;
+    /* The first group of a name wins, as when searching the file */
+    while (table[b]&&strcmp((char *)buf+table[b]+4,groups[i].name))
+      b=(b+1)&(h->buckets-1);
+    if (table[b]) continue;
+    table[b]=pos;
+    memcpy(buf+pos,&groups[i].hash,4);
+    memcpy(buf+pos+4,groups[i].name,name_len);
+    strcpy((char *)buf+pos+4+name_len,groups[i].words);
+    pos+=(4+name_len+strlen(groups[i].words)+1+3)&~3;
+  }
+  free(h);
+
+  /* Replaced in one go, running proxies may be reading the old one */
+  tmp=malloc(strlen(index)+sizeof(".XXXXXX"));
+  if (!tmp) goto out;
+  sprintf(tmp,"%s.XXXXXX",index);
+  fd=mkstemp(tmp);
+  if (fd==-1) {
+    if (!quiet||((errno!=EACCES)&&(errno!=EPERM)&&(errno!=EROFS)))
+      perror(tmp);
+    goto out;
+  }
+  if ((write(fd,buf,size)!=(ssize_t)size)||fchmod(fd,0644)||
+      rename(tmp,index)) {
+    perror(index);
+    unlink(tmp);
+    goto out;
+  }
+  result=0;
+ out:
+  if (fd!=-1) close(fd);
+  free(tmp);
+  free(buf);
+  free(index);
+  free(groups);
+  free(text);
+  return result;
+}
+
+int groups_compile(const char *file)
+{
+  return compile_index(file,0);
+}
+
+/* Copy words into a NULL terminated array of its words */
+static int split_words(const char *words, char ***result)
+{
+  char *copy=strdup(words);
+  char **v;
+  char *p;
+  int n=0;
+  if (!copy) return -1;
+  for (p=copy;*p;++p) n+=(*p==' ');
+  v=malloc((n+2)*sizeof(*v));
+  if (!v) {
+    free(copy);
+    return -1;
+  }
+  n=0;
+  for (p=strtok(copy," ");p;p=strtok(NULL," ")) v[n++]=p;
+  v[n]=NULL;
+  *result=v;
+  return n;
+}
+
+/* Look name up in the index, if it is one of ours and up to date.
+ * Returns what groups_lookup does, or -2 if the index can't be used.
+ */
+static int lookup_index(const char *index, const struct stat *src,
+			const char *name, char ***words)
+{
+  const struct groups_header *h;
+  const unsigned char *map;
+  uint32_t hash=hash_name(name);
+  uint32_t b,i;
+  struct stat st;
+  int fd=open(index,O_RDONLY|O_CLOEXEC);
+  int result=-2;
+  if (fd==-1) return -2;
+  if (fstat(fd,&st)||(st.st_size<(off_t)sizeof(*h))) {
+    close(fd);
+    return -2;
+  }
+  map=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (map==MAP_FAILED) return -2;
+  h=(const struct groups_header *)map;
+  if ((h->magic!=GROUPS_MAGIC)||(h->version!=GROUPS_VERSION)||
+      (h->source_mtime!=src->st_mtim.tv_sec)||
+      (h->source_mtime_nsec!=src->st_mtim.tv_nsec)||
+      (h->source_size!=src->st_size)||(h->source_ino!=src->st_ino)||
+      (h->size!=st.st_size)||!h->buckets||(h->buckets&(h->buckets-1))||
+      (h->buckets>(st.st_size-sizeof(*h))/sizeof(uint32_t)))
+    goto out;
+  b=hash&(h->buckets-1);
+  for (i=0;i<h->buckets;++i,b=(b+1)&(h->buckets-1)) {
+    uint32_t pos,entry_hash;
+    const char *entry;
+    memcpy(&pos,map+sizeof(*h)+b*sizeof(uint32_t),4);
+    if (!pos) {
+      result=0;
+      break;
+    }
+    if (pos>st.st_size-6) break;
+    memcpy(&entry_hash,map+pos,4);
+    entry=(const char *)map+pos+4;
+    /* Both strings end before the end of the index */
+    if (!memchr(entry,0,st.st_size-pos-4)) break;
+    if (!memchr(entry+strlen(entry)+1,0,st.st_size-pos-4-strlen(entry)-1))
+      break;
+    if ((entry_hash==hash)&&!strcmp(entry,name)) {
+      result=split_words(entry+strlen(entry)+1,words);
+      break;
+    }
+  }
+ out:
+  munmap((void *)map,st.st_size);
+  return result;
+}
+
+int groups_lookup(const char *file, const char *name, char ***words)
+{
+  struct group *groups;
+  struct stat st;
+  char *index,*text;
+  int n,i,r;
+
+  if (stat(file,&st)) return (errno==ENOENT)?0:-1;
+  index=index_name(file);
+  if (!index) return -1;
+  r=lookup_index(index,&st,name,words);
+  if ((r==-2)&&!compile_index(file,1)) r=lookup_index(index,&st,name,words);
+  free(index);
+  if (r!=-2) return r;
+
+  /* No index, search the file itself */
+  if (read_groups(file,&st,&text,&groups,&n)) return -1;
+  r=0;
+  for (i=0;i<n;++i)
+    if (!strcmp(groups[i].name,name)) {
+      r=split_words(groups[i].words,words);
+      break;
+    }
+  free(groups);
+  free(text);
+  return r;
+}
@@ -0,0 +1,47 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+/*
+    Host groups: a file mapping destination names to the arguments to
+    use for them, so a ProxyCommand only has to name the destination.
+    Every line holds a name followed by its words, separated by
+    whitespace, lines starting with # are ignored.
+
+    The file is compiled into an index next to it, FILE.idx: a hash
+    table which is mapped and probed, so looking up a name costs the
+    same however many groups the file holds. The index is rebuilt when
+    the file has changed since it was compiled, if that isn't possible
+    the file itself is searched.
+ */
+
+#ifndef GROUPS_H
+#define GROUPS_H
+
+/* Look up name in file. Returns the number of words of its group and
+ * sets *words to a NULL terminated array of them which stays valid, 0
+ * if there is no such group or no file, -1 on error.
+ */
+int groups_lookup(const char *file, const char *name, char ***words);
+
+/* Compile the index of file, returns -1 on error */
+int groups_compile(const char *file);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "live.h"
+
+static char *live_file=NULL;
+
+char *live_default_dir(void)
+{
+  const char *dir=getenv("XDG_RUNTIME_DIR");
+  char *file=malloc(64+(dir?strlen(dir):0));
+  if (!file) return NULL;
+  if (dir&&*dir)
+    sprintf(file,"%s/ssh-multipath-proxy.live",dir);
+  else
+    sprintf(file,"/tmp/ssh-multipath-proxy-%ld.live",(long)getuid());
+  return file;
+}
+
+static void live_remove(void)
+{
+  unlink(live_file);
+}
+
+/* Whether dir is ours alone. It may be in /tmp, where anybody could
+ * have made it first.
+ */
+static int private_dir(const char *dir)
+{
+  struct stat st;
+  if (lstat(dir,&st)) return 0;
+  if (!S_ISDIR(st.st_mode)||(st.st_uid!=getuid())||
+      ((st.st_mode&07777)!=0700)) {
+    fprintf(stderr,"%s: Not a private directory of ours\n",dir);
+    return 0;
+  }
+  return 1;
+}
+
+int live_open(const char *dir, const char *path)
+{
+  struct live_page *page;
+  int fd;
+  if (mkdir(dir,0700)&&(errno!=EEXIST)) {
+    perror(dir);
+    return -1;
+  }
+  if (!private_dir(dir)) return -1;
+  live_file=malloc(strlen(dir)+32);
+  if (!live_file) return -1;
+  sprintf(live_file,"%s/%ld",dir,(long)getpid());
+  /* A page left by a killed session of the same pid is ours to replace */
+  unlink(live_file);
+  fd=open(live_file,O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_CLOEXEC,0600);
+  if (fd==-1) {
+    perror(live_file);
+    free(live_file);
+    live_file=NULL;
+    return -1;
+  }
+  if (ftruncate(fd,sizeof(*page))||
+      ((page=mmap(NULL,sizeof(*page),PROT_READ|PROT_WRITE,MAP_SHARED,
+		  fd,0))==MAP_FAILED)) {
+    perror(live_file);
+    close(fd);
+    unlink(live_file);
+    free(live_file);
+    live_file=NULL;
+    return -1;
+  }
+  close(fd);
+  page->pid=getpid();
+  snprintf(page->path,sizeof(page->path),"%s",path);
+  page->relay=*relay_stats;
+  /* Last, so a page is not shown before it is complete */
+  page->magic=LIVE_MAGIC;
+  relay_stats=&page->relay;
+  atexit(live_remove);
+  return 0;
+}
+
+/* What --top remembers of a session from one round to the next */
+struct row {
+  struct live_page page;
+  uint64_t rate[2];
+};
+
+static int64_t now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*(int64_t)1000000+tv.tv_usec;
+}
+
+/* Copy the page in file, returns -1 if it isn't one of a live session.
+ * Those left behind by sessions which were killed are removed.
+ */
+static int read_page(const char *file, struct live_page *page)
+{
+  const struct live_page *p;
+  struct stat st;
+  int fd=open(file,O_RDONLY|O_CLOEXEC);
+  if (fd==-1) return -1;
+  if (fstat(fd,&st)||(st.st_size<(off_t)sizeof(*p))||
+      ((p=mmap(NULL,sizeof(*p),PROT_READ,MAP_SHARED,fd,0))==MAP_FAILED)) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  *page=*p;
+  munmap((void *)p,sizeof(*p));
+  if (page->magic!=LIVE_MAGIC) return -1;
+  if (kill(page->pid,0)&&(errno==ESRCH)) {
+    unlink(file);
+    return -1;
+  }
+  page->path[sizeof(page->path)-1]=0;
+  return 0;
+}
+
+/* Read every page in dir into *rows. Returns -1, having said why, if dir
+ * can't be trusted or read.
+ */
+static int read_rows(const char *dir, struct row **rows, int *nr_rows)
+{
+  struct dirent *e;
+  DIR *d;
+  *nr_rows=0;
+  if (access(dir,F_OK)&&(errno==ENOENT)) return 0;
+  if (!private_dir(dir)) return -1;
+  d=opendir(dir);
+  if (!d) {
+    perror(dir);
+    return -1;
+  }
+  while ((e=readdir(d))) {
+    char file[4096];
+    struct row *r;
+    if ((e->d_name[0]<'0')||(e->d_name[0]>'9')) continue;
+    r=realloc(*rows,(*nr_rows+1)*sizeof(**rows));
+    if (!r) break;
+    *rows=r;
+    snprintf(file,sizeof(file),"%s/%s",dir,e->d_name);
+    if (!read_page(file,&r[*nr_rows].page)) ++*nr_rows;
+  }
+  closedir(d);
+  return 0;
+}
+
+static int by_rate(const void *a, const void *b)
+{
+  const struct row *x=a,*y=b;
+  uint64_t rx=x->rate[0]+x->rate[1],ry=y->rate[0]+y->rate[1];
+  return (rx<ry)?1:(rx>ry)?-1:(x->page.pid-y->page.pid);
+}
+
+/* n bytes in at most 6 characters */
+static const char *size_str(char *buf, uint64_t n)
+{
+  if (n<10000) sprintf(buf,"%u",(unsigned)n);
+  else if (n<(uint64_t)10000<<10) sprintf(buf,"%uk",(unsigned)(n>>10));
+  else if (n<(uint64_t)10000<<20) sprintf(buf,"%uM",(unsigned)(n>>20));
+  else sprintf(buf,"%uG",(unsigned)(n>>30));
+  return buf;
+}
+
+int live_top(const char *dir)
+{
+  struct row *rows=NULL,*last=NULL;
+  int nr_rows,nr_last=0;
+  int tty=isatty(1);
+  int64_t then=0;
+  while (1) {
+    int64_t now=now_us();
+    int i,k;
+    if (read_rows(dir,&rows,&nr_rows)) return -1;
+    /* Rates are over the last round, or the whole session in the first */
+    for (i=0;i<nr_rows;++i) {
+      struct row *r=rows+i;
+      const struct relay_stats *s=&r->page.relay;
+      int64_t since=now-(s->start.tv_sec*(int64_t)1000000+s->start.tv_usec);
+      for (k=0;(k<nr_last)&&(last[k].page.pid!=r->page.pid);++k);
+      r->rate[0]=r->rate[1]=0;
+      if (k<nr_last) {
+	int64_t t=now-then;
+	if (t>0) {
+	  r->rate[0]=(s->bytes[0]-last[k].page.relay.bytes[0])*1000000/t;
+	  r->rate[1]=(s->bytes[1]-last[k].page.relay.bytes[1])*1000000/t;
+	}
+      } else if (s->start.tv_sec&&(since>0)) {
+	r->rate[0]=s->bytes[0]*1000000/since;
+	r->rate[1]=s->bytes[1]*1000000/since;
+      }
+    }
+    qsort(rows,nr_rows,sizeof(*rows),by_rate);
+    if (tty) printf("\033[H\033[2J");
+    printf("%7s %6s %6s %6s %6s %6s %6s %6s %8s %8s  %s\n","PID","IN/s",
+	   "OUT/s","IN","OUT","BUFIN","BUFOUT","SHORT","STALLIN","STALLOUT",
+	   "PATH");
+    for (i=0;i<nr_rows;++i) {
+      const struct relay_stats *s=&rows[i].page.relay;
+      char b[8][16];
+      printf("%7ld %6s %6s %6s %6s %6s %6s %6s %7.1fs %7.1fs  %s\n",
+	     (long)rows[i].page.pid,size_str(b[0],rows[i].rate[0]),
+	     size_str(b[1],rows[i].rate[1]),size_str(b[2],s->bytes[0]),
+	     size_str(b[3],s->bytes[1]),size_str(b[4],s->high_water[0]),
+	     size_str(b[5],s->high_water[1]),size_str(b[6],s->short_writes),
+	     s->stalled[0]/1e6,s->stalled[1]/1e6,rows[i].page.path);
+    }
+    fflush(stdout);
+    if (!tty) break;
+    /* Keep this round to work out the rates of the next */
+    free(last);
+    last=rows;
+    nr_last=nr_rows;
+    rows=NULL;
+    then=now;
+    sleep(1);
+  }
+  free(rows);
+  free(last);
+  return 0;
+}
@@ -0,0 +1,61 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+    Live counters. With --live every session which gets as far as
+    relaying keeps its relay_stats in a file named after its pid in a
+    directory of the user, mapped shared, so they can be read while it
+    runs without a word to the session. The file is removed when the
+    session ends. ssh-multipath-proxy --top reads every file there and
+    shows which sessions move how much over which connection.
+ */
+
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <stdint.h>
+#include "stats.h"
+
+#define LIVE_MAGIC 0x564c504d /* "MPLV" */
+
+struct live_page {
+  uint32_t magic;
+  int32_t pid;
+  /* The connection, or connections when bonding, the session uses */
+  char path[256];
+  struct relay_stats relay;
+};
+
+/* $XDG_RUNTIME_DIR/ssh-multipath-proxy.live or a directory in /tmp */
+char *live_default_dir(void);
+
+/* Keep relay_stats in a page in dir from now on. dir has to be a
+ * directory of ours which nobody else can get at. Returns -1 if it
+ * isn't or the page can't be created, the counters stay private then.
+ */
+int live_open(const char *dir, const char *path);
+
+/* Show the sessions in dir, sorted by how much they move, once a
+ * second until interrupted, or a single time if stdout is not a
+ * terminal. Returns -1 if dir can't be read or is not private.
+ */
+int live_top(const char *dir);
+
+#endif
@@ -0,0 +1,1056 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <zlib.h>
+#include "event.h"
+#include "mpx.h"
+#include "stats.h"
+
+/* Frames read ahead on one path, and written to it in one go */
+#define PATH_FRAMES 4
+#define FRAME_SPACE (MPX_HEADER+MPX_FRAME_MAX)
+#define PATH_BUF (PATH_FRAMES*FRAME_SPACE)
+
+/* Only consider a path writable while it has less than this not yet
+ * sent, so data is spread according to how fast each path drains
+ * rather than how much its socket buffer holds.
+ */
+#define NOTSENT_LOWAT (128*1024)
+
+/* With resume: acknowledge this much, ping paths which have sent
+ * nothing for PING and give up on paths which have received nothing
+ * for PATH_TIMEOUT. A new path is connected every RECONNECT_DELAY
+ * while some are missing, with at most RECONNECTS under way.
+ */
+#define ACK_EVERY (2*MPX_FRAME_MAX)
+#define PING 2000000
+#define PATH_TIMEOUT (3*PING)
+#define RECONNECT_DELAY 250000
+#define RETRY_DELAY 1000000
+#define RECONNECTS 2
+
+/* With compression: what is read at once, and how much larger than
+ * that its deflated form can be when it doesn't compress.
+ */
+#define PLAIN_BUF (PATH_FRAMES*MPX_FRAME_MAX)
+#define DEFLATE_SLACK(n) (((n)>>6)+64)
+
+/* One descriptor and whether it is ready. Pipes and sockets are made
+ * non-blocking and assumed ready until a call says EAGAIN, anything
+ * else is only used right after the event loop reported it ready.
+ */
+struct endpoint {
+  int fd;
+  int nonblock;
+  int can_read;
+  int can_write;
+  int registered;
+};
+
+struct mpx_path {
+  struct endpoint e;
+  unsigned char in[PATH_BUF];
+  size_t in_len;
+  unsigned char out[PATH_BUF];
+  size_t out_start;
+  size_t out_len;
+  /* Written since the path was last reported writable */
+  int paced;
+  /* The other end closed it, which it only does when it is done */
+  int closed;
+  /* Bytes of MPX_BANNER yet to come on a path we connected ourselves */
+  int banner;
+  /* With resume: where the stream was when the path was added, whether
+   * the HELLO of the other end has arrived, and what has to be sent
+   * again on it before anything new.
+   */
+  uint64_t created;
+  int hello;
+  uint64_t replay;
+  uint64_t replay_end;
+  int replay_fin;
+  int fin;
+  int64_t last_sent;
+  int64_t last_received;
+};
+
+struct mpx {
+  struct event_loop *ev;
+  struct endpoint local[2];
+  struct endpoint control;
+  unsigned char id[MPX_ID_LEN];
+  struct mpx_path *paths[MPX_MAX_PATHS];
+  int nr_paths;
+  int next_path;
+  /* Offset of the next byte to send and to deliver */
+  uint64_t sent;
+  uint64_t received;
+  int in_eof;
+  int fin_queued;
+  int fin_received;
+  /* With resume: what has been sent from acked on, and how much we
+   * have acknowledged.
+   */
+  unsigned char *ring;
+  size_t ring_size;
+  uint64_t acked;
+  uint64_t ack_sent;
+  int64_t resume_timeout;
+  int64_t lost_since;
+  int (*reconnect)(void);
+  int64_t next_reconnect;
+  int want_paths;
+  /* Done and waiting for the other end to close the paths */
+  int closing;
+  /* With compression: the two streams, what is read before deflating
+   * and what has been inflated but not yet written.
+   */
+  int compress;
+  z_stream deflater;
+  z_stream inflater;
+  unsigned char *zin;
+  unsigned char *plain;
+  size_t plain_start;
+  size_t plain_len;
+  /* Inflating filled plain, and zlib may have more */
+  int inflating;
+};
+
+static int64_t now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return ((int64_t)tv.tv_sec)*((int64_t)1000000)+((int64_t)tv.tv_usec);
+}
+
+void mpx_encode(unsigned char *buf, int type, size_t len, uint64_t seq)
+{
+  int i;
+  buf[0]=type;
+  buf[1]=0;
+  buf[2]=len>>8;
+  buf[3]=len;
+  for (i=0;i<8;++i) buf[4+i]=seq>>(56-8*i);
+}
+
+int mpx_decode(const unsigned char *buf, size_t avail, struct mpx_frame *f)
+{
+  int i;
+  if (avail<MPX_HEADER) return 0;
+  f->type=buf[0];
+  f->flags=buf[1];
+  f->len=(buf[2]<<8)|buf[3];
+  f->seq=0;
+  for (i=0;i<8;++i) f->seq=(f->seq<<8)|buf[4+i];
+  f->payload=buf+MPX_HEADER;
+  if ((f->type<MPX_HELLO)||(f->type>MPX_ACK)||
+      (f->flags&&(f->type!=MPX_HELLO))||(f->len>MPX_FRAME_MAX))
+    return -1;
+  if (avail<MPX_HEADER+f->len) return 0;
+  return MPX_HEADER+f->len;
+}
+
+static void endpoint_init(struct endpoint *e, int fd)
+{
+  struct stat st;
+  e->fd=fd;
+  e->nonblock=!fstat(fd,&st)&&(S_ISFIFO(st.st_mode)||S_ISSOCK(st.st_mode));
+  if (e->nonblock) fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+  e->can_read=e->can_write=e->nonblock;
+  e->registered=0;
+}
+
+/* Record the outcome of a read or write on e. Returns 1 if it got
+ * EAGAIN, which is not an error.
+ */
+static int endpoint_did(struct endpoint *e, int event, ssize_t r)
+{
+  int again=(r==-1)&&((errno==EAGAIN)||(errno==EINTR));
+  if (!e->nonblock||again) {
+    if (event==EV_READ) e->can_read=0;
+    else e->can_write=0;
+  }
+  return again;
+}
+
+struct mpx *mpx_new(int local_in, int local_out, const unsigned char *id)
+{
+  struct mpx *m=calloc(1,sizeof(*m));
+  if (!m) return NULL;
+  m->ev=ev_new();
+  if (!m->ev) {
+    free(m);
+    return NULL;
+  }
+  endpoint_init(m->local,local_in);
+  endpoint_init(m->local+1,local_out);
+  m->control.fd=-1;
+  memcpy(m->id,id,MPX_ID_LEN);
+  if (ev_add(m->ev,local_in,0)||
+      ((local_out!=local_in)&&ev_add(m->ev,local_out,0))) {
+    ev_free(m->ev);
+    free(m);
+    return NULL;
+  }
+  return m;
+}
+
+int mpx_set_resume(struct mpx *m, size_t buffer, int64_t timeout,
+		   int (*reconnect)(void))
+{
+  m->ring=malloc(buffer);
+  if (!m->ring) return -1;
+  m->ring_size=buffer;
+  m->resume_timeout=timeout;
+  m->reconnect=reconnect;
+  m->lost_since=now_us();
+  return 0;
+}
+
+/* The ring holds the stream from acked to sent, at offset seq modulo
+ * its size.
+ */
+static void ring_copy(struct mpx *m, uint64_t seq, unsigned char *buf,
+		      size_t len, int to_ring)
+{
+  while (len) {
+    size_t pos=seq%m->ring_size;
+    size_t n=m->ring_size-pos;
+    if (n>len) n=len;
+    if (to_ring) memcpy(m->ring+pos,buf,n);
+    else memcpy(buf,m->ring+pos,n);
+    seq+=n;
+    buf+=n;
+    len-=n;
+  }
+}
+
+int mpx_set_compress(struct mpx *m)
+{
+  m->zin=malloc(PLAIN_BUF);
+  m->plain=malloc(PLAIN_BUF);
+  if (!m->zin||!m->plain||
+      (deflateInit2(&m->deflater,Z_DEFAULT_COMPRESSION,Z_DEFLATED,-15,8,
+		    Z_DEFAULT_STRATEGY)!=Z_OK))
+    return -1;
+  if (inflateInit2(&m->inflater,-15)!=Z_OK) {
+    deflateEnd(&m->deflater);
+    return -1;
+  }
+  m->compress=1;
+  return 0;
+}
+
+/* How much may be read from local_in. With compression it is less
+ * than the room for it, as not all of it may compress.
+ */
+static size_t ring_room(struct mpx *m)
+{
+  size_t room=PATH_FRAMES*MPX_FRAME_MAX;
+  if (m->ring) room=m->ring_size-(m->sent-m->acked);
+  if (!m->compress) return room;
+  if (room>PLAIN_BUF) room=PLAIN_BUF;
+  return (room>DEFLATE_SLACK(room))?room-DEFLATE_SLACK(room):0;
+}
+
+static int add_path(struct mpx *m, int fd, int banner)
+{
+  struct mpx_path *p;
+  int lowat=NOTSENT_LOWAT;
+  if (m->nr_paths==MPX_MAX_PATHS) return -1;
+  p=calloc(1,sizeof(*p));
+  if (!p) return -1;
+  endpoint_init(&p->e,fd);
+  if (ev_add(m->ev,fd,0)) {
+    free(p);
+    return -1;
+  }
+#ifdef TCP_NOTSENT_LOWAT
+  setsockopt(fd,IPPROTO_TCP,TCP_NOTSENT_LOWAT,&lowat,sizeof(lowat));
+#endif
+  (void)lowat;
+  p->banner=banner?3:0;
+  p->created=m->sent;
+  p->last_sent=p->last_received=now_us();
+  /* Every path starts with HELLO telling where it belongs */
+  mpx_encode(p->out,MPX_HELLO,MPX_ID_LEN,m->received);
+  if (m->ring) p->out[1]=MPX_F_RESUME;
+  if (m->compress) p->out[1]|=MPX_F_COMPRESS;
+  memcpy(p->out+MPX_HEADER,m->id,MPX_ID_LEN);
+  p->out_len=MPX_HELLO_LEN;
+  m->paths[m->nr_paths++]=p;
+  m->lost_since=0;
+  return 0;
+}
+
+int mpx_add_path(struct mpx *m, int fd)
+{
+  return add_path(m,fd,0);
+}
+
+/* A path is gone. That is the end of the session, unless it can be
+ * resumed on another path. Returns -1 if it can't.
+ */
+static int lose_path(struct mpx *m, int i)
+{
+  struct mpx_path *p=m->paths[i];
+  if (!m->ring) return -1;
+  /* Those we connected and never got to work are no news */
+  if (!p->banner) fprintf(stderr,"Lost a path, resuming the session\n");
+  ev_del(m->ev,p->e.fd);
+  close(p->e.fd);
+  free(p);
+  m->paths[i]=m->paths[--m->nr_paths];
+  if (m->next_path>=m->nr_paths) m->next_path=0;
+  if (!m->nr_paths) m->lost_since=now_us();
+  return 0;
+}
+
+void mpx_set_control(struct mpx *m, int fd)
+{
+  endpoint_init(&m->control,fd);
+  if (ev_add(m->ev,fd,0)) m->control.fd=-1;
+}
+
+int mpx_send_path(int control, int fd, const unsigned char *hello)
+{
+  union {
+    struct cmsghdr h;
+    char space[CMSG_SPACE(sizeof(int))];
+  } u;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  memset(&msg,0,sizeof(msg));
+  iov.iov_base=(void *)hello;
+  iov.iov_len=MPX_HELLO_LEN;
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  msg.msg_control=u.space;
+  msg.msg_controllen=sizeof(u.space);
+  cmsg=CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level=SOL_SOCKET;
+  cmsg->cmsg_type=SCM_RIGHTS;
+  cmsg->cmsg_len=CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg),&fd,sizeof(int));
+  return (sendmsg(control,&msg,0)==MPX_HELLO_LEN)?0:-1;
+}
+
+/* Returns the descriptor, -1 on error and -2 at end of file */
+static int recv_path(int control, unsigned char *hello)
+{
+  union {
+    struct cmsghdr h;
+    char space[CMSG_SPACE(sizeof(int))];
+  } u;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  int fd=-1;
+  ssize_t r;
+  memset(&msg,0,sizeof(msg));
+  iov.iov_base=hello;
+  iov.iov_len=MPX_HELLO_LEN;
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  msg.msg_control=u.space;
+  msg.msg_controllen=sizeof(u.space);
+  r=recvmsg(control,&msg,0);
+  if (r==0) return -2;
+  if (r==-1) return -1;
+  for (cmsg=CMSG_FIRSTHDR(&msg);cmsg;cmsg=CMSG_NXTHDR(&msg,cmsg))
+    if ((cmsg->cmsg_level==SOL_SOCKET)&&(cmsg->cmsg_type==SCM_RIGHTS))
+      memcpy(&fd,CMSG_DATA(cmsg),sizeof(int));
+  if ((r!=MPX_HELLO_LEN)&&(fd!=-1)) {
+    close(fd);
+    fd=-1;
+  }
+  return fd;
+}
+
+/* Take the next path from the control socket. Its HELLO goes first in
+ * what has been received on it, as if it had just arrived.
+ */
+static int take_path(struct mpx *m)
+{
+  unsigned char hello[MPX_HELLO_LEN];
+  int fd=recv_path(m->control.fd,hello);
+  if (fd<0) return fd;
+  if (add_path(m,fd,0)) {
+    close(fd);
+    return 0;
+  }
+  memcpy(m->paths[m->nr_paths-1]->in,hello,MPX_HELLO_LEN);
+  m->paths[m->nr_paths-1]->in_len=MPX_HELLO_LEN;
+  return 0;
+}
+
+/* Whether new data can go on p. A resumed path has to hear where to
+ * start from first, and say it again, so each path still carries the
+ * stream in increasing order.
+ */
+static int carries_data(struct mpx *m, struct mpx_path *p)
+{
+  return !p->closed&&!p->banner&&(p->hello||!p->created||!m->ring)&&
+    (p->hello||!m->compress)&&
+    (p->replay==p->replay_end)&&!p->replay_fin;
+}
+
+/* The next path to put data on: one which has written everything it
+ * had, taking turns among those.
+ */
+static struct mpx_path *path_for_data(struct mpx *m)
+{
+  int i;
+  for (i=0;i<m->nr_paths;++i) {
+    struct mpx_path *p=m->paths[(m->next_path+i)%m->nr_paths];
+    if (!p->out_len&&!p->paced&&carries_data(m,p)) {
+      m->next_path=(m->next_path+i+1)%m->nr_paths;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/* Read from local_in and deflate what was read into the frames of p,
+ * flushing it all out.
+ */
+static int send_compressed(struct mpx *m, struct mpx_path *p)
+{
+  ssize_t r=read(m->local[0].fd,m->zin,ring_room(m));
+  ++relay_stats->reads;
+  if (endpoint_did(m->local,EV_READ,r)) return 0;
+  if (r<1) {
+    m->in_eof=1;
+    return 1;
+  }
+  relay_stats->bytes[0]+=r;
+  m->deflater.next_in=m->zin;
+  m->deflater.avail_in=r;
+  p->out_start=0;
+  p->out_len=0;
+  /* The slack left by ring_room makes sure it all fits */
+  do {
+    unsigned char *frame=p->out+p->out_len;
+    size_t n;
+    m->deflater.next_out=frame+MPX_HEADER;
+    m->deflater.avail_out=MPX_FRAME_MAX;
+    deflate(&m->deflater,Z_SYNC_FLUSH);
+    n=MPX_FRAME_MAX-m->deflater.avail_out;
+    if (!n) break;
+    mpx_encode(frame,MPX_DATA,n,m->sent);
+    if (m->ring) ring_copy(m,m->sent,frame+MPX_HEADER,n,1);
+    p->out_len+=MPX_HEADER+n;
+    m->sent+=n;
+  } while (!m->deflater.avail_out&&(p->out_len+FRAME_SPACE<=PATH_BUF));
+  return 1;
+}
+
+/* Read from local_in straight into the frames of a path */
+static int send_data(struct mpx *m, struct mpx_path *p)
+{
+  struct iovec iov[PATH_FRAMES];
+  size_t room=ring_room(m);
+  ssize_t r;
+  size_t left;
+  int i,n;
+  if (m->compress) return send_compressed(m,p);
+  for (n=0;(n<PATH_FRAMES)&&room;++n) {
+    iov[n].iov_base=p->out+n*FRAME_SPACE+MPX_HEADER;
+    iov[n].iov_len=(room<MPX_FRAME_MAX)?room:MPX_FRAME_MAX;
+    room-=iov[n].iov_len;
+  }
+  r=readv(m->local[0].fd,iov,n);
+  ++relay_stats->reads;
+  if (endpoint_did(m->local,EV_READ,r)) return 0;
+  if (r<1) {
+    m->in_eof=1;
+    return 1;
+  }
+  /* Close the gaps left by a short read */
+  p->out_start=0;
+  p->out_len=0;
+  for (left=r,i=0;left;++i) {
+    size_t len=(left<iov[i].iov_len)?left:iov[i].iov_len;
+    memmove(p->out+p->out_len+MPX_HEADER,iov[i].iov_base,len);
+    mpx_encode(p->out+p->out_len,MPX_DATA,len,m->sent);
+    if (m->ring) ring_copy(m,m->sent,p->out+p->out_len+MPX_HEADER,len,1);
+    p->out_len+=MPX_HEADER+len;
+    m->sent+=len;
+    relay_stats->bytes[0]+=len;
+    left-=len;
+  }
+  return 1;
+}
+
+/* Put a frame without payload on p, if there is room */
+static int queue_frame(struct mpx_path *p, int type, uint64_t seq)
+{
+  if (p->closed||(p->out_start+p->out_len+MPX_HEADER>PATH_BUF)) return 0;
+  mpx_encode(p->out+p->out_start+p->out_len,type,0,seq);
+  p->out_len+=MPX_HEADER;
+  return 1;
+}
+
+static int queue_fin(struct mpx *m)
+{
+  int i;
+  for (i=0;i<m->nr_paths;++i) {
+    struct mpx_path *p=m->paths[i];
+    if (carries_data(m,p)&&queue_frame(p,MPX_FIN,m->sent)) {
+      p->fin=1;
+      m->fin_queued=1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Send again on p what it has to, from the ring */
+static int send_replay(struct mpx *m, struct mpx_path *p)
+{
+  int i;
+  if (p->replay<m->acked) p->replay=m->acked;
+  if (p->replay>p->replay_end) p->replay=p->replay_end;
+  for (i=0;(i<PATH_FRAMES)&&(p->replay<p->replay_end);++i) {
+    size_t n=p->replay_end-p->replay;
+    if (n>MPX_FRAME_MAX) n=MPX_FRAME_MAX;
+    mpx_encode(p->out+p->out_len,MPX_DATA,n,p->replay);
+    ring_copy(m,p->replay,p->out+p->out_len+MPX_HEADER,n,0);
+    p->out_len+=MPX_HEADER+n;
+    p->replay+=n;
+  }
+  if ((p->replay==p->replay_end)&&p->replay_fin&&
+      queue_frame(p,MPX_FIN,m->sent)) {
+    p->replay_fin=0;
+    p->fin=1;
+  }
+  return 1;
+}
+
+/* Returns -1 if the path failed */
+static int write_path(struct mpx_path *p, int *progress)
+{
+  /* A broken path is not worth dying for when it can be resumed */
+  ssize_t r=send(p->e.fd,p->out+p->out_start,p->out_len,MSG_NOSIGNAL);
+  ++relay_stats->writes;
+  if (endpoint_did(&p->e,EV_WRITE,r)) return 0;
+  if (r<1) return -1;
+  if ((size_t)r<p->out_len) ++relay_stats->short_writes;
+  p->out_start+=r;
+  p->out_len-=r;
+  if (!p->out_len) p->out_start=0;
+#ifdef TCP_NOTSENT_LOWAT
+  p->paced=1;
+#endif
+  p->last_sent=now_us();
+  *progress=1;
+  return 0;
+}
+
+/* Whether the FIN of the other end has arrived, delivered or not */
+static int fin_arrived(struct mpx *m)
+{
+  struct mpx_frame f;
+  size_t pos;
+  int i,size;
+  if (m->fin_received) return 1;
+  for (i=0;i<m->nr_paths;++i)
+    for (pos=0;(size=mpx_decode(m->paths[i]->in+pos,m->paths[i]->in_len-pos,&f))>0;pos+=size)
+      if (f.type==MPX_FIN) return 1;
+  return 0;
+}
+
+/* How many paths the other end has not closed */
+static int open_paths(struct mpx *m)
+{
+  int i,n=0;
+  for (i=0;i<m->nr_paths;++i) n+=!m->paths[i]->closed;
+  return n;
+}
+
+/* Returns -1 if the path failed */
+static int read_path(struct mpx *m, struct mpx_path *p, int *progress)
+{
+  ssize_t r=read(p->e.fd,p->in+p->in_len,PATH_BUF-p->in_len);
+  ++relay_stats->reads;
+  if (endpoint_did(&p->e,EV_READ,r)) return 0;
+  if (r==0) {
+    /* The other end of a session which can be resumed only closes
+     * paths once it is done sending. Once our FIN is out it closes them
+     * all, with its own FIN maybe still unread on another one.
+     */
+    if (m->ring&&!fin_arrived(m)&&!(m->fin_queued&&open_paths(m)>1))
+      return -1;
+    /* Everything sent on it has arrived, but nothing more will */
+    p->closed=1;
+    *progress=1;
+    return 0;
+  }
+  if (r<1) return -1;
+  p->last_received=now_us();
+  p->in_len+=r;
+  /* A path we connected ourselves starts with the banner */
+  while (p->banner&&p->in_len) {
+    if (p->in[0]!=MPX_BANNER[3-p->banner]) return -1;
+    --p->banner;
+    memmove(p->in,p->in+1,--p->in_len);
+  }
+  *progress=1;
+  return 0;
+}
+
+static void consume(struct mpx_path *p, size_t n)
+{
+  p->in_len-=n;
+  memmove(p->in,p->in+n,p->in_len);
+}
+
+/* The other end has received everything up to seq */
+static void got_ack(struct mpx *m, uint64_t seq)
+{
+  if ((seq>m->acked)&&(seq<=m->sent)) m->acked=seq;
+}
+
+/* HELLO on a path of a resumable session. What the other end is
+ * missing, and which was sent before the path came, goes on it again.
+ * It was written when the path came to the other end, which may have
+ * acknowledged more on another path since. Returns -1 if it claims
+ * more than was ever sent.
+ */
+static int got_hello(struct mpx *m, struct mpx_path *p,
+		     const struct mpx_frame *f)
+{
+  uint64_t seq=f->seq;
+  if (p->hello||!(f->flags&MPX_F_RESUME)) return 0;
+  p->hello=1;
+  if (seq>m->sent) return -1;
+  if (seq<m->acked) seq=m->acked;
+  got_ack(m,seq);
+  if (seq<p->created) {
+    p->replay=seq;
+    p->replay_end=p->created;
+  }
+  if (m->fin_queued&&!p->fin) p->replay_fin=1;
+  return 0;
+}
+
+/* Drop the frames at the start of p which have been delivered */
+static void drop_delivered(struct mpx *m, struct mpx_path *p)
+{
+  struct mpx_frame f;
+  size_t pos=0;
+  int size;
+  while ((size=mpx_decode(p->in+pos,p->in_len-pos,&f))>0&&
+	 (f.type==MPX_DATA)&&(f.seq+f.len<=m->received))
+    pos+=size;
+  consume(p,pos);
+}
+
+/* Inflate the data in iov, once what was inflated before is written,
+ * and write it to local_out. Returns -1 on error.
+ */
+static int deliver_compressed(struct mpx *m, struct mpx_path *p,
+			      struct iovec *iov, int n, int *progress)
+{
+  ssize_t r;
+  int i=0;
+  if (!m->plain_len&&(n||m->inflating)) {
+    z_stream *z=&m->inflater;
+    z->next_out=m->plain;
+    z->avail_out=PLAIN_BUF;
+    do {
+      z->next_in=(i<n)?iov[i].iov_base:NULL;
+      z->avail_in=(i<n)?iov[i].iov_len:0;
+      r=inflate(z,Z_SYNC_FLUSH);
+      if ((r!=Z_OK)&&(r!=Z_BUF_ERROR)) {
+	fprintf(stderr,"Bad compressed data from the peer\n");
+	return -1;
+      }
+      if (i<n) m->received+=iov[i].iov_len-z->avail_in;
+      if (z->avail_in) break;
+    } while (z->avail_out&&(++i<n));
+    m->inflating=!z->avail_out;
+    m->plain_start=0;
+    m->plain_len=PLAIN_BUF-z->avail_out;
+    drop_delivered(m,p);
+    *progress=1;
+  }
+  if (!m->plain_len||!m->local[1].can_write) return 0;
+
+  r=write(m->local[1].fd,m->plain+m->plain_start,m->plain_len);
+  ++relay_stats->writes;
+  if (endpoint_did(m->local+1,EV_WRITE,r)) return 0;
+  if (r<1) return -1;
+  if ((size_t)r<m->plain_len) ++relay_stats->short_writes;
+  m->plain_start+=r;
+  m->plain_len-=r;
+  relay_stats->bytes[1]+=r;
+  *progress=1;
+  return 0;
+}
+
+/* Deliver what continues the stream from the first frames waiting on
+ * path p. Returns -1 on error.
+ */
+static int deliver(struct mpx *m, struct mpx_path *p, int *progress)
+{
+  struct iovec iov[PATH_FRAMES];
+  struct mpx_frame f;
+  size_t pos=0,asked;
+  uint64_t next=m->received;
+  int n=0,i,size;
+  ssize_t r;
+
+  /* Gather the frames which follow each other in the buffer */
+  while ((n<PATH_FRAMES)&&(size=mpx_decode(p->in+pos,p->in_len-pos,&f))) {
+    if (size<0) return -1;
+    if ((f.type==MPX_DATA)&&(f.seq<=next)&&(f.seq+f.len>next)) {
+      iov[n].iov_base=(char *)f.payload+(next-f.seq);
+      iov[n].iov_len=f.seq+f.len-next;
+      next=f.seq+f.len;
+      ++n;
+      pos+=size;
+      continue;
+    }
+    if (n) break;
+    /* Anything which isn't new data is dealt with on its own */
+    if (f.type==MPX_HELLO) {
+      if (m->compress&&!(f.flags&MPX_F_COMPRESS)) {
+	fprintf(stderr,"The peer does not compress\n");
+	return -1;
+      }
+      if (m->ring&&got_hello(m,p,&f)) return -1;
+      /* Nothing compressed goes out before the peer has said yes */
+      if (m->compress) p->hello=1;
+      consume(p,size);
+      *progress=1;
+      continue;
+    }
+    if (f.type==MPX_ACK) {
+      got_ack(m,f.seq);
+      consume(p,size);
+      *progress=1;
+      continue;
+    }
+    if ((f.type==MPX_DATA)&&(f.seq+f.len<=next)) {
+      consume(p,size);
+      *progress=1;
+      continue;
+    }
+    /* It may come more than once on a resumed session */
+    if ((f.type==MPX_FIN)&&(f.seq==next)&&!m->plain_len&&!m->inflating) {
+      if (m->fin_received) {
+	/* Already done */
+      } else if (m->local[1].fd==m->local[0].fd) {
+	shutdown(m->local[1].fd,SHUT_WR);
+      } else {
+	ev_del(m->ev,m->local[1].fd);
+	close(m->local[1].fd);
+      }
+      m->fin_received=1;
+      consume(p,size);
+      *progress=1;
+      continue;
+    }
+    break;
+  }
+  if (m->compress) return deliver_compressed(m,p,iov,n,progress);
+  if (!n||m->fin_received||!m->local[1].can_write) return 0;
+
+  r=writev(m->local[1].fd,iov,n);
+  ++relay_stats->writes;
+  if (endpoint_did(m->local+1,EV_WRITE,r)) return 0;
+  if (r<1) return -1;
+  for (i=0,asked=0;i<n;++i) asked+=iov[i].iov_len;
+  if ((size_t)r<asked) ++relay_stats->short_writes;
+  m->received+=r;
+  relay_stats->bytes[1]+=r;
+  *progress=1;
+  drop_delivered(m,p);
+  return 0;
+}
+
+static int has_deliverable(struct mpx *m)
+{
+  struct mpx_frame f;
+  int i;
+  if (m->plain_len||m->inflating) return 1;
+  for (i=0;i<m->nr_paths;++i)
+    if ((mpx_decode(m->paths[i]->in,m->paths[i]->in_len,&f)>0)&&
+	(f.type==MPX_DATA)&&(f.seq<=m->received))
+      return 1;
+  return 0;
+}
+
+/* Both ends are done sending, or the other end would not have closed a
+ * path, so anything lost now needs no new one.
+ */
+static int shutting_down(struct mpx *m)
+{
+  return m->fin_queued&&(m->fin_received||(open_paths(m)<m->nr_paths));
+}
+
+/* Keep a resumable session going: drop paths which have gone quiet,
+ * ping those we have been quiet on, acknowledge what has arrived and
+ * connect new paths for those which were lost. Returns -1 when there
+ * has been no path for too long.
+ */
+static int check_paths(struct mpx *m, int *progress)
+{
+  int64_t now=now_us();
+  int i,connecting=0;
+  for (i=0;i<m->nr_paths;++i) {
+    struct mpx_path *p=m->paths[i];
+    if (p->closed) continue;
+    /* Unless we are not reading it anyway */
+    if ((p->in_len<PATH_BUF)&&(now-p->last_received>=PATH_TIMEOUT)) {
+      lose_path(m,i--);
+      *progress=1;
+      continue;
+    }
+    if (p->banner) ++connecting;
+    else if ((now-p->last_sent>=PING)&&!p->out_len&&!m->closing)
+      *progress|=queue_frame(p,MPX_ACK,m->received);
+  }
+  if ((m->received-m->ack_sent>=ACK_EVERY)&&!m->closing) {
+    for (i=0;i<m->nr_paths;++i)
+      if (!m->paths[i]->banner&&queue_frame(m->paths[i],MPX_ACK,m->received)) {
+	m->ack_sent=m->received;
+	*progress=1;
+	break;
+      }
+  }
+  if (m->reconnect&&(m->nr_paths<m->want_paths+connecting)&&
+      (connecting<RECONNECTS)&&(now>=m->next_reconnect)&&
+      !shutting_down(m)) {
+    int fd=m->reconnect();
+    if ((fd!=-1)&&add_path(m,fd,1)) close(fd);
+    m->next_reconnect=now+((fd!=-1)?RECONNECT_DELAY:RETRY_DELAY);
+    if (fd!=-1) *progress=1;
+  }
+  if (!m->nr_paths&&(now-m->lost_since>=m->resume_timeout)) return -1;
+  return 0;
+}
+
+/* When check_paths next has something to do */
+static int64_t next_check(struct mpx *m)
+{
+  int64_t next=0;
+  int i,connecting=0;
+#define AT(t) if (!next||((t)<next)) next=(t)
+  for (i=0;i<m->nr_paths;++i) {
+    struct mpx_path *p=m->paths[i];
+    if (p->closed) continue;
+    if (p->in_len<PATH_BUF) AT(p->last_received+PATH_TIMEOUT);
+    if (p->banner) ++connecting;
+    else if (!p->out_len&&!m->closing) AT(p->last_sent+PING);
+  }
+  if (m->reconnect&&(m->nr_paths<m->want_paths+connecting)&&
+      (connecting<RECONNECTS)&&!shutting_down(m))
+    AT(m->next_reconnect);
+  if (!m->nr_paths) AT(m->lost_since+m->resume_timeout);
+#undef AT
+  return next;
+}
+
+/* Do everything that can be done without waiting. Returns 1 when the
+ * session is over and -1 if it broke.
+ */
+static int work(struct mpx *m)
+{
+  int progress;
+  do {
+    struct mpx_path *p;
+    int i;
+    progress=0;
+
+    if ((m->control.fd!=-1)&&m->control.can_read) {
+      int r=take_path(m);
+      if (r==0) {
+	if (!m->control.nonblock) m->control.can_read=0;
+      } else if ((r==-1)&&endpoint_did(&m->control,EV_READ,-1)) {
+	/* Nothing yet */
+      } else {
+	/* No more paths will come */
+	ev_del(m->ev,m->control.fd);
+	close(m->control.fd);
+	m->control.fd=-1;
+      }
+      progress=1;
+    }
+
+    if (m->ring&&check_paths(m,&progress)) return -1;
+
+    if (!m->in_eof&&m->local[0].can_read&&ring_room(m)&&(p=path_for_data(m)))
+      progress|=send_data(m,p);
+    if (m->in_eof&&!m->fin_queued) progress|=queue_fin(m);
+
+    for (i=0;i<m->nr_paths;++i) {
+      p=m->paths[i];
+      if (!p->out_len&&!p->paced&&!p->banner&&
+	  ((p->replay<p->replay_end)||p->replay_fin))
+	progress|=send_replay(m,p);
+      if ((p->out_len&&!p->closed&&p->e.can_write&&write_path(p,&progress))||
+	  (!p->closed&&(p->in_len<PATH_BUF)&&p->e.can_read&&
+	   read_path(m,p,&progress))||
+	  deliver(m,p,&progress)) {
+	if (lose_path(m,i--)) return -1;
+	progress=1;
+      }
+    }
+
+    if (m->fin_queued&&m->fin_received) {
+      for (i=0;(i<m->nr_paths)&&(m->paths[i]->closed||!m->paths[i]->out_len);++i);
+      if ((i==m->nr_paths)&&!m->ring) return 1;
+      /* The other end may still be reading, and closing a path with
+       * pings in it would reset it. It closes when it is done too.
+       */
+      if ((i==m->nr_paths)&&!m->closing) {
+	for (i=0;i<m->nr_paths;++i) shutdown(m->paths[i]->e.fd,SHUT_WR);
+	m->closing=1;
+      }
+      for (i=0;(i<m->nr_paths)&&m->paths[i]->closed;++i);
+      if (m->closing&&(i==m->nr_paths)) return 1;
+    }
+    if (!progress&&!m->ring) {
+      /* Stuck if every path is gone and what we need never came */
+      for (i=0;(i<m->nr_paths)&&m->paths[i]->closed;++i);
+      if ((i==m->nr_paths)&&(m->control.fd==-1)&&!has_deliverable(m))
+	return -1;
+    }
+  } while (progress);
+  return 0;
+}
+
+static int set_interest(struct mpx *m, struct endpoint *e, int want)
+{
+  if (want==e->registered) return 0;
+  e->registered=want;
+  return ev_mod(m->ev,e->fd,want);
+}
+
+/* Ask the event loop about whatever we are waiting for */
+static int update_interest(struct mpx *m)
+{
+  int want_in=0,want_out=0;
+  int i;
+  if (!m->in_eof&&!m->local[0].can_read&&ring_room(m)) {
+    for (i=0;i<m->nr_paths;++i)
+      if (!m->paths[i]->out_len&&!m->paths[i]->paced) want_in=EV_READ;
+  }
+  if (!m->fin_received&&!m->local[1].can_write&&has_deliverable(m))
+    want_out=EV_WRITE;
+  if (m->local[0].fd==m->local[1].fd) {
+    if (set_interest(m,m->local,want_in|want_out)) return -1;
+  } else {
+    if (set_interest(m,m->local,want_in)||
+	(!m->fin_received&&set_interest(m,m->local+1,want_out)))
+      return -1;
+  }
+  if ((m->control.fd!=-1)&&
+      set_interest(m,&m->control,m->control.can_read?0:EV_READ))
+    return -1;
+  for (i=0;i<m->nr_paths;++i) {
+    struct mpx_path *p=m->paths[i];
+    int want=0;
+    if (!p->closed) {
+      if ((p->in_len<PATH_BUF)&&!p->e.can_read) want|=EV_READ;
+      if ((p->out_len&&!p->e.can_write)||p->paced) want|=EV_WRITE;
+    }
+    if (set_interest(m,&p->e,want)) return -1;
+  }
+  return 0;
+}
+
+static void mark_ready(struct endpoint *e, const struct ev_event *event)
+{
+  if (event->fd!=e->fd) return;
+  if (event->events&EV_READ) e->can_read=1;
+  if (event->events&EV_WRITE) e->can_write=1;
+}
+
+int mpx_run(struct mpx *m)
+{
+  int r,i,j,n;
+  /* Paths lost later are replaced up to this many */
+  m->want_paths=m->nr_paths;
+  while (!(r=work(m))) {
+    struct ev_event events[16];
+    int64_t timeout;
+    if (update_interest(m)) {
+      r=-1;
+      break;
+    }
+    if (m->ring&&(timeout=next_check(m))) {
+      timeout-=now_us();
+      if (timeout<1) timeout=1;
+    } else {
+      timeout=-1;
+    }
+    ++relay_stats->waits;
+    n=ev_wait(m->ev,events,16,timeout);
+    if ((n==-1)&&(errno!=EINTR)) {
+      r=-1;
+      break;
+    }
+    for (j=0;j<n;++j) {
+      mark_ready(m->local,events+j);
+      mark_ready(m->local+1,events+j);
+      mark_ready(&m->control,events+j);
+      for (i=0;i<m->nr_paths;++i) {
+	mark_ready(&m->paths[i]->e,events+j);
+	if ((events[j].fd==m->paths[i]->e.fd)&&(events[j].events&EV_WRITE))
+	  m->paths[i]->paced=0;
+      }
+    }
+  }
+  for (i=0;i<m->nr_paths;++i) {
+    close(m->paths[i]->e.fd);
+    free(m->paths[i]);
+  }
+  ev_free(m->ev);
+  if (m->compress) {
+    deflateEnd(&m->deflater);
+    inflateEnd(&m->inflater);
+  }
+  free(m->zin);
+  free(m->plain);
+  free(m->ring);
+  free(m);
+  return (r<0)?-1:0;
+}
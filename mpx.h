@@ -0,0 +1,138 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+    The framing used to spread one byte stream over several TCP
+    connections, paths, between ssh-multipath-proxy --bond and
+    ssh-multipath-peer.
+
+    Every path starts with the peer sending MPX_BANNER where an SSH
+    server would send its banner. Then both ends send frames, each a
+    header of MPX_HEADER bytes: the type, a zero byte, the payload
+    length as 16 bits and a 64 bit sequence number, all big endian.
+
+    The first frame on a path is HELLO, whose payload is the session id
+    the path belongs to and whose sequence number is how much of the
+    stream its sender has received. DATA frames carry the bytes of the
+    stream starting at the offset in their sequence number, and FIN
+    marks the end of the stream at its sequence number. A sender puts
+    the frames of one direction on each path in increasing order, so
+    the receiver only ever has to look at the first frame waiting on
+    each path to find the one which continues the stream.
+
+    A session which can be resumed is asked for with MPX_F_RESUME in the
+    second byte of HELLO. Both ends then keep what they have sent in a
+    ring until the other end acknowledges it with ACK, whose sequence
+    number is how much it has received. ACK is also sent as a ping on
+    paths which have been quiet for a while, so a path which stops
+    delivering is noticed. When a path is lost the client connects a
+    new one, and the HELLO on it says where the other end has to go
+    back to. What was sent since is sent again on the new path only.
+
+    A compressed session is asked for with MPX_F_COMPRESS, and the other
+    end says it has understood by setting it in its own HELLO. Each
+    direction is then one raw deflate stream, flushed after every read
+    so nothing waits for more input behind it, and the sequence numbers
+    count the compressed bytes.
+ */
+
+#ifndef MPX_H
+#define MPX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MPX_BANNER "MPX"
+#define MPX_HEADER 12
+#define MPX_FRAME_MAX 16384
+#define MPX_MAX_PATHS 8
+#define MPX_ID_LEN 16
+#define MPX_HELLO_LEN (MPX_HEADER+MPX_ID_LEN)
+/* The smallest buffer of a resumable session */
+#define MPX_MIN_RESUME (64*1024)
+
+enum {
+  MPX_HELLO=1,
+  MPX_DATA,
+  MPX_FIN,
+  MPX_ACK
+};
+
+/* Flags of HELLO */
+#define MPX_F_RESUME 1
+#define MPX_F_COMPRESS 2
+
+struct mpx_frame {
+  int type;
+  int flags;
+  size_t len;
+  uint64_t seq;
+  const unsigned char *payload;
+};
+
+void mpx_encode(unsigned char *buf, int type, size_t len, uint64_t seq);
+
+/* Decode the frame at the start of buf. Returns its total size, 0 if
+ * more bytes are needed and -1 if it is not a valid frame.
+ */
+int mpx_decode(const unsigned char *buf, size_t avail, struct mpx_frame *f);
+
+struct mpx;
+
+/* Relay between local_in and local_out, which may be the same socket,
+ * and the paths which are added. The session id is sent in HELLO on
+ * every path.
+ */
+struct mpx *mpx_new(int local_in, int local_out,
+		    const unsigned char *id);
+
+/* Make the session resumable, keeping up to buffer bytes which have
+ * not been acknowledged. Sessions with no path for timeout microseconds
+ * fail. reconnect, which is NULL on the peer, connects a new path and
+ * returns its non-blocking descriptor, or -1. Must come before any
+ * paths are added. Returns -1 if the buffer can't be allocated.
+ */
+int mpx_set_resume(struct mpx *m, size_t buffer, int64_t timeout,
+		   int (*reconnect)(void));
+
+/* Compress the session in both directions. Must come before any paths
+ * are added. Returns -1 if zlib can't be set up.
+ */
+int mpx_set_compress(struct mpx *m);
+
+/* Add a path whose banner has been dealt with. Returns -1 if there is
+ * no room for it.
+ */
+int mpx_add_path(struct mpx *m, int fd);
+
+/* Watch fd for new paths sent with mpx_send_path */
+void mpx_set_control(struct mpx *m, int fd);
+
+/* Pass a path on as SCM_RIGHTS along with the HELLO of MPX_HELLO_LEN
+ * bytes which was read from it.
+ */
+int mpx_send_path(int control, int fd, const unsigned char *hello);
+
+/* Run until both directions are finished. Returns 0, or -1 if the
+ * session broke, for example because a path failed.
+ */
+int mpx_run(struct mpx *m);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "resolve.h"
+#include "upstream.h"
+
+/* Split name, which is host, host:port, [host]:port or [host], in
+ * place. A host with more than one colon and no brackets is taken as
+ * an IPv6 address without a port. Any of them may be followed by
+ * @source, which is cut off, it is only used to connect. Returns the
+ * port, or NULL if there is none.
+ */
+static char *split_host_port(char **host)
+{
+  char *name=*host;
+  char *p=strrchr(name,'@');
+  if (p) *p=0;
+  if (*name=='[') {
+    p=strchr(name,']');
+    if (!p||(p[1]&&(p[1]!=':'))) return NULL;
+    *host=name+1;
+    *p=0;
+    return p[1]?p+2:NULL;
+  }
+  p=strrchr(name,':');
+  if (!p||(strchr(name,':')!=p)) return NULL;
+  *p=0;
+  return p+1;
+}
+
+/* Like resolve_host, but with numeric set only numeric addresses are
+ * accepted and names fail quietly.
+ */
+static struct addrinfo **resolve(const char *name, struct addrinfo **res,
+				 int numeric)
+{
+  char *copy=malloc(strlen(name)+1);
+  char *hostname;
+  const char *port,*default_port;
+  struct addrinfo hints;
+  struct addrinfo *ai;
+  struct addrinfo **list;
+  int n=0,i,r;
+
+  *res=NULL;
+  if (!copy) {
+    perror("malloc");
+    return NULL;
+  }
+  strcpy(copy,name);
+  /* Through a proxy it is the proxy we connect to */
+  hostname=upstream_proxy(copy,&default_port);
+  port=split_host_port(&hostname);
+  if (!port||!*port) port=default_port;
+
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=AF_UNSPEC;
+  hints.ai_socktype=SOCK_STREAM;
+  if (numeric) hints.ai_flags=AI_NUMERICHOST;
+  r=getaddrinfo(hostname,port,&hints,res);
+  if (r) {
+    if (!numeric) fprintf(stderr,"%s: %s\n",name,gai_strerror(r));
+    free(copy);
+    return NULL;
+  }
+  free(copy);
+
+  for (ai=*res;ai;ai=ai->ai_next) ++n;
+  list=malloc((n+1)*sizeof(*list));
+  if (!list) {
+    perror("malloc");
+    freeaddrinfo(*res);
+    *res=NULL;
+    return NULL;
+  }
+
+  /* Take the first unused address of the wanted family, or of any
+   * family once the wanted family has run out.
+   */
+  for (i=0;i<n;++i) {
+    int family=i?list[i-1]->ai_family:(*res)->ai_family;
+    struct addrinfo *pick=NULL;
+    for (ai=*res;ai;ai=ai->ai_next) {
+      int j,used=0;
+      for (j=0;j<i;++j) used|=(list[j]==ai);
+      if (used) continue;
+      if (!pick) pick=ai;
+      if (i&&(ai->ai_family!=family)) {
+        pick=ai;
+        break;
+      }
+    }
+    list[i]=pick;
+  }
+  list[n]=NULL;
+  return list;
+}
+
+/* Resolve a host name with an optional :port suffix to all of its
+ * addresses. The addresses are returned in an array ordered as
+ * described in RFC 8305: starting with the first address returned by
+ * getaddrinfo, alternating between the address families. The array is
+ * terminated by a NULL pointer, and *res must be freed with
+ * freeaddrinfo once the array is no longer needed.
+ */
+struct addrinfo **resolve_host(const char *name, struct addrinfo **res)
+{
+  return resolve(name,res,0);
+}
+
+static void lookup_done(struct lookup *l)
+{
+  gettimeofday(&l->resolved,NULL);
+  for (l->nr_addrs=0;l->addrs&&l->addrs[l->nr_addrs];++l->nr_addrs);
+  /* The write makes the results visible to the main thread */
+  write(l->notify_fd,&l->index,sizeof(l->index));
+}
+
+static void *lookup_thread(void *arg)
+{
+  struct lookup *l=arg;
+  l->addrs=resolve_host(l->name,&l->res);
+  lookup_done(l);
+  return NULL;
+}
+
+int lookup_start(struct lookup *lookups, int n)
+{
+  int fds[2];
+  int i;
+  pthread_attr_t attr;
+
+  if (pipe(fds)) {
+    perror("pipe");
+    return -1;
+  }
+  fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+  fcntl(fds[1],F_SETFD,FD_CLOEXEC);
+  fcntl(fds[0],F_SETFL,O_NONBLOCK);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+  for (i=0;i<n;++i) {
+    pthread_t thread;
+    lookups[i].res=NULL;
+    lookups[i].addrs=NULL;
+    lookups[i].done=0;
+    lookups[i].next=0;
+    lookups[i].index=i;
+    lookups[i].notify_fd=fds[1];
+    lookups[i].source=strrchr(lookups[i].name,'@');
+    if (lookups[i].source) ++lookups[i].source;
+    /* Addresses need neither a thread nor the resolver, which keeps
+     * the memory of both out of the process.
+     */
+    lookups[i].addrs=resolve(lookups[i].name,&lookups[i].res,1);
+    if (lookups[i].addrs) {
+      lookup_done(lookups+i);
+      continue;
+    }
+    /* Without a thread we can still do the lookup the slow way */
+    if (pthread_create(&thread,&attr,lookup_thread,lookups+i))
+      lookup_thread(lookups+i);
+  }
+  pthread_attr_destroy(&attr);
+  /* The write end is never closed, threads may still be using it */
+  return fds[0];
+}
+
+int lookup_collect(int fd, struct lookup *lookups)
+{
+  int index[16];
+  int count=0;
+  ssize_t r;
+  while ((r=read(fd,index,sizeof(index)))>0) {
+    int i;
+    for (i=0;i<r/(int)sizeof(int);++i) {
+      lookups[index[i]].done=1;
+      ++count;
+    }
+  }
+  return count;
+}
+
+void lookup_free(struct lookup *l)
+{
+  free(l->addrs);
+  if (l->res) freeaddrinfo(l->res);
+  l->addrs=NULL;
+  l->res=NULL;
+}
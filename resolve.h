@@ -0,0 +1,70 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+    Host name lookups. All hosts are looked up in parallel by one
+    thread each, and the main thread is told about every lookup that
+    finishes through a pipe, which it can wait for along with the
+    sockets.
+ */
+
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include <netdb.h>
+#include <sys/time.h>
+
+struct lookup {
+  const char *name;
+  /* What follows the @ of the name, which connections are bound to,
+   * or NULL.
+   */
+  const char *source;
+  /* Set once done is true. addrs is NULL if the lookup failed. */
+  struct addrinfo *res;
+  struct addrinfo **addrs;
+  int done;
+  /* When the lookup finished and how many addresses it found */
+  struct timeval resolved;
+  int nr_addrs;
+  /* Index in addrs of the next address to try */
+  int next;
+  /* Used by the lookup thread */
+  int index;
+  int notify_fd;
+};
+
+/* Resolve a host name with an optional :port and @source suffix, see
+ * resolve.c
+ */
+struct addrinfo **resolve_host(const char *name, struct addrinfo **res);
+
+/* Start looking up all n names. Returns a non-blocking descriptor which
+ * becomes readable when lookups finish, or -1 on error.
+ */
+int lookup_start(struct lookup *lookups, int n);
+
+/* Mark the lookups reported on fd as done, returns how many finished.
+ * fd can be closed once all of them have.
+ */
+int lookup_collect(int fd, struct lookup *lookups);
+
+void lookup_free(struct lookup *l);
+
+#endif
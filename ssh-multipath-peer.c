@@ -0,0 +1,340 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+    The server side of ssh-multipath-proxy --bond. It listens for the
+    paths of bonded sessions, answering MPX_BANNER where sshd would send
+    its banner, and groups them by the session id in their HELLO. For
+    every session it connects to sshd and relays between sshd and all
+    paths of the session, putting the stream back in order.
+
+    Usage: ssh-multipath-peer [-l address:port] [-t host:port]
+                              [-b buffer] [-r seconds]
+
+    By default it listens on port 2222 of all addresses and connects to
+    localhost:22. Each session runs in a child process, which the
+    listener hands later paths of the session to.
+
+    Sessions started with ssh-multipath-proxy --resume keep up to
+    buffer bytes, 1M by default, which the client has not acknowledged
+    yet, and wait up to 300 seconds for the client to come back when
+    all their paths are lost.
+
+    Sessions started with ssh-multipath-proxy --compress are compressed
+    in both directions.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "resolve.h"
+#include "mpx.h"
+
+struct session {
+  unsigned char id[MPX_ID_LEN];
+  pid_t pid;
+  int control;
+};
+
+static struct session *sessions=NULL;
+static int nr_sessions=0;
+static const char *target="localhost:22";
+static size_t resume_buffer=1024*1024;
+static int64_t resume_timeout=300000000;
+
+static void sigchld_handler(int sig)
+{
+  (void)sig;
+}
+
+static int open_listener(const char *addr)
+{
+  struct addrinfo *res=NULL;
+  struct addrinfo **list=NULL;
+  struct sockaddr_in6 any;
+  const struct sockaddr *sa;
+  socklen_t len;
+  int one=1,zero=0;
+  int fd;
+
+  if (addr) {
+    list=resolve_host(addr,&res);
+    if (!list||!list[0]) return -1;
+    sa=list[0]->ai_addr;
+    len=list[0]->ai_addrlen;
+  } else {
+    memset(&any,0,sizeof(any));
+    any.sin6_family=AF_INET6;
+    any.sin6_addr=in6addr_any;
+    any.sin6_port=htons(2222);
+    sa=(struct sockaddr *)&any;
+    len=sizeof(any);
+  }
+  fd=socket(sa->sa_family,SOCK_STREAM,0);
+  if (fd!=-1) {
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+    /* Take IPv4 connections on the same socket */
+    if (!addr) setsockopt(fd,IPPROTO_IPV6,IPV6_V6ONLY,&zero,sizeof(zero));
+    if (bind(fd,sa,len)||listen(fd,64)) {
+      close(fd);
+      fd=-1;
+    }
+  }
+  if (fd==-1) perror(addr?addr:"[::]:2222");
+  free(list);
+  if (res) freeaddrinfo(res);
+  return fd;
+}
+
+/* Connect to sshd, trying its addresses in turn */
+static int connect_target(void)
+{
+  struct addrinfo *res;
+  struct addrinfo **list=resolve_host(target,&res);
+  int i,fd=-1;
+  if (!list) return -1;
+  for (i=0;list[i];++i) {
+    fd=socket(list[i]->ai_family,list[i]->ai_socktype,list[i]->ai_protocol);
+    if (fd==-1) continue;
+    if (!connect(fd,list[i]->ai_addr,list[i]->ai_addrlen)) break;
+    close(fd);
+    fd=-1;
+  }
+  if (fd==-1) perror(target);
+  free(list);
+  freeaddrinfo(res);
+  return fd;
+}
+
+static void reap_sessions(void)
+{
+  pid_t pid;
+  int i;
+  while ((pid=waitpid(-1,NULL,WNOHANG))>0)
+    for (i=0;i<nr_sessions;++i)
+      if (sessions[i].pid==pid) {
+	close(sessions[i].control);
+	sessions[i]=sessions[--nr_sessions];
+	break;
+      }
+}
+
+/* A path which has been answered and is waiting for its HELLO */
+struct pending {
+  int fd;
+  unsigned char buf[MPX_HELLO_LEN];
+  size_t got;
+  time_t accepted;
+};
+
+#define MAX_PENDING 64
+#define HELLO_TIMEOUT 10
+
+static struct pending pending[MAX_PENDING];
+static int nr_pending=0;
+
+static void drop_pending(int i)
+{
+  close(pending[i].fd);
+  pending[i]=pending[--nr_pending];
+}
+
+/* Read what has arrived of the HELLO of pending path i. Returns 1 with
+ * the HELLO decoded in f once all of it is there, and drops the path if
+ * it turns out to be no good.
+ */
+static int read_hello(int i, struct mpx_frame *f)
+{
+  struct pending *p=pending+i;
+  ssize_t r=read(p->fd,p->buf+p->got,sizeof(p->buf)-p->got);
+  if ((r==-1)&&(errno==EAGAIN)) return 0;
+  if (r<1) {
+    drop_pending(i);
+    return 0;
+  }
+  p->got+=r;
+  if (p->got<sizeof(p->buf)) return 0;
+  if ((mpx_decode(p->buf,sizeof(p->buf),f)!=(int)sizeof(p->buf))||
+      (f->type!=MPX_HELLO)||(f->len!=MPX_ID_LEN)) {
+    drop_pending(i);
+    return 0;
+  }
+  return 1;
+}
+
+static struct session *start_session(const unsigned char *id, int flags,
+				     int listen_fd)
+{
+  struct session *s;
+  int pair[2];
+  pid_t pid;
+  int i;
+
+  s=realloc(sessions,(nr_sessions+1)*sizeof(*s));
+  if (!s) return NULL;
+  sessions=s;
+  if (socketpair(AF_UNIX,SOCK_STREAM,0,pair)) {
+    perror("socketpair");
+    return NULL;
+  }
+  pid=fork();
+  if (pid==-1) {
+    perror("fork");
+    close(pair[0]);
+    close(pair[1]);
+    return NULL;
+  }
+  if (!pid) {
+    struct mpx *m;
+    int fd;
+    close(listen_fd);
+    close(pair[0]);
+    for (i=0;i<nr_sessions;++i) close(sessions[i].control);
+    for (i=0;i<nr_pending;++i) close(pending[i].fd);
+    signal(SIGCHLD,SIG_DFL);
+    fd=connect_target();
+    if (fd==-1) _exit(EXIT_FAILURE);
+    m=mpx_new(fd,fd,id);
+    if (!m||((flags&MPX_F_RESUME)&&
+	     mpx_set_resume(m,resume_buffer,resume_timeout,NULL))||
+	((flags&MPX_F_COMPRESS)&&mpx_set_compress(m)))
+      _exit(EXIT_FAILURE);
+    mpx_set_control(m,pair[1]);
+    _exit(mpx_run(m)?EXIT_FAILURE:EXIT_SUCCESS);
+  }
+  close(pair[1]);
+  s=sessions+nr_sessions++;
+  memcpy(s->id,id,MPX_ID_LEN);
+  s->pid=pid;
+  s->control=pair[0];
+  fcntl(s->control,F_SETFD,FD_CLOEXEC);
+  return s;
+}
+
+int main(int argc, char **argv)
+{
+  struct sigaction sa;
+  const char *listen_addr=NULL;
+  int listen_fd;
+  int c;
+
+  while ((c=getopt(argc,argv,"l:t:b:r:"))!=-1) {
+    char *end;
+    switch(c) {
+    case 'l':
+      listen_addr=optarg;
+      break;
+    case 't':
+      target=optarg;
+      break;
+    case 'b':
+      resume_buffer=strtoul(optarg,&end,10);
+      if (*end=='k') resume_buffer<<=10,++end;
+      else if (*end=='M') resume_buffer<<=20,++end;
+      /* It has to hold more than the client acknowledges at once */
+      if (!*end&&(resume_buffer>=MPX_MIN_RESUME)) break;
+      fprintf(stderr,"%s: Bad buffer size %s\n",argv[0],optarg);
+      exit(EXIT_FAILURE);
+    case 'r':
+      resume_timeout=strtol(optarg,&end,10)*(int64_t)1000000;
+      if (!*end&&(resume_timeout>0)) break;
+      fprintf(stderr,"%s: Bad time %s\n",argv[0],optarg);
+      exit(EXIT_FAILURE);
+    default:
+      fprintf(stderr,"Usage: %s [-l address:port] [-t host:port] [-b buffer] [-r seconds]\n",argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  listen_fd=open_listener(listen_addr);
+  if (listen_fd==-1) exit(EXIT_FAILURE);
+  fcntl(listen_fd,F_SETFD,FD_CLOEXEC);
+
+  /* No SA_RESTART, so a finished session interrupts poll */
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler=sigchld_handler;
+  sigaction(SIGCHLD,&sa,NULL);
+  signal(SIGPIPE,SIG_IGN);
+
+  /* The client only sends HELLO once it has all its paths, so they
+   * wait here side by side rather than one after another.
+   */
+  while (1) {
+    struct pollfd fds[MAX_PENDING+1];
+    time_t now=time(NULL);
+    int i,n;
+    reap_sessions();
+    for (i=0;i<nr_pending;++i)
+      if (now-pending[i].accepted>HELLO_TIMEOUT) drop_pending(i--);
+    fds[0].fd=listen_fd;
+    fds[0].events=(nr_pending<MAX_PENDING)?POLLIN:0;
+    for (i=0;i<nr_pending;++i) {
+      fds[i+1].fd=pending[i].fd;
+      fds[i+1].events=POLLIN;
+    }
+    n=nr_pending;
+    if (poll(fds,n+1,1000)<1) continue;
+    /* Backwards, so dropped paths don't move those not yet looked at */
+    for (i=n-1;i>=0;--i) {
+      struct session *s=NULL;
+      struct pending p;
+      struct mpx_frame f;
+      int k;
+      if (!fds[i+1].revents||!read_hello(i,&f)) continue;
+      p=pending[i];
+      pending[i]=pending[--nr_pending];
+      f.payload=p.buf+MPX_HEADER;
+      for (k=0;k<nr_sessions;++k)
+	if (!memcmp(sessions[k].id,f.payload,MPX_ID_LEN)) s=sessions+k;
+      /* Where nothing has been received yet, there is nothing to resume */
+      if (!s&&!f.seq)
+	s=start_session(f.payload,f.flags,listen_fd);
+      if (!s)
+	fprintf(stderr,"Unknown session, dropping its path\n");
+      /* A session which has just ended can't take more paths */
+      else if (mpx_send_path(s->control,p.fd,p.buf))
+	fprintf(stderr,"Session ended, dropping its new path\n");
+      close(p.fd);
+    }
+    if (fds[0].revents) {
+      int fd=accept(listen_fd,NULL,NULL);
+      if (fd==-1) continue;
+      fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)|O_NONBLOCK);
+      if (write(fd,MPX_BANNER,3)!=3) {
+	close(fd);
+	continue;
+      }
+      pending[nr_pending].fd=fd;
+      pending[nr_pending].got=0;
+      pending[nr_pending].accepted=now;
+      ++nr_pending;
+    }
+  }
+}
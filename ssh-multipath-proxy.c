@@ -34,7 +34,23 @@
     optionally ends with "-- command" where command is an
     alternate proxy to use if all specified hosts fail. You can
     end the hostname with :portnumber to use a nonstandard port,
-    if none is specified 22 will be used.
+    if none is specified 22 will be used. IPv6 addresses are given
+    in brackets when followed by a port, as in [2001:db8::1]:2222.
+    A host written as socks5://proxy[:port]/host[:port] or
+    http-connect://proxy[:port]/host[:port] is reached through a SOCKS5
+    or HTTP proxy, in the race along with the others and relayed by the
+    proxy itself, instead of by a command like nc -X after the hosts
+    have failed. The request is sent as soon as the connection to the
+    proxy is made. The ports default to 1080 for SOCKS5, 8080 for HTTP
+    and 22 for the host. Proxies asking for a password are not
+    supported.
+    A host may end with @interface or @address to make its
+    connections leave through that interface or from that source
+    address, as in %h:%p@eth0 %h:%p@wwan0, so the race covers the
+    uplinks of a multi-homed client as well as the addresses of the
+    server. An interface is bound with SO_BINDTODEVICE where that is
+    allowed, or else by its address, which some policy routing must
+    then send out through it.
 
 
     If you want to be able to ssh from your laptop to your
@@ -62,17 +78,290 @@
 
 
     Features I'd like to add in the future:
-    - Support hostnames resolving to multiple IPs.
-    - Configurable timeouts.
-    - IPv6 support.
     - Configurable use of setsid() (startup/connected/never)
-    - Asynchronous DNS lookups
-    - TCP Keep Alive
+
+
+    Options:
+    -s, --splice   On Linux, relay data with splice() through a pair of
+                   pipes, so the payload never gets copied to user
+                   space. Used only when both stdin and stdout can be
+                   spliced, otherwise the ordinary relay is used.
+    --io-uring     On Linux 5.6 and later, relay data through io_uring.
+                   A read and a write per direction stay queued in the
+                   kernel, and a single system call hands over the ones
+                   which finished and waits for the next, instead of a
+                   wait, a read and a write for every chunk. Uses the
+                   buffers of --buffer-size, registered with the kernel
+                   if the memory lock limit allows it. Without kernel
+                   support the relay of --splice or the ordinary relay
+                   is used.
+    -b, --buffer-size=SIZE
+                   Size of the buffer used in each direction by the
+                   ordinary relay to start with, may be suffixed with
+                   k or M. The default is 8k.
+    --buffer-max=SIZE
+                   How large the buffers of the ordinary relay may grow
+                   together, 4M by default. A buffer grows while reads
+                   fill it and more is waiting, up to about twice the
+                   window the kernel measured for the connection, and
+                   shrinks back once traffic is light again, so typing
+                   costs little memory and bulk copies are not held
+                   back. With the size of --buffer-size the buffers
+                   stay fixed.
+    -a, --attempt-delay=TIME
+                   When a host resolves to more than one address, the
+                   addresses are tried one after another in the order
+                   of RFC 8305 (Happy Eyeballs), alternating between
+                   IPv6 and IPv4. This is how long to wait for a reply
+                   before the next address is tried, 250ms by default.
+                   TIME is in milliseconds unless suffixed with us or s.
+    --stagger=TIME
+                   How long to wait for a reply from one host before
+                   the next host is tried, one second by default.
+    --banner-timeout=TIME
+                   Give up on a connection which has not produced an
+                   SSH banner this long after the connect was started.
+                   By default connections are kept open for as long as
+                   the race goes on. A connection only wins once the
+                   whole identification line "SSH-x.y-..." has arrived,
+                   servers answering with anything else, like an HTTP
+                   proxy or a captive portal, are skipped.
+    --fan-out      Connect to every address of every host at once
+                   instead of one after another, and use the first
+                   banner. Costs a few extra SYNs, but on flaky
+                   networks the login takes one round trip to the
+                   fastest server instead of waiting out the stagger
+                   for every dead one. The losing connections are
+                   reset rather than closed, so the servers drop them
+                   at once.
+    --evaluate=TIME
+                   Instead of using the first connection to produce a
+                   banner, wait this long after it for the banners of
+                   the others, connecting all remaining hosts at once,
+                   and use the one with the lowest round trip time the
+                   kernel measured. The first to answer is not always
+                   the fastest path, when a server is reachable over
+                   several links it may be a congested one. Linux only,
+                   elsewhere and with --bond the first banner wins.
+    --fallback-delay=TIME
+                   How long to wait after the last connect before the
+                   fallback command is run, three seconds by default.
+                   With --race-fallback, how long after startup.
+    --race-fallback
+                   Instead of giving up on the hosts and running the
+                   fallback command in their place, start it as one
+                   more candidate, with a socket as its stdin and
+                   stdout, after --fallback-delay or once all hosts
+                   have failed. It has to produce an SSH banner like
+                   the hosts, whichever is first wins and the others
+                   are closed, a losing command is killed. A slow
+                   tunnel then no longer keeps out a host answering
+                   late, and a host no longer has to fail before the
+                   tunnel gets its turn.
+    --deadline=TIME
+                   Exit with an error if no connection has been chosen
+                   this long after startup. There is no deadline by
+                   default.
+    --nodelay      Set TCP_NODELAY on the connections, so keystrokes of
+                   interactive sessions are not held back by Nagle.
+    --sndbuf=SIZE, --rcvbuf=SIZE
+                   Set the socket send and receive buffer sizes.
+    --keepalive[=IDLE[,INTERVAL[,COUNT]]]
+                   Enable TCP keepalive, optionally with the idle time
+                   before the first probe, the time between probes and
+                   the number of unanswered probes before giving up.
+                   The times are in seconds unless a unit is given,
+                   and are rounded up to whole seconds. Where the
+                   system supports it.
+    --rate-limit=RATE[,RATE]
+                   Relay at most RATE bytes per second, like 200k, from
+                   stdin to the server, and the second RATE from the
+                   server to stdout, by default the same. Bursts of up
+                   to an eighth of a second's worth go through at full
+                   speed, so keystrokes are not held back by a limit
+                   meant for bulk copies. Not with --io-uring, which is
+                   then not used, or --bond.
+    --qos[=INTERACTIVE[,BULK]]
+                   Mark the packets sent to the server with a traffic
+                   class, as the IPQoS option of ssh does for its own
+                   socket, which here is a pipe. A session counts as
+                   interactive until it has made a run of large reads,
+                   then as bulk until it has gone a second without one.
+                   The classes are af11 to af43, cs0 to cs7, ef, le,
+                   lowdelay, throughput, reliability or none as for
+                   IPQoS, or the TOS byte as a number, and af21,cs1 by
+                   default. With a single class it is used throughout.
+                   On Linux the socket priority follows the class, so
+                   queueing on this host favours interactive sessions
+                   too. Changing classes needs the ordinary relay or
+                   that of --splice.
+    --fastopen     Use TCP Fast Open where the system supports it. The
+                   ssh client sends its identification as soon as it
+                   starts, if it is already waiting on stdin when a
+                   connection is started, it is sent along with the SYN
+                   to every candidate, saving the winner a round trip.
+                   Not used together with a fallback command, since the
+                   command would not get those bytes.
+    --config=FILE  Read options from FILE, see below.
+    --groups=FILE  Where to look up a host group when the only argument
+                   is a name, ~/.ssh/multipath-proxy.groups by default,
+                   see below.
+    --compile-groups
+                   Compile the index of the groups file and exit.
+    --cache[=FILE] Remember the outcome of each race in FILE, by default
+                   ssh-multipath-proxy.cache in $XDG_RUNTIME_DIR, and
+                   use it to order the next race. The host which won
+                   most recently is tried first, starting with the
+                   address it won with even before its name has been
+                   looked up again, and only for about twice as long as
+                   it took to answer last time. The other hosts follow,
+                   those which have lost the fewest races since they
+                   last won first. An address which failed to produce
+                   a banner, or had not even connected when the next
+                   host got its turn, is tried after all others for
+                   the next 10 seconds, twice as long with every
+                   failure in a row, up to 10 minutes.
+    --stats[=DEST] Write one line of JSON per session with the time each
+                   lookup, connect and banner took, which connection
+                   won, whether the fallback command was run, and the
+                   bytes and system calls of the relay, with the most it
+                   buffered, how often a write came up short and how
+                   long the relay waited for either side to take more.
+                   DEST is stderr (the default), a file to append to, or
+                   unix:PATH to send it as a datagram to a unix socket.
+    --live[=DIR]   Keep the counters of the relay in a file in DIR,
+                   ssh-multipath-proxy.live in $XDG_RUNTIME_DIR by
+                   default, mapped into memory while the session runs,
+                   for --top to read. Best put in the config file so
+                   every session does it.
+    --top          Show the sessions which run with --live, busiest
+                   first, with what they move per second and in all,
+                   the counters of --stats and the connection they use,
+                   every second until interrupted. If stdout is not a
+                   terminal they are shown once. Takes the DIR of
+                   --live.
+    --daemon[=SOCKET]
+                   Run as a daemon serving proxies started with
+                   --use-daemon, on the unix socket SOCKET, by default
+                   ssh-multipath-proxy.sock next to the cache. Each
+                   session runs in a child of the daemon, always with
+                   the cache. After a session has found a winner, the
+                   daemon fills a pool of spare connections to the same
+                   address for the next sessions to the same hosts. A
+                   session which gets a spare whose banner has arrived
+                   uses it without any race at all.
+    --pool-size=N  Spare connections per list of hosts, at most 16. The
+                   default is 1, 0 turns the pool off.
+    --pool-ttl=TIME
+                   How long a spare is kept, one minute by default. It
+                   is replaced when it expires only if its hosts have
+                   been used since it was opened, so the pool drains
+                   when they are idle. sshd closes connections which
+                   have not logged in after its LoginGraceTime, keep
+                   this below that.
+    --pool-check=TIME
+                   Send TCP keepalive probes on idle spares this often,
+                   so one whose path has broken is dropped before it is
+                   handed out. Spares closed by the server are always
+                   noticed right away.
+    --monitor      Watch for changes of the network, like moving from
+                   the office to a VPN, with netlink or a routing
+                   socket. A second after one, the daemon runs the last
+                   session to every list of hosts used within the hour
+                   again in the background, with --fan-out and without
+                   a client, to update the cache and fill the pool with
+                   connections over the new network. Sessions started
+                   after that find the new winner right away instead
+                   of waiting out timeouts on paths that went away.
+    --use-daemon[=SOCKET]
+                   Hand stdin, stdout and stderr and the arguments over
+                   to the daemon, and exit with the status of the
+                   session. The options of the session are those of the
+                   daemon with the command line on top. If there is no
+                   daemon the proxy does the work itself.
+    --bond[=N]     Spread the session over up to N connections, 8 by
+                   default, to hosts running ssh-multipath-peer in
+                   front of sshd. The peer answers with MPX instead of
+                   an SSH banner, and every connection which does so
+                   within --bond-wait of the first one joins the
+                   session. Data is split into frames sent on whichever
+                   connection has room, and put back in order at the
+                   other end. If the first host to answer is a plain
+                   sshd it is used as without --bond. The session ends
+                   if one of its connections fails, unless --resume is
+                   given.
+    --bond-wait=TIME
+                   How long to wait for more connections after the first
+                   one answered, 500ms by default. All remaining hosts
+                   are connected at once during this time.
+    --resume       Keep the session alive when its connection to
+                   ssh-multipath-peer breaks, for example when moving
+                   from Wi-Fi to a cable. Both ends keep what they sent
+                   until the other end acknowledges it, and a lost
+                   connection is replaced by connecting to the hosts
+                   again, all their addresses in turn beginning with
+                   those which were in use. The new connection picks up
+                   the stream where the old one left it. A connection
+                   is considered lost when nothing has arrived on it
+                   for six seconds. Implies --bond=1 unless --bond is
+                   given.
+    --resume-buffer=SIZE
+                   How much which has not yet been acknowledged is kept,
+                   at least 64k and 1M by default. Reading from stdin
+                   waits while it is full.
+    --resume-timeout=TIME
+                   Give up when no new connection could be made for this
+                   long, five minutes by default. The peer has its own
+                   limit, see ssh-multipath-peer.c.
+    --compress[=RTT]
+                   Compress the session in both directions with deflate
+                   between here and ssh-multipath-peer, for slow links
+                   which are paid by the byte. Everything read at once
+                   is sent at once, so typing is not held back. With
+                   RTT, a time like 150 (ms) or 1s, only when none of
+                   the connections has a shorter round trip time than
+                   that. It is what the kernel measured for them when
+                   the session begins, and where that can't be told
+                   they are taken to be slow. Implies --bond=1 unless
+                   --bond is given.
+
+    Since ProxyCommand lines tend to get long, options can also be
+    given in ~/.ssh/multipath-proxy.conf and in the environment
+    variable SSH_MULTIPATH_PROXY_OPTIONS. The config file has one long
+    option per line, without the leading dashes, with the value
+    separated by whitespace or =, for example "stagger 50ms". Lines
+    starting with # are ignored. The environment variable holds long
+    options written as on the command line, separated by whitespace.
+    The config file is read first, then the environment variable, then
+    the command line, so later settings override earlier ones.
+
+    Instead of the list of hosts a single name can be given, which is
+    looked up in the groups file. It has one group per line, the name
+    followed by the arguments it stands for, separated by whitespace:
+
+      db1 --banner-timeout=3s db1.example.com db1-vpn:2222 weight=2 \
+          timeout=1s -- ssh -W db1.example.com:22 jump
+
+    Words starting with -- are long options, applied on top of the
+    command line, and a lone -- starts the fallback command, which is
+    run as written: there is no %h or %p to expand. The others are
+    hosts, each optionally followed by settings of its own:
+    weight=N, hosts of a higher weight are tried first, 1 by default;
+    stagger=TIME and timeout=TIME in place of --stagger and
+    --banner-timeout. A ProxyCommand then only needs
+    "ssh-multipath-proxy %h". The file is compiled into FILE.idx, which
+    is rebuilt whenever the file changes, so finding a group takes the
+    same time however many of them the file holds.
 
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include <string.h>
 #include <time.h>
 #include <signal.h>
@@ -81,6 +370,8 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <ctype.h>
@@ -88,241 +379,2642 @@
 #include <netdb.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+#include "event.h"
+#include "resolve.h"
+#include "cache.h"
+#include "stats.h"
+#include "daemon.h"
+#include "mpx.h"
+#include "banner.h"
+#include "uring.h"
+#include "groups.h"
+#include "upstream.h"
+#include "live.h"
 
 struct socket_info {
   int fd;
+  int host;
   char *name;
-  struct sockaddr_in sock_addr;
+  struct timeval connect_time;
+  /* How much of the early data was sent with the SYN */
+  size_t early_sent;
+  struct sockaddr_storage sock_addr;
+  socklen_t sock_len;
+  /* Index in the stats attempts, -1 without stats */
+  int attempt;
+  int connected;
+  /* Opened by the daemon before the session started */
+  int standby;
+  /* The kind of proxy the connection goes through, until the proxy
+   * has connected to the host
+   */
+  int upstream;
+  /* What the server has sent so far, passed on to the client once the
+   * identification line is complete.
+   */
+  char banner[SSH_BANNER_MAX];
+  size_t banner_len;
+};
+
+/* Everything the connection race in main and wait_for_reply works on.
+ * Lookups for all hosts are started right away, and resolve_fd becomes
+ * readable whenever one of them finishes.
+ */
+struct race {
+  struct event_loop *ev;
+  struct socket_info *sockets;
+  int nr_open_sockets;
+  int sockets_size;
+  struct lookup *lookups;
+  int nr_hosts;
+  int pending_lookups;
+  int resolve_fd;
+  int last_connect_fd;
+  int last_host;
+  struct timeval last_connect_time;
+  /* Hosts in the order they are tried, and what the cache says about
+   * each of them.
+   */
+  int *order;
+  struct history *history;
+  struct cache *cache;
+  /* Bytes read from stdin before the race was decided, for fastopen */
+  char early_data[1024];
+  size_t early_len;
+  struct session_stats stats;
+  /* Connections to bonding peers, used together when the wait is over */
+  struct socket_info bond[MPX_MAX_PATHS];
+  int nr_bond;
+  int64_t bond_deadline;
+  /* With --evaluate, connections whose banner arrived while waiting for
+   * the others
+   */
+  struct socket_info *ready;
+  int nr_ready;
+  int ready_size;
+  int64_t ready_deadline;
+  /* With --race-fallback, the command until it is started at
+   * fallback_at, and then its pid
+   */
+  char **fallback;
+  int64_t fallback_at;
+  pid_t fallback_pid;
+};
+
+struct history {
+  struct cache_entry entry;
+  int known;
+  int cached_tried;
+  int tried;
+  /* Once the addresses of the lookup are sorted, where those which
+   * failed recently begin
+   */
+  int sorted;
+  int first_dead;
+};
+
+static int use_splice=0;
+static int use_uring=0;
+static size_t buffer_size=8192;
+static size_t buffer_max=4*1024*1024;
+/* Bytes per second of each direction of the relay, 0 for no limit */
+static size_t rate_limit[2]={0,0};
+/* The TOS byte of interactive and of bulk sessions, -1 for none */
+static int qos[2]={-1,-1};
+static int64_t attempt_delay=250000;
+static int64_t stagger=1000000;
+static int64_t banner_timeout=0;
+static int64_t evaluate_window=0;
+static int fan_out=0;
+static int race_fallback=0;
+static int64_t fallback_delay=3000000;
+static int64_t deadline=0;
+static struct timeval start_time;
+static int use_cache=0;
+static char *cache_file=NULL;
+static char *groups_file=NULL;
+static int compile_groups=0;
+/* Per host settings from a group, NULL without one */
+struct host_options {
+  int weight;
+  int64_t stagger;
+  int64_t banner_timeout;
+};
+static struct host_options *host_options=NULL;
+static int use_nodelay=0;
+static int use_fastopen=0;
+static int sndbuf=0;
+static int rcvbuf=0;
+/* Zero for the system defaults */
+static int keepalive=0;
+static int keepalive_idle=0;
+static int keepalive_interval=0;
+static int keepalive_count=0;
+static char *stats_dest=NULL;
+static int use_live=0;
+static char *live_dir=NULL;
+static int show_top=0;
+static int run_daemon=0;
+static int use_daemon=0;
+static char *daemon_socket=NULL;
+/* Set in a session child of the daemon */
+static int in_daemon=0;
+static int notify_fd=-1;
+/* A probe of the daemon, which stops once it has a winner */
+static int probing=0;
+static struct pool_options pool={1,60000000,0,0};
+static int bond=0;
+static int64_t bond_wait=500000;
+static int use_resume=0;
+static size_t resume_buffer=1024*1024;
+static int64_t resume_timeout=300000000;
+/* Compression, only with round trip times of at least compress_rtt
+ * microseconds if that is not 0
+ */
+static int use_compress=0;
+static int64_t compress_rtt=0;
+/* Where lost connections of a resumed session are connected again */
+static struct sockaddr_storage *candidates=NULL;
+static socklen_t *candidate_lens=NULL;
+static const char **candidate_sources=NULL;
+static int nr_candidates=0;
+static int next_candidate=0;
+
+static inline int64_t timeval_to_int64(struct timeval tv)
+{
+  return ((int64_t)tv.tv_sec)*((int64_t)1000000)+((int64_t)tv.tv_usec);
+}
+
+static int64_t now_us(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return timeval_to_int64(tv);
+}
+
+/* A fixed size ring buffer holding the bytes read from one side of
+ * the relay until they have been written to the other side. Both the
+ * free space and the buffered data can wrap around the end of the
+ * buffer, so they are handed to readv and writev as up to two pieces.
+ */
+struct ring {
+  char *buf;
+  size_t size;
+  size_t start;
+  size_t used;
+};
+
+static int ring_init(struct ring *r, size_t size)
+{
+  r->buf=malloc(size);
+  r->size=size;
+  r->start=0;
+  r->used=0;
+  return r->buf?0:-1;
+}
+
+/* Fill iov with the buffered data, returns the number of pieces */
+static int ring_data(struct ring *r, struct iovec *iov)
+{
+  size_t first=r->size-r->start;
+  if (first>r->used) first=r->used;
+  iov[0].iov_base=r->buf+r->start;
+  iov[0].iov_len=first;
+  iov[1].iov_base=r->buf;
+  iov[1].iov_len=r->used-first;
+  return iov[1].iov_len?2:1;
+}
+
+/* Fill iov with the free space, returns the number of pieces */
+static int ring_space(struct ring *r, struct iovec *iov)
+{
+  size_t end=(r->start+r->used)%r->size;
+  size_t space=r->size-r->used;
+  size_t first=r->size-end;
+  if (first>space) first=space;
+  iov[0].iov_base=r->buf+end;
+  iov[0].iov_len=first;
+  iov[1].iov_base=r->buf;
+  iov[1].iov_len=space-first;
+  return iov[1].iov_len?2:1;
+}
+
+static void ring_consume(struct ring *r, size_t n)
+{
+  r->used-=n;
+  /* Keep the data contiguous for as long as possible */
+  r->start=r->used?(r->start+n)%r->size:0;
+}
+
+/* Move the data into a new buffer of size bytes, which must hold it */
+static int ring_resize(struct ring *r, size_t size)
+{
+  struct iovec iov[2];
+  char *buf=malloc(size);
+  if (!buf) return -1;
+  ring_data(r,iov);
+  memcpy(buf,iov[0].iov_base,iov[0].iov_len);
+  memcpy(buf+iov[0].iov_len,iov[1].iov_base,iov[1].iov_len);
+  free(r->buf);
+  r->buf=buf;
+  r->size=size;
+  r->start=0;
+  return 0;
+}
+
+/* The relay moves data from stdin to the socket and from the socket to
+ * stdout. Direction i reads from fd[i] and writes to fd[i+1]. Every
+ * descriptor is registered with the event loop once. Pipes and sockets
+ * are made non-blocking and registered edge triggered, their ready bits
+ * stay set until a read or write comes up short. Anything else, like a
+ * tty, is registered level triggered only for the events we want right
+ * now, and its ready bits are cleared after every attempt.
+ */
+struct relay_fds {
+  struct event_loop *ev;
+  int fd[3];
+  int edge[3];
+  int ready[3];
+  int registered[3];
+};
+
+static int relay_open(struct relay_fds *r, int sock)
+{
+  int i;
+  r->fd[0]=0;
+  r->fd[1]=sock;
+  r->fd[2]=1;
+  r->ev=ev_new();
+  if (!r->ev) {
+    perror("event loop");
+    return -1;
+  }
+  for (i=0;i<3;++i) {
+    struct stat st;
+    int events=(i==0)?EV_READ:(i==2)?EV_WRITE:(EV_READ|EV_WRITE);
+    r->edge[i]=ev_has_edge(r->ev)&&!fstat(r->fd[i],&st)&&
+      (S_ISFIFO(st.st_mode)||S_ISSOCK(st.st_mode));
+    if (r->edge[i])
+      fcntl(r->fd[i],F_SETFL,fcntl(r->fd[i],F_GETFL)|O_NONBLOCK);
+    r->ready[i]=0;
+    r->registered[i]=r->edge[i]?(events|EV_EDGE):0;
+    if (ev_add(r->ev,r->fd[i],r->registered[i])) {
+      perror("event loop");
+      ev_free(r->ev);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void relay_release(struct relay_fds *r)
+{
+  ev_free(r->ev);
+}
+
+/* Record the outcome of a read or write of asked bytes on fd[i]. A
+ * short write means the destination is full, but a short read does not
+ * prove the source is empty: the hangup may have been reported together
+ * with the last data, so keep reading until EAGAIN or end of file.
+ */
+static void relay_did(struct relay_fds *r, int i, int event,
+		      ssize_t done, size_t asked)
+{
+  if ((!r->edge[i])||((done==-1)&&(errno==EAGAIN))||
+      ((event==EV_WRITE)&&(done<(ssize_t)asked)))
+    r->ready[i]&=~event;
+}
+
+/* Shut down the writing side of direction i once it is finished */
+static void relay_shutdown(struct relay_fds *r, int i)
+{
+  shutdown(r->fd[i+1],SHUT_WR);
+  if (i == 1) {
+    ev_del(r->ev,1);
+    close(1);
+  }
+}
+
+/* Wait until one of the wanted events is ready, or up to timeout
+ * microseconds if that is not negative. Returns -1 on error.
+ */
+static int relay_wait(struct relay_fds *r, const int *want, int64_t timeout)
+{
+  struct ev_event events[8];
+  int64_t before=0;
+  int i,j,n,stalled;
+  for (i=0;i<3;++i) {
+    if (want[i]&r->ready[i]) return 0;
+  }
+  for (i=0;i<3;++i) {
+    if ((!r->edge[i])&&(want[i]!=r->registered[i])) {
+      if (ev_mod(r->ev,r->fd[i],want[i])) return -1;
+      r->registered[i]=want[i];
+    }
+  }
+  ++relay_stats->waits;
+  /* Time spent with data waiting for its destination is stalled */
+  stalled=(want[1]|want[2])&EV_WRITE;
+  if (stalled) before=now_us();
+  n=ev_wait(r->ev,events,8,timeout);
+  if (stalled) {
+    int64_t t=now_us()-before;
+    for (i=0;i<2;++i)
+      if (want[i+1]&EV_WRITE) relay_stats->stalled[i]+=t;
+  }
+  if (n==-1) return (errno==EINTR)?0:-1;
+  for (j=0;j<n;++j)
+    for (i=0;i<3;++i)
+      if (events[j].fd==r->fd[i]) r->ready[i]|=events[j].events;
+  return 0;
+}
+
+/* How much of a buffer direction i of the relay can put to use: twice
+ * what the kernel measured the connection can have in flight, the
+ * congestion window when sending and the receive window when receiving.
+ */
+static size_t buffer_target(int sock, int i)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+  struct tcp_info ti;
+  socklen_t len=sizeof(ti);
+  if (!getsockopt(sock,IPPROTO_TCP,TCP_INFO,&ti,&len))
+    return 2*(i?(size_t)ti.tcpi_rcv_space:
+	      (size_t)ti.tcpi_snd_cwnd*ti.tcpi_snd_mss);
+#else
+  (void)sock;
+  (void)i;
+#endif
+  return buffer_max;
+}
+
+/* A read just filled buffer i, double it if more is waiting and the
+ * destination is keeping up, within the target and buffer_max. Returns
+ * -1 if it stays as it is.
+ */
+static int buffer_grow(struct relay_fds *fds, struct ring *buffer, int i)
+{
+  size_t size=buffer[i].size*2;
+  int waiting=0;
+  if (size+buffer[!i].size>buffer_max) return -1;
+  if (ioctl(fds->fd[i],FIONREAD,&waiting)||(waiting<1)) return -1;
+  if (buffer[i].size>=buffer_target(fds->fd[1],i)) return -1;
+#ifdef SIOCOUTQ
+  /* Unacknowledged data piling up in the socket means the network is
+   * what holds us back, not the buffer.
+   */
+  if (!i) {
+    int queued=0;
+    if (!ioctl(fds->fd[1],SIOCOUTQ,&queued)&&
+	((size_t)queued>=buffer[i].size))
+      return -1;
+  }
+#endif
+  return ring_resize(buffer+i,size);
+}
+
+/* Buffer i was just emptied, halve it if the last read used a quarter
+ * of it or less.
+ */
+static void buffer_shrink(struct ring *r, size_t last_read)
+{
+  if ((r->size/2>=buffer_size)&&(last_read<=r->size/4))
+    ring_resize(r,r->size/2);
+}
+
+/* A token bucket for one direction of the relay. Up to an eighth of a
+ * second's worth, and at least BUCKET_MIN, may be read at once.
+ */
+#define BUCKET_MIN 4096
+
+struct bucket {
+  size_t rate;
+  size_t burst;
+  size_t tokens;
+  int64_t last;
+};
+
+static void bucket_init(struct bucket *b, size_t rate)
+{
+  b->rate=rate;
+  b->burst=(rate/8>BUCKET_MIN)?rate/8:BUCKET_MIN;
+  b->tokens=b->burst;
+  b->last=now_us();
+}
+
+/* How much may be read now, SIZE_MAX without a limit. Once it is down
+ * to less than a quarter of the burst, nothing until that has come in,
+ * to keep reads from getting tiny.
+ */
+static size_t bucket_allows(struct bucket *b, int64_t now)
+{
+  int64_t elapsed=now-b->last;
+  size_t add;
+  if (!b->rate) return SIZE_MAX;
+  if (elapsed>=1000000) {
+    b->tokens=b->burst;
+    b->last=now;
+  } else if ((add=elapsed*(int64_t)b->rate/1000000)) {
+    b->tokens=(b->tokens+add<b->burst)?b->tokens+add:b->burst;
+    /* Leave the rest of the time to count towards the next token */
+    b->last+=add*(int64_t)1000000/b->rate;
+  }
+  return (b->tokens>=b->burst/4)?b->tokens:0;
+}
+
+static void bucket_take(struct bucket *b, size_t n)
+{
+  if (b->rate) b->tokens-=(n<b->tokens)?n:b->tokens;
+}
+
+/* Microseconds until a quarter of the burst may be read */
+static int64_t bucket_wait(const struct bucket *b)
+{
+  size_t want=b->burst/4;
+  if (b->tokens>=want) return 0;
+  return (want-b->tokens)*(int64_t)1000000/b->rate+1;
+}
+
+/* Cut iov down to max bytes, returns the number of pieces left */
+static int iov_limit(struct iovec *iov, int n, size_t max)
+{
+  if (iov[0].iov_len>=max) {
+    iov[0].iov_len=max;
+    return 1;
+  }
+  if ((n>1)&&(iov[0].iov_len+iov[1].iov_len>max))
+    iov[1].iov_len=max-iov[0].iov_len;
+  return n;
+}
+
+/* Mark the packets of fd with the TOS byte tos, and on Linux give them
+ * a queueing priority to match.
+ */
+static void set_qos(int fd, int tos, int priority)
+{
+  struct sockaddr_storage ss;
+  socklen_t len=sizeof(ss);
+  if ((tos<0)||getsockname(fd,(struct sockaddr *)&ss,&len)) return;
+#ifdef IPV6_TCLASS
+  if (ss.ss_family==AF_INET6)
+    setsockopt(fd,IPPROTO_IPV6,IPV6_TCLASS,&tos,sizeof(tos));
+  else
+#endif
+    setsockopt(fd,IPPROTO_IP,IP_TOS,&tos,sizeof(tos));
+#ifdef SO_PRIORITY
+  setsockopt(fd,SOL_SOCKET,SO_PRIORITY,&priority,sizeof(priority));
+#else
+  (void)priority;
+#endif
+}
+
+/* A session is interactive until it has made QOS_BULK_READS reads of
+ * QOS_LARGE bytes or more in a row, in either direction, and is bulk
+ * until it has gone QOS_IDLE without one.
+ */
+#define QOS_LARGE 4096
+#define QOS_BULK_READS 16
+#define QOS_IDLE 1000000
+/* TC_PRIO_INTERACTIVE and TC_PRIO_BULK of Linux */
+#define QOS_PRIO_INTERACTIVE 6
+#define QOS_PRIO_BULK 2
+
+struct qos_state {
+  int fd;
+  int bulk;
+  int large_reads;
+  int64_t last_large;
 };
 
-int select_loop(int fd)
+static void qos_init(struct qos_state *q, int fd)
+{
+  q->fd=fd;
+  q->bulk=0;
+  q->large_reads=0;
+  q->last_large=0;
+  set_qos(fd,qos[0],QOS_PRIO_INTERACTIVE);
+}
+
+/* The relay read n bytes */
+static void qos_read(struct qos_state *q, size_t n)
 {
-  int src[2]={0,fd};
-  int dst[2]={fd,1};
-  char buffer[2][8192];
-  int bufusage[2]={0,0};
+  /* With a single class there is nothing to tell apart */
+  if (qos[0]==qos[1]) return;
+  if (n>=QOS_LARGE) {
+    q->last_large=now_us();
+    if (!q->bulk&&(++q->large_reads>=QOS_BULK_READS)) {
+      set_qos(q->fd,qos[1],QOS_PRIO_BULK);
+      q->bulk=1;
+    }
+  } else if (!q->bulk) {
+    q->large_reads=0;
+  } else if (now_us()-q->last_large>=QOS_IDLE) {
+    set_qos(q->fd,qos[0],QOS_PRIO_INTERACTIVE);
+    q->bulk=0;
+    q->large_reads=0;
+  }
+}
+
+/* The banner already read from the server is sent to stdout first */
+int copy_loop(int fd, const char *banner, size_t banner_len)
+{
+  struct relay_fds fds;
+  struct ring buffer[2];
   int active[2]={1,1};
+  int done[2]={0,0};
+  size_t last_read[2]={0,0};
+  /* Full reads to go before growing is considered again */
+  int grow_wait[2]={0,0};
+  struct bucket bucket[2];
+  struct qos_state qs;
+  int result=0;
+  int i;
+
+  if (ring_init(buffer,buffer_size)||
+      ring_init(buffer+1,(buffer_size<banner_len)?banner_len:buffer_size)) {
+    perror("malloc");
+    return -1;
+  }
+  memcpy(buffer[1].buf,banner,banner_len);
+  buffer[1].used=banner_len;
+  if (relay_open(&fds,fd)) {
+    free(buffer[0].buf);
+    free(buffer[1].buf);
+    return -1;
+  }
+  for (i=0;i<2;++i) bucket_init(bucket+i,rate_limit[i]);
+  qos_init(&qs,fd);
 
   while(1) {
-    int i;
-    int max_fd=-1;
-    fd_set rfd;
-    fd_set wfd;
-    FD_ZERO(&rfd);
-    FD_ZERO(&wfd);
+    int want[3]={0,0,0};
+    int64_t now=(rate_limit[0]||rate_limit[1])?now_us():0;
+    int64_t timeout=-1;
     for (i=0;i<2;++i) {
-      if (bufusage[i]>0) {
-        FD_SET(dst[i],&wfd);
-        if (dst[i]>max_fd) max_fd=dst[i];
+      struct iovec iov[2];
+      size_t allowed=bucket_allows(bucket+i,now);
+      if ((buffer[i].used>0)&&(fds.ready[i+1]&EV_WRITE)) {
+        ssize_t r=writev(fds.fd[i+1],iov,ring_data(buffer+i,iov));
+        ++relay_stats->writes;
+        relay_did(&fds,i+1,EV_WRITE,r,iov[0].iov_len+iov[1].iov_len);
+        if ((r==-1)&&(errno==EAGAIN)) {
+          /* Try again when it is writable */
+        } else if (r<1) {
+          active[i]=0;
+          buffer[i].used=0;
+        } else {
+          if ((size_t)r<iov[0].iov_len+iov[1].iov_len)
+            ++relay_stats->short_writes;
+          ring_consume(buffer+i,r);
+          relay_stats->bytes[i]+=r;
+          if (!buffer[i].used) buffer_shrink(buffer+i,last_read[i]);
+        }
+      }
+      if (active[i]&&(buffer[i].used<buffer[i].size)&&allowed&&
+          (fds.ready[i]&EV_READ)) {
+        int n=ring_space(buffer+i,iov);
+        size_t space=iov[0].iov_len+iov[1].iov_len;
+        ssize_t r;
+        n=iov_limit(iov,n,allowed);
+        r=readv(fds.fd[i],iov,n);
+        ++relay_stats->reads;
+        relay_did(&fds,i,EV_READ,r,iov[0].iov_len+iov[1].iov_len);
+        if ((r==-1)&&(errno==EAGAIN)) {
+          /* Try again when it is readable */
+        } else if (r<1) {
+          active[i]=0;
+        } else {
+          buffer[i].used+=r;
+          last_read[i]=r;
+          if (buffer[i].used>relay_stats->high_water[i])
+            relay_stats->high_water[i]=buffer[i].used;
+          bucket_take(bucket+i,r);
+          qos_read(&qs,r);
+          if (((size_t)r==space)&&
+              (grow_wait[i]--<1)&&buffer_grow(&fds,buffer,i))
+            grow_wait[i]=32;
+        }
+      }
+      if ((!active[i])&&(buffer[i].used==0)&&!done[i]) {
+        relay_shutdown(&fds,i);
+        done[i]=1;
       }
-      if (active[i]&&(bufusage[i]<4096)) {
-        FD_SET(src[i],&rfd);
-        if (src[i]>max_fd) max_fd=src[i];
+      if (buffer[i].used>0) want[i+1]|=EV_WRITE;
+      if (active[i]&&(buffer[i].used<buffer[i].size)) {
+        /* Out of tokens it waits for more instead */
+        if (!bucket_allows(bucket+i,now)) {
+          int64_t t=bucket_wait(bucket+i);
+          if ((timeout<0)||(t<timeout)) timeout=t;
+        } else {
+          want[i]|=EV_READ;
+        }
       }
     }
-    if (max_fd == -1) return 0;
-    if (select(max_fd+1,&rfd,&wfd,NULL,NULL)<1) return -1;
+    if (!(want[0]|want[1]|want[2])&&(timeout<0)) break;
+    if (relay_wait(&fds,want,timeout)) {
+      result=-1;
+      break;
+    }
+  }
+
+  relay_release(&fds);
+  free(buffer[0].buf);
+  free(buffer[1].buf);
+  return result;
+}
+
+#ifdef SPLICE_F_MOVE
+#define SPLICE_CHUNK 65536
+
+/* Pipes and sockets can always be spliced, regular files can be
+ * spliced on any recent kernel. Terminals and other character devices
+ * can't, for those we have to use copy_loop.
+ */
+static int can_splice(int fd)
+{
+  struct stat st;
+  if (fstat(fd,&st)) return 0;
+  return S_ISFIFO(st.st_mode)||S_ISSOCK(st.st_mode)||S_ISREG(st.st_mode);
+}
+
+/* Same as copy_loop, but the data is moved from the source into a
+ * pipe and from the pipe into the destination with splice(), so it
+ * never passes through user space. Returns -2 if splice turned out not
+ * to work before any data was moved, in that case the caller can still
+ * fall back to copy_loop.
+ */
+int splice_loop(int fd, const char *banner, size_t banner_len)
+{
+  struct relay_fds fds;
+  int pipes[2][2]={{-1,-1},{-1,-1}};
+  int inpipe[2]={0,0};
+  int full[2]={0,0};
+  int active[2]={1,1};
+  int done[2]={0,0};
+  int moved=0;
+  struct bucket bucket[2];
+  struct qos_state qs;
+  int result=0;
+  int i;
+
+  for (i=0;i<2;++i)
+    if (pipe(pipes[i])) {
+      perror("pipe");
+      result=-2;
+      goto out;
+    }
+  if (relay_open(&fds,fd)) {
+    result=-2;
+    goto out;
+  }
+  /* An empty pipe always has room for the banner. Falling back is still
+   * fine, the banner is handed to copy_loop again.
+   */
+  if (banner_len&&(write(pipes[1][1],banner,banner_len)!=(ssize_t)banner_len)) {
+    result=-2;
+    goto release;
+  }
+  inpipe[1]=banner_len;
+  for (i=0;i<2;++i) bucket_init(bucket+i,rate_limit[i]);
+  qos_init(&qs,fd);
+
+  while(1) {
+    int want[3]={0,0,0};
+    int64_t now=(rate_limit[0]||rate_limit[1])?now_us():0;
+    int64_t timeout=-1;
     for (i=0;i<2;++i) {
-      if ((bufusage[i]>0)&&(FD_ISSET(dst[i],&wfd))) {
-        int towrite=bufusage[i];
-        int r;
-        if (towrite>4096) towrite=4096;
-        r=write(dst[i],buffer[i],towrite);
-        if (r<1) {
+      size_t allowed=bucket_allows(bucket+i,now);
+      if ((inpipe[i]>0)&&(fds.ready[i+1]&EV_WRITE)) {
+        ssize_t r=splice(pipes[i][0],NULL,fds.fd[i+1],NULL,inpipe[i],
+                         SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        ++relay_stats->writes;
+        relay_did(&fds,i+1,EV_WRITE,r,inpipe[i]);
+        if ((r==-1)&&(errno==EINVAL)&&!moved) {
+          result=-2;
+          goto release;
+        }
+        if ((r==-1)&&(errno==EAGAIN)) {
+          /* Try again when it is writable */
+        } else if (r<1) {
           active[i]=0;
-          bufusage[i]=0;
+          inpipe[i]=0;
         } else {
-          bufusage[i]-=r;
-          memcpy(buffer[i],buffer[i]+r,bufusage[i]);
+          if (r<inpipe[i]) ++relay_stats->short_writes;
+          inpipe[i]-=r;
+          relay_stats->bytes[i]+=r;
+          full[i]=0;
+          moved=1;
         }
       }
-      if (active[i]&&(bufusage[i]<4096)&&(FD_ISSET(src[i],&rfd))) {
-        int r=read(src[i],buffer[i]+bufusage[i],4096);
-        if (r<1) {
+      if (active[i]&&(inpipe[i]<SPLICE_CHUNK)&&!full[i]&&allowed&&
+          (fds.ready[i]&EV_READ)) {
+        size_t len=SPLICE_CHUNK-inpipe[i];
+        ssize_t r=splice(fds.fd[i],NULL,pipes[i][1],NULL,
+                         (len<allowed)?len:allowed,
+                         SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        ++relay_stats->reads;
+        if ((r==-1)&&(errno==EINVAL)&&!moved) {
+          result=-2;
+          goto release;
+        }
+        /* A short count or EAGAIN may be caused by the pipe being full
+         * rather than the source being empty, as every splice into a
+         * pipe takes up a whole pipe buffer no matter how small it is.
+         * We only know the source is empty if the pipe is empty too.
+         */
+        if (!fds.edge[i]) fds.ready[i]&=~EV_READ;
+        if ((r==-1)&&(errno==EAGAIN)) {
+          if (inpipe[i]) full[i]=1;
+          else fds.ready[i]&=~EV_READ;
+        } else if (r<1) {
           active[i]=0;
         } else {
-          bufusage[i]+=r;
+          inpipe[i]+=r;
+          moved=1;
+          if ((uint64_t)inpipe[i]>relay_stats->high_water[i])
+            relay_stats->high_water[i]=inpipe[i];
+          bucket_take(bucket+i,r);
+          qos_read(&qs,r);
         }
       }
-      if ((!active[i])&&(bufusage[i]==0)&&(dst[i]>-1)) {
-        shutdown(dst[i],SHUT_WR);
-        if (i == 1) close(1);
-        dst[i]=-1;
+      if ((!active[i])&&(inpipe[i]==0)&&!done[i]) {
+        relay_shutdown(&fds,i);
+        done[i]=1;
+      }
+      if (inpipe[i]>0) want[i+1]|=EV_WRITE;
+      if (active[i]&&(inpipe[i]<SPLICE_CHUNK)&&!full[i]) {
+        if (!bucket_allows(bucket+i,now)) {
+          int64_t t=bucket_wait(bucket+i);
+          if ((timeout<0)||(t<timeout)) timeout=t;
+        } else {
+          want[i]|=EV_READ;
+        }
       }
     }
+    if (!(want[0]|want[1]|want[2])&&(timeout<0)) break;
+    if (relay_wait(&fds,want,timeout)) {
+      result=-1;
+      break;
+    }
+  }
+
+ release:
+  relay_release(&fds);
+ out:
+  for (i=0;i<2;++i) {
+    if (pipes[i][0]!=-1) close(pipes[i][0]);
+    if (pipes[i][1]!=-1) close(pipes[i][1]);
   }
+  return result;
 }
+#endif
 
-/* This function will resolve the host name synchronously, and if that
- * succeeds try to open a TCP connection to the host. The TCP connection
- * is done asynchronously, and is checked in wait_for_reply.
+/* Forward bytes between stdio and fd until both directions are done,
+ * using uring_loop or splice_loop if it was asked for and works on these
+ * fds. The banner goes out first.
  */
-void try_to_connect(struct socket_info *s)
+int relay(int fd, const char *banner, size_t banner_len)
 {
-  int fd;
-  uint16_t port=22;
-  char *p;
-  char *hostname=malloc(strlen(s->name)+1);
-  struct hostent *host_addr;
-  struct sockaddr_in sock_addr;
-
-  s->fd=-1;
+  int r=-2;
+  gettimeofday(&relay_stats->start,NULL);
+  /* Limits and marks are only kept by the other relays */
+  if (use_uring&&!rate_limit[0]&&!rate_limit[1]&&(qos[0]==qos[1]))
+    r=uring_loop(fd,banner,banner_len,buffer_size);
+#ifdef SPLICE_F_MOVE
+  if ((r==-2)&&use_splice&&can_splice(0)&&can_splice(1))
+    r=splice_loop(fd,banner,banner_len);
+#endif
+  if (r==-2) r=copy_loop(fd,banner,banner_len);
+  gettimeofday(&relay_stats->end,NULL);
+  return r;
+}
 
-  if (!hostname) {
-    perror("malloc");
-    return;
+static void set_socket_options(int fd)
+{
+  int one=1;
+  /* Until the relay knows better, sessions count as interactive */
+  set_qos(fd,qos[0],QOS_PRIO_INTERACTIVE);
+  if (use_nodelay)
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+  if (sndbuf)
+    setsockopt(fd,SOL_SOCKET,SO_SNDBUF,&sndbuf,sizeof(sndbuf));
+  if (rcvbuf)
+    setsockopt(fd,SOL_SOCKET,SO_RCVBUF,&rcvbuf,sizeof(rcvbuf));
+  if (keepalive) {
+    setsockopt(fd,SOL_SOCKET,SO_KEEPALIVE,&one,sizeof(one));
+#if defined(TCP_KEEPIDLE)
+    if (keepalive_idle)
+      setsockopt(fd,IPPROTO_TCP,TCP_KEEPIDLE,&keepalive_idle,
+		 sizeof(keepalive_idle));
+#elif defined(TCP_KEEPALIVE)
+    if (keepalive_idle)
+      setsockopt(fd,IPPROTO_TCP,TCP_KEEPALIVE,&keepalive_idle,
+		 sizeof(keepalive_idle));
+#endif
+#ifdef TCP_KEEPINTVL
+    if (keepalive_interval)
+      setsockopt(fd,IPPROTO_TCP,TCP_KEEPINTVL,&keepalive_interval,
+		 sizeof(keepalive_interval));
+#endif
+#ifdef TCP_KEEPCNT
+    if (keepalive_count)
+      setsockopt(fd,IPPROTO_TCP,TCP_KEEPCNT,&keepalive_count,
+		 sizeof(keepalive_count));
+#endif
   }
-  strcpy(hostname,s->name);
+}
 
-  p=strrchr(hostname,':');
-  if (p) {
-    port=atoi(p+1);
-    *p=0;
-  }
+/* Bind fd, a socket of family, to source, an interface or an address.
+ * Returns -1 if that isn't possible, with errno set.
+ */
+static int bind_source(int fd, int family, const char *source)
+{
+  struct addrinfo hints,*res;
+  struct ifaddrs *ifs,*i;
+  int r=-1;
 
-  /* TODO: Support multiple IPs per hostname */
-  host_addr=gethostbyname(hostname);
-  if (!host_addr) {
-    fprintf(stderr,"%s: no such host\n",hostname);
-    return;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family=family;
+  hints.ai_socktype=SOCK_STREAM;
+  hints.ai_flags=AI_NUMERICHOST|AI_PASSIVE;
+  if (!getaddrinfo(source,NULL,&hints,&res)) {
+    r=bind(fd,res->ai_addr,res->ai_addrlen);
+    freeaddrinfo(res);
+    return r;
   }
+  /* An address of the other family, no use for this connection */
+  hints.ai_family=AF_UNSPEC;
+  if (!getaddrinfo(source,NULL,&hints,&res)) {
+    freeaddrinfo(res);
+    errno=EAFNOSUPPORT;
+    return -1;
+  }
+
+#ifdef SO_BINDTODEVICE
+  /* Needs privileges before Linux 5.7 */
+  if (!setsockopt(fd,SOL_SOCKET,SO_BINDTODEVICE,source,strlen(source)+1))
+    return 0;
+#endif
+  if (getifaddrs(&ifs)) return -1;
+  errno=ENODEV;
+  for (i=ifs;i;i=i->ifa_next)
+    if (i->ifa_addr&&(i->ifa_addr->sa_family==family)&&
+	!strcmp(i->ifa_name,source)) {
+      socklen_t len=(family==AF_INET6)?sizeof(struct sockaddr_in6):
+	sizeof(struct sockaddr_in);
+      /* Link local addresses only reach the link */
+      if ((family==AF_INET6)&&
+	  IN6_IS_ADDR_LINKLOCAL(&((struct sockaddr_in6 *)i->ifa_addr)->sin6_addr))
+	continue;
+      r=bind(fd,i->ifa_addr,len);
+      break;
+    }
+  freeifaddrs(ifs);
+  return r;
+}
+
+/* Start a TCP connection to the given address, from source unless it
+ * is NULL. The TCP connection is done asynchronously, and is checked
+ * in wait_for_reply. s->fd is -1 if the connection attempt failed
+ * right away. If there is early data and fastopen is enabled it is
+ * sent with the SYN, s->early_sent tells how much of it the kernel
+ * took.
+ */
+void try_to_connect(struct socket_info *s, const struct addrinfo *ai,
+		    const char *source, const char *early_data,
+		    size_t early_len)
+{
+  int fd;
+  int r;
 
-  sock_addr.sin_family = AF_INET;
-  sock_addr.sin_port = htons(port);
-  sock_addr.sin_addr.s_addr= *(unsigned long int*)(host_addr->h_addr);
+  s->fd=-1;
+  s->early_sent=0;
+  s->banner_len=0;
 
-  fd=socket(PF_INET,SOCK_STREAM,0);
+  fd=socket(ai->ai_family,ai->ai_socktype,ai->ai_protocol);
   if (fd==-1) {
     perror("socket");
     return;
   }
   fcntl(fd,F_SETFL,O_NONBLOCK);
   fcntl(fd,F_SETFD,FD_CLOEXEC);
-  connect(fd,(struct sockaddr*)&sock_addr,sizeof(sock_addr));
-  s->sock_addr=sock_addr;
+  set_socket_options(fd);
+  if (source&&bind_source(fd,ai->ai_family,source)) {
+    if (errno!=EAFNOSUPPORT) perror(source);
+    close(fd);
+    return;
+  }
+#ifdef MSG_FASTOPEN
+  if (use_fastopen&&early_len) {
+    /* Without a cookie for this server the kernel sends a plain SYN and
+     * returns EINPROGRESS, we will send the data once we have a winner.
+     */
+    r=sendto(fd,early_data,early_len,MSG_FASTOPEN,ai->ai_addr,ai->ai_addrlen);
+    if (r>0) s->early_sent=r;
+    if ((r==-1)&&(errno==EOPNOTSUPP))
+      r=connect(fd,ai->ai_addr,ai->ai_addrlen);
+  } else
+#endif
+  {
+    (void)early_data;
+    (void)early_len;
+    r=connect(fd,ai->ai_addr,ai->ai_addrlen);
+  }
+  if ((r==-1)&&(errno!=EINPROGRESS)) {
+    /* Typically no route for this address family, try the next one */
+    close(fd);
+    return;
+  }
+  memcpy(&s->sock_addr,ai->ai_addr,ai->ai_addrlen);
+  s->sock_len=ai->ai_addrlen;
   s->fd = fd;
 }
 
-int read_SSH(int fd)
+/* With fastopen, grab whatever the ssh client has already written, so
+ * it can be sent with the SYN. Only done for pipes and sockets, and
+ * only while we have nothing yet.
+ */
+static void read_early_data(struct race *race)
 {
-  int l;
-  char reply[3];
-  l=read(fd,&reply,3);
-  if (l<1) return -1;
-  if (memcmp(reply,"SSH",l)) return -1;
-  write(1,reply,l);
+  struct pollfd p;
+  struct stat st;
+  ssize_t r;
+  if (!use_fastopen||race->early_len) return;
+  if (fstat(0,&st)||!(S_ISFIFO(st.st_mode)||S_ISSOCK(st.st_mode))) return;
+  p.fd=0;
+  p.events=POLLIN;
+  if (poll(&p,1,0)!=1||!(p.revents&POLLIN)) return;
+  r=read(0,race->early_data,sizeof(race->early_data));
+  if (r>0) race->early_len=r;
+}
+
+/* Send the part of the early data the SYN didn't carry. There is very
+ * little of it, so just wait for the socket whenever it is full.
+ */
+static int send_early_data(struct race *race, struct socket_info *s)
+{
+  size_t done=s->early_sent;
+  while (done<race->early_len) {
+    ssize_t r=write(s->fd,race->early_data+done,race->early_len-done);
+    if (r>0) {
+      done+=r;
+    } else if ((r==-1)&&(errno==EAGAIN)) {
+      struct pollfd p;
+      p.fd=s->fd;
+      p.events=POLLOUT;
+      poll(&p,1,-1);
+    } else if ((r==-1)&&(errno==EINTR)) {
+      continue;
+    } else {
+      return -1;
+    }
+  }
   return 0;
 }
 
-static inline int64_t timeval_to_int64(struct timeval tv)
+/* Read more of the banner of s without blocking. Returns 1 once the
+ * identification line has arrived, 0 if more is needed, -1 if nothing
+ * could be read and -2 if it isn't an SSH server. With bonding 2 is
+ * returned for a bonding peer, and with bonding 2 only a peer will do,
+ * an SSH server counts as -2.
+ */
+static int read_banner(struct socket_info *s, int bonding)
 {
-  return ((int64_t)tv.tv_sec)*((int64_t)1000000)+((int64_t)tv.tv_usec);
+  size_t want=sizeof(s->banner)-s->banner_len;
+  ssize_t l;
+  int r;
+  /* The frames of a peer follow right after its banner, don't read them */
+  if (bonding&&!s->upstream&&(s->banner_len<3)&&
+      !memcmp(s->banner,MPX_BANNER,s->banner_len))
+    want=3-s->banner_len;
+  l=read(s->fd,s->banner+s->banner_len,want);
+  if ((l==-1)&&(errno==EAGAIN)) return 0;
+  if (l<1) return -1;
+  s->banner_len+=l;
+  if (s->upstream) {
+    /* The answer of the proxy, maybe followed by the banner */
+    r=upstream_reply(s->upstream,s->banner,s->banner_len);
+    if ((r<0)||(!r&&(s->banner_len==sizeof(s->banner)))) return -2;
+    if (!r) return 0;
+    s->upstream=0;
+    s->banner_len-=r;
+    memmove(s->banner,s->banner+r,s->banner_len);
+    if (!s->banner_len) return 0;
+  }
+  if (bonding&&!memcmp(s->banner,MPX_BANNER,
+		       (s->banner_len<3)?s->banner_len:3))
+    return (s->banner_len<3)?0:2;
+  if (bonding>1) return -2;
+  r=banner_check(s->banner,s->banner_len);
+  return (r<0)?-2:(r>0);
 }
 
-/* wait_for_reply will wait for the given timeout starting from the
- * specified timeout for an SSH banner from any of the open sockets.
- * If it gets a reply, it will close all other sockets and forward
- * bytes between stdio and that socket. In this case the function
- * never returns. Otherwise the function returns 0 on timeout or if
- * all sockets are closed. If anything else happens it will return 1
- * in which case the caller is expected to recompute the timeout and
- * call wait_for_reply again.
+/* Ask the proxy s is connected to for the host. There is little to
+ * send and the connection has just been made, so it fits at once.
  */
-int wait_for_reply(struct socket_info *sockets, int *nr_open_sockets_ptr,
-		   struct timeval start_time, int64_t timeout)
+static int send_upstream(struct socket_info *s)
 {
-  struct timeval current_time;
-  fd_set socket_fd_set;
-  int i,max_fd=0;
-  struct timeval timeout_tv;
+  char buf[512];
+  int len=upstream_request(s->name,buf,sizeof(buf));
+  if (len<0) {
+    fprintf(stderr,"%s: Invalid host\n",s->name);
+    return -1;
+  }
+  return (write(s->fd,buf,len)==len)?0:-1;
+}
 
-  if (!*nr_open_sockets_ptr) return 0;
+static struct attempt_stats *attempt_of(struct race *race,
+				       const struct socket_info *s)
+{
+  return (s->attempt>=0)?race->stats.attempts+s->attempt:NULL;
+}
 
-  if (timeout) {
-    gettimeofday(&current_time,NULL);
-    timeout+=timeval_to_int64(start_time);
-    timeout-=timeval_to_int64(current_time);
-    if (timeout<1) timeout=1;
-    timeout_tv.tv_sec=timeout/1000000;
-    timeout_tv.tv_usec=timeout%1000000;
-  }
+static void set_result(struct race *race, const struct socket_info *s,
+		       const char *result)
+{
+  struct attempt_stats *a=attempt_of(race,s);
+  if (a) a->result=result;
+}
 
-  FD_ZERO(&socket_fd_set);
-  for (i=0;i<*nr_open_sockets_ptr;++i) {
-    int s=sockets[i].fd;
-    FD_SET(s,&socket_fd_set);
-    if (s>max_fd) max_fd=s;
+/* Write the stats line for this session, if stats are enabled. winner
+ * is NULL unless the race was won.
+ */
+static void report_stats(struct race *race, const struct socket_info *winner,
+			 int fallback, const struct relay_stats *relay)
+{
+  struct host_stats *hosts;
+  int h;
+  if (!stats_enabled()) return;
+  hosts=calloc(race->nr_hosts,sizeof(*hosts));
+  if (!hosts) return;
+  for (h=0;h<race->nr_hosts;++h) {
+    hosts[h].name=race->lookups[h].name;
+    /* Lookups still running haven't told us anything yet */
+    if (race->lookups[h].done) {
+      hosts[h].resolved=race->lookups[h].resolved;
+      hosts[h].addresses=race->lookups[h].nr_addrs;
+    }
   }
-  switch(select(max_fd+1,&socket_fd_set,NULL,NULL,timeout?&timeout_tv:NULL)) {
-  case -1:
-    perror("This should not happen - select");
-    return 0;
-  case 0:
-    /* timeout */
-    return 0;
-  default:
-    /* Naiiiice */
-    for (i=0;i<*nr_open_sockets_ptr;++i)
-      if (FD_ISSET(sockets[i].fd,&socket_fd_set)) {
-	/* Remove this socket from the array */
-	struct socket_info info=sockets[i];
-	sockets[i]=sockets[--*nr_open_sockets_ptr];
-
-	if(read_SSH(info.fd)) {
-	  /* Not good, I didn't get a reply starting with SSH as expected */
-	  /* It is already removed from the array, just step back the index */
-	  --i;
-	  close(info.fd);
-	} else {
-	  /* This sokcet looks good - point of no return - we will use it */
-	  char sock_str[INET_ADDRSTRLEN+1];
-	  inet_ntop(AF_INET,&(info.sock_addr.sin_addr),
-		    sock_str,sizeof(sock_str)-1);
-	  fprintf(stderr,"Using: %s (%s:%d)\n",info.name,sock_str,
-		  ntohs(info.sock_addr.sin_port));
-	  for (i=0;i<*nr_open_sockets_ptr;++i) {
-	    close(sockets[i].fd);
-	  }
-	  exit(select_loop(info.fd)?EXIT_FAILURE:EXIT_SUCCESS);
-	}
-      } /* for ... if FD_ISSET */
-  } /* switch */
-  return 1;
+  race->stats.start=start_time;
+  race->stats.hosts=hosts;
+  race->stats.nr_hosts=race->nr_hosts;
+  race->stats.winner=winner?winner->attempt:-1;
+  race->stats.fallback=fallback;
+  race->stats.relay=relay;
+  stats_report(&race->stats);
+  race->stats.hosts=NULL;
+  free(hosts);
 }
 
-/* Timeout is one second if we tried a connect within the last second and
- * did not get a reply yet. Otherwise timeout is just one microsecond
+/* Tell the cache how the race went. The winner is NULL if all hosts
+ * failed, every host which was tried and did not win counts as failed.
+ * A failure is only recorded once, the race may go on after the
+ * fallback command could not be run.
  */
-int compute_timeout(int open_sockets,
-		    struct socket_info *sockets,
-		    int last_connect_fd)
+static void record_race(struct race *race, struct socket_info *winner)
 {
-  int timeout=1,i;
-  for (i=0;i<open_sockets;++i) {
-    if (sockets[i].fd == last_connect_fd) {
-      timeout=1000000;
+  int h;
+  if (!race->cache) return;
+  for (h=0;h<race->nr_hosts;++h) {
+    const char *name=race->lookups[h].name;
+    if (winner&&(winner->host==h)) {
+      struct timeval now;
+      uint32_t rtt;
+      gettimeofday(&now,NULL);
+      rtt=timeval_to_int64(now)-timeval_to_int64(winner->connect_time);
+      /* A standby connection says nothing about how fast the host is */
+      if (winner->standby)
+	rtt=race->history[h].known?race->history[h].entry.rtt:0;
+      cache_success(race->cache,name,(struct sockaddr *)&winner->sock_addr,
+		    winner->sock_len,rtt);
+      cache_alive(race->cache,(struct sockaddr *)&winner->sock_addr,
+		  winner->sock_len,race->lookups[h].source);
+    } else if (race->history[h].tried) {
+      cache_failure(race->cache,name);
+      race->history[h].tried=0;
     }
   }
-  return timeout;
 }
 
-int main(int argc, char ** argv)
+/* Remember that the address of s failed, so the next races try it
+ * after the others.
+ */
+static void address_failed(struct race *race, const struct socket_info *s)
 {
-  int cmdidx;
-  struct socket_info *sockets;
-  int open_sockets=0;
-  int sockidx;
+  if (race->cache&&(s->host!=-1))
+    cache_dead(race->cache,(struct sockaddr *)&s->sock_addr,s->sock_len,
+	       race->lookups[s->host].source);
+}
 
-  int last_connect_fd=0;
-  struct timeval last_connect_time;
+static int64_t host_stagger(struct race *race, int h);
 
-  if (argc < 3) {
-    fprintf(stderr,"Usage: %s <host1>[:port] <host2>[:port] [...] [-- command]\n",argv[0]);
-    exit(EXIT_FAILURE);
+/* Close a connection which lost the race. With --fan-out it is reset,
+ * the server would otherwise keep it until sshd times it out.
+ */
+static void close_loser(int fd)
+{
+  if (fan_out) {
+    struct linger lin={1,0};
+    setsockopt(fd,SOL_SOCKET,SO_LINGER,&lin,sizeof(lin));
   }
+  close(fd);
+}
 
-  for (cmdidx=1;(cmdidx<argc)&&strcmp(argv[cmdidx],"--");++cmdidx);
-  if (cmdidx==1) {
+/* Kill the fallback command of --race-fallback unless it is the winner,
+ * and reap it so it does not linger as a zombie for the whole session.
+ */
+static void stop_fallback(struct race *race, const struct socket_info *winner)
+{
+  if (race->fallback_pid&&(!winner||(winner->host!=-1))) {
+    kill(race->fallback_pid,SIGTERM);
+    waitpid(race->fallback_pid,NULL,0);
+    race->fallback_pid=0;
+  }
+}
+
+/* With --live, keep the counters where --top can see them from now on.
+ * The session goes on without if that fails.
+ */
+static void go_live(const char *path)
+{
+  if (!use_live) return;
+  if (!live_dir) live_dir=live_default_dir();
+  if (live_dir) live_open(live_dir,path);
+}
+
+/* We have a winner, which is no longer among the open sockets. Close
+ * the others and forward bytes between stdio and the winner until the
+ * session is over. Never returns.
+ */
+static void use_connection(struct race *race, struct socket_info *info)
+{
+  struct timeval now;
+  char host_str[NI_MAXHOST];
+  char port_str[NI_MAXSERV];
+  char path[256];
+  int i,r;
+  if (getnameinfo((struct sockaddr*)&info->sock_addr,info->sock_len,
+		  host_str,sizeof(host_str),port_str,sizeof(port_str),
+		  NI_NUMERICHOST|NI_NUMERICSERV))
+    strcpy(host_str,"?");
+  if (info->host==-1)
+    snprintf(path,sizeof(path),"fallback %s",info->name);
+  else
+    snprintf(path,sizeof(path),(info->sock_addr.ss_family==AF_INET6)?
+	     "%s ([%s]:%s)":"%s (%s:%s)",info->name,host_str,port_str);
+  fprintf(stderr,"Using: %s\n",path);
+  stop_fallback(race,info);
+  gettimeofday(&now,NULL);
+  for (i=0;i<race->nr_open_sockets;++i) {
+    struct socket_info *s=race->sockets+i;
+    struct sockaddr_storage peer;
+    socklen_t peer_len=sizeof(peer);
+    set_result(race,s,"lost");
+    if (s->host!=-1) {
+      if (getpeername(s->fd,(struct sockaddr *)&peer,&peer_len)) {
+	/* Still not connected after the next host got its turn */
+	if (timeval_to_int64(now)-timeval_to_int64(s->connect_time)>=
+	    host_stagger(race,s->host))
+	  address_failed(race,s);
+      } else if (probing&&race->cache) {
+	/* After the network changed, what connects is worth a try */
+	cache_alive(race->cache,(struct sockaddr *)&s->sock_addr,s->sock_len,
+		    race->lookups[s->host].source);
+      }
+    }
+    close_loser(s->fd);
+  }
+  set_result(race,info,"won");
+  record_race(race,info);
+  /* The spares of the daemon would neither be bound to the source nor
+   * ask the proxy for the host
+   */
+  if ((notify_fd!=-1)&&(info->host!=-1)&&!race->lookups[info->host].source&&
+      !upstream_type(info->name))
+    daemon_notify(notify_fd,info->host,(struct sockaddr *)&info->sock_addr,
+		  info->sock_len);
+  if (probing) exit(EXIT_SUCCESS);
+  ev_free(race->ev);
+  if (send_early_data(race,info)) {
+    perror("write");
+    report_stats(race,info,info->host==-1,NULL);
+    exit(EXIT_FAILURE);
+  }
+  go_live(path);
+  r=relay(info->fd,info->banner,info->banner_len);
+  report_stats(race,info,info->host==-1,relay_stats);
+  exit(r?EXIT_FAILURE:EXIT_SUCCESS);
+}
+
+static int connect_address(const struct sockaddr *addr, socklen_t addr_len,
+			   const char *source);
+
+static void add_candidate(const struct sockaddr *addr, socklen_t len,
+			  const char *source)
+{
+  int i;
+  for (i=0;i<nr_candidates;++i)
+    if ((candidate_lens[i]==len)&&!memcmp(candidates+i,addr,len)&&
+	(candidate_sources[i]==source))
+      return;
+  memcpy(candidates+nr_candidates,addr,len);
+  candidate_sources[nr_candidates]=source;
+  candidate_lens[nr_candidates++]=len;
+}
+
+/* Every address the race knows of, those in use first. Proxies are
+ * left out, they would need to be asked for the host again.
+ */
+static void collect_candidates(struct race *race)
+{
+  int i,h,n=race->nr_bond;
+  for (h=0;h<race->nr_hosts;++h)
+    if (race->lookups[h].done) n+=race->lookups[h].nr_addrs;
+  candidates=malloc(n*sizeof(*candidates));
+  candidate_lens=malloc(n*sizeof(*candidate_lens));
+  candidate_sources=malloc(n*sizeof(*candidate_sources));
+  if (!candidates||!candidate_lens||!candidate_sources) return;
+  for (i=0;i<race->nr_bond;++i)
+    if (!upstream_type(race->bond[i].name))
+      add_candidate((struct sockaddr *)&race->bond[i].sock_addr,
+		    race->bond[i].sock_len,
+		    race->lookups[race->bond[i].host].source);
+  for (i=0;i<race->nr_hosts;++i) {
+    struct lookup *l=race->lookups+race->order[i];
+    if (!l->done||!l->addrs||upstream_type(l->name)) continue;
+    for (h=0;l->addrs[h];++h)
+      add_candidate(l->addrs[h]->ai_addr,l->addrs[h]->ai_addrlen,l->source);
+  }
+}
+
+/* Connect to the next candidate for a lost connection */
+static int reconnect_path(void)
+{
+  int i,fd;
+  for (i=0;i<nr_candidates;++i) {
+    int c=next_candidate++%nr_candidates;
+    fd=connect_address((struct sockaddr *)(candidates+c),candidate_lens[c],
+		       candidate_sources[c]);
+    if (fd!=-1) return fd;
+  }
+  return -1;
+}
+
+/* The smoothed round trip time the kernel measured for s in
+ * microseconds, -1 if it can't tell.
+ */
+static int64_t connection_rtt(const struct socket_info *s)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+  struct tcp_info ti;
+  socklen_t len=sizeof(ti);
+  if (!getsockopt(s->fd,IPPROTO_TCP,TCP_INFO,&ti,&len)) return ti.tcpi_rtt;
+#else
+  (void)s;
+#endif
+  return -1;
+}
+
+/* Whether the session over the connections in race->bond is to be
+ * compressed.
+ */
+static int compress_bond(struct race *race)
+{
+  int i;
+  if (!use_compress) return 0;
+  if (!compress_rtt) return 1;
+  for (i=0;i<race->nr_bond;++i) {
+    int64_t rtt=connection_rtt(race->bond+i);
+    if ((rtt>=0)&&(rtt<compress_rtt)) return 0;
+  }
+  return 1;
+}
+
+/* Run the session over the connections to a bonding peer in race->bond.
+ * Never returns.
+ */
+static void use_bond(struct race *race)
+{
+  unsigned char id[MPX_ID_LEN];
+  struct mpx *m;
+  /* Room for every path, live_open cuts it to fit */
+  char path[MPX_MAX_PATHS*(NI_MAXHOST+64)];
+  int i,r,fd;
+  int compress=compress_bond(race);
+  path[0]=0;
+  for (i=0;i<race->nr_bond;++i) {
+    struct socket_info *s=race->bond+i;
+    char host_str[NI_MAXHOST];
+    size_t len=strlen(path);
+    if (getnameinfo((struct sockaddr*)&s->sock_addr,s->sock_len,
+		    host_str,sizeof(host_str),NULL,0,NI_NUMERICHOST))
+      strcpy(host_str,"?");
+    snprintf(path+len,sizeof(path)-len,"%s%s (%s)",i?", ":"",s->name,
+	     host_str);
+    set_result(race,s,"won");
+  }
+  if (compress) strncat(path,", compressed",sizeof(path)-strlen(path)-1);
+  fprintf(stderr,"Bonding: %s\n",path);
+  stop_fallback(race,NULL);
+  for (i=0;i<race->nr_open_sockets;++i) {
+    set_result(race,race->sockets+i,"lost");
+    close_loser(race->sockets[i].fd);
+  }
+  /* The daemon is not told, its spares only take SSH banners */
+  record_race(race,race->bond);
+  if (probing) exit(EXIT_SUCCESS);
+  ev_free(race->ev);
+
+  /* The peer tells sessions apart by this, they only have to differ */
+  fd=open("/dev/urandom",O_RDONLY);
+  if ((fd==-1)||(read(fd,id,sizeof(id))!=sizeof(id))) {
+    perror("/dev/urandom");
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+  m=mpx_new(0,1,id);
+  if (use_resume) collect_candidates(race);
+  if (!m||(use_resume&&
+	   (!candidates||!candidate_lens||!candidate_sources||
+	    mpx_set_resume(m,resume_buffer,resume_timeout,reconnect_path)))||
+      (compress&&mpx_set_compress(m))) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (i=0;i<race->nr_bond;++i) mpx_add_path(m,race->bond[i].fd);
+  go_live(path);
+  gettimeofday(&relay_stats->start,NULL);
+  r=mpx_run(m);
+  gettimeofday(&relay_stats->end,NULL);
+  report_stats(race,race->bond,0,relay_stats);
+  exit(r?EXIT_FAILURE:EXIT_SUCCESS);
+}
+
+/* Add s, which answered as a bonding peer, to the connections to use */
+static void add_bond(struct race *race, struct socket_info *s)
+{
+  struct timeval now;
+  if (!race->nr_bond) {
+    gettimeofday(&now,NULL);
+    race->bond_deadline=timeval_to_int64(now)+bond_wait;
+  }
+  race->bond[race->nr_bond++]=*s;
+  if (race->nr_bond==bond) use_bond(race);
+}
+
+/* The evaluation is over, use the ready connection with the lowest
+ * round trip time, the first to answer among equals. extra, if not
+ * NULL, answered last and is not in race->ready. Never returns.
+ */
+static void use_fastest(struct race *race, struct socket_info *extra)
+{
+  struct socket_info best,*c;
+  int64_t rtt,best_rtt=-1;
+  int i,b=0,n=race->nr_ready+(extra!=NULL);
+  for (i=0;i<n;++i) {
+    c=(i<race->nr_ready)?race->ready+i:extra;
+    rtt=connection_rtt(c);
+    if ((rtt>=0)&&((best_rtt<0)||(rtt<best_rtt))) {
+      best_rtt=rtt;
+      b=i;
+    }
+  }
+  best=(b<race->nr_ready)?race->ready[b]:*extra;
+  for (i=0;i<n;++i)
+    if (i!=b) {
+      c=(i<race->nr_ready)?race->ready+i:extra;
+      set_result(race,c,"slower");
+      close_loser(c->fd);
+    }
+  if (n>1)
+    fprintf(stderr,"Fastest of %d: %s, round trip %.1fms\n",n,
+	    best.name,best_rtt/1000.0);
+  free(race->ready);
+  race->nr_ready=0;
+  use_connection(race,&best);
+}
+
+/* Add s, whose banner has arrived, to the connections to choose from
+ * once the evaluation window is over.
+ */
+static void add_ready(struct race *race, struct socket_info *s)
+{
+  struct timeval now;
+  if (race->nr_ready==race->ready_size) {
+    int size=race->ready_size?race->ready_size*2:4;
+    struct socket_info *ready=realloc(race->ready,size*sizeof(*ready));
+    /* Too bad, the evaluation is over */
+    if (!ready) use_fastest(race,s);
+    race->ready=ready;
+    race->ready_size=size;
+  }
+  if (!race->nr_ready) {
+    gettimeofday(&now,NULL);
+    race->ready_deadline=timeval_to_int64(now)+evaluate_window;
+  }
+  race->ready[race->nr_ready++]=*s;
+}
+
+static int grow_sockets(struct race *race);
+
+/* Start the fallback command of --race-fallback with one end of a
+ * socket pair as its stdin and stdout, and enter the other end in the
+ * race like a connection to a host.
+ */
+static void start_fallback(struct race *race)
+{
+  char **argv=race->fallback;
+  struct socket_info *s;
+  int sv[2],i;
+  pid_t pid;
+  race->fallback=NULL;
+  if (grow_sockets(race)) return;
+  if (socketpair(AF_UNIX,SOCK_STREAM,0,sv)) {
+    perror("socketpair");
+    return;
+  }
+  pid=fork();
+  if (pid==-1) {
+    perror("fork");
+    close(sv[0]);
+    close(sv[1]);
+    return;
+  }
+  if (!pid) {
+    dup2(sv[1],0);
+    dup2(sv[1],1);
+    close(sv[0]);
+    close(sv[1]);
+    execvp(argv[0],argv);
+    perror(argv[0]);
+    _exit(127);
+  }
+  close(sv[1]);
+  fcntl(sv[0],F_SETFL,O_NONBLOCK);
+  fcntl(sv[0],F_SETFD,FD_CLOEXEC);
+  fprintf(stderr,"Racing:");
+  for (i=0;argv[i];++i)
+    fprintf(stderr," %s",argv[i]);
+  fprintf(stderr,"\n");
+  s=race->sockets+race->nr_open_sockets;
+  memset(s,0,sizeof(*s));
+  s->fd=sv[0];
+  s->host=-1;
+  s->name=argv[0];
+  s->attempt=-1;
+  s->connected=1;
+  if (ev_add(race->ev,s->fd,EV_READ)) {
+    perror("event loop");
+    close(s->fd);
+    kill(pid,SIGTERM);
+    return;
+  }
+  gettimeofday(&s->connect_time,NULL);
+  race->fallback_pid=pid;
+  ++race->nr_open_sockets;
+}
+
+/* How long s may take to produce its banner, 0 for no limit */
+static int64_t banner_timeout_of(const struct socket_info *s)
+{
+  if ((s->host!=-1)&&host_options&&host_options[s->host].banner_timeout)
+    return host_options[s->host].banner_timeout;
+  return banner_timeout;
+}
+
+/* wait_for_reply will wait for the given timeout starting from the
+ * last connect for an SSH banner from any of the open sockets.
+ * If it gets a reply, it will close all other sockets and forward
+ * bytes between stdio and that socket. In this case the function
+ * never returns. Otherwise the function returns 0 on timeout or if
+ * all sockets are closed and all lookups are done. If anything else
+ * happens, including a lookup finishing, it will return 1 in which
+ * case the caller is expected to recompute the timeout and call
+ * wait_for_reply again. A timeout of -1 means no limit, 0 only picks
+ * up what is already there.
+ */
+int wait_for_reply(struct race *race, int64_t timeout)
+{
+  struct socket_info *sockets;
+  int *nr_open_sockets_ptr=&race->nr_open_sockets;
+  struct timeval current_time;
+  struct ev_event events[16];
+  int64_t now,end,caller_end;
+  int i,j,n;
+
+  /* Work with absolute times, -1 meaning no limit */
+  gettimeofday(&current_time,NULL);
+  now=timeval_to_int64(current_time);
+
+  if (race->nr_bond&&(race->bond_deadline<=now)) use_bond(race);
+  if (race->nr_ready&&(race->ready_deadline<=now)) use_fastest(race,NULL);
+  if (race->fallback&&(race->fallback_at<=now)) start_fallback(race);
+  if (!*nr_open_sockets_ptr&&!race->pending_lookups) return 0;
+  /* Only now, starting the fallback may have moved them */
+  sockets=race->sockets;
+
+  if (timeout>=0) timeout+=timeval_to_int64(race->last_connect_time);
+  caller_end=timeout;
+  if (race->nr_bond&&(timeout<0||(race->bond_deadline<timeout)))
+    timeout=race->bond_deadline;
+  if (race->nr_ready&&(timeout<0||(race->ready_deadline<timeout)))
+    timeout=race->ready_deadline;
+  if (race->fallback&&(timeout<0||(race->fallback_at<timeout)))
+    timeout=race->fallback_at;
+
+  if (deadline) {
+    end=timeval_to_int64(start_time)+deadline;
+    if (end<=now) {
+      if (race->nr_ready) use_fastest(race,NULL);
+      fprintf(stderr,"Deadline reached, giving up\n");
+      record_race(race,NULL);
+      report_stats(race,NULL,0,NULL);
+      exit(EXIT_FAILURE);
+    }
+    if (timeout<0||(end<timeout)) timeout=end;
+  }
+
+  {
+    int expired=0;
+    for (i=0;i<*nr_open_sockets_ptr;++i) {
+      int64_t t=banner_timeout_of(sockets+i);
+      if (!t) continue;
+      end=timeval_to_int64(sockets[i].connect_time)+t;
+      if (end<=now) {
+	/* Never going to hear from this one */
+	set_result(race,sockets+i,"timeout");
+	address_failed(race,sockets+i);
+	ev_del(race->ev,sockets[i].fd);
+	close_loser(sockets[i].fd);
+	sockets[i--]=sockets[--*nr_open_sockets_ptr];
+	expired=1;
+      } else if (timeout<0||(end<timeout)) {
+	timeout=end;
+      }
+    }
+    if (expired) return 1;
+  }
+
+  end=timeout;
+  if (timeout>=0) {
+    timeout-=now;
+    /* Already due, just pick up what is there, like with --fan-out
+     * where the next connect is due right away, or a delay of 0
+     */
+    if (timeout<0) timeout=0;
+  }
+
+  n=ev_wait(race->ev,events,16,timeout);
+  switch(n) {
+  case -1:
+    /* A signal, just recompute the timeout and come back */
+    if (errno==EINTR) return 1;
+    perror("This should not happen - ev_wait");
+    return 0;
+  case 0:
+    /* timeout, unless it was the deadline, a banner timeout, the
+     * end of the wait for bonding connections or of the evaluation, or
+     * time to start the fallback command
+     */
+    return end!=caller_end;
+  default:
+    /* Naiiiice */
+    for (j=0;j<n;++j) {
+      if (events[j].fd==race->resolve_fd) {
+	race->pending_lookups-=lookup_collect(race->resolve_fd,race->lookups);
+	if (!race->pending_lookups) {
+	  ev_del(race->ev,race->resolve_fd);
+	  close(race->resolve_fd);
+	  race->resolve_fd=-1;
+	}
+	continue;
+      }
+      for (i=0;i<*nr_open_sockets_ptr;++i)
+	if (sockets[i].fd==events[j].fd) {
+	  struct socket_info info;
+	  int r=0;
+	  /* With stats or a proxy we also wait for the connect to finish */
+	  if ((events[j].events&EV_WRITE)&&!sockets[i].connected) {
+	    int err=0;
+	    socklen_t len=sizeof(err);
+	    getsockopt(sockets[i].fd,SOL_SOCKET,SO_ERROR,&err,&len);
+	    if (!err&&attempt_of(race,sockets+i))
+	      gettimeofday(&attempt_of(race,sockets+i)->connected,NULL);
+	    sockets[i].connected=1;
+	    ev_mod(race->ev,sockets[i].fd,EV_READ);
+	    if (!err&&sockets[i].upstream&&send_upstream(sockets+i))
+	      r=-1;
+	    else if (!err&&!(events[j].events&EV_READ))
+	      break;
+	  }
+	  /* Once bonding has begun, plain SSH servers are no use */
+	  if (!r) r=read_banner(sockets+i,bond?(race->nr_bond?2:1):0);
+	  /* Stays in the race until the banner is complete */
+	  if (!r) break;
+
+	  /* Remove this socket from the array */
+	  info=sockets[i];
+	  sockets[i]=sockets[--*nr_open_sockets_ptr];
+	  ev_del(race->ev,info.fd);
+
+	  if ((r!=-1)&&attempt_of(race,&info))
+	    gettimeofday(&attempt_of(race,&info)->banner,NULL);
+	  if (r==2) {
+	    add_bond(race,&info);
+	  } else if(r<0) {
+	    /* Not good, I didn't get an SSH banner as expected */
+	    set_result(race,&info,(r==-2)?"bad-banner":"failed");
+	    address_failed(race,&info);
+	    close(info.fd);
+	  } else if (evaluate_window&&!bond) {
+	    /* Good, but there may be a faster one */
+	    add_ready(race,&info);
+	  } else {
+	    /* This sokcet looks good - point of no return - we will use it */
+	    use_connection(race,&info);
+	  }
+	  break;
+	} /* for ... if fd matches */
+    }
+  } /* switch */
+  return 1;
+}
+
+/* Timeout is delay if we tried a connect within the last delay and
+ * did not get a reply yet. Otherwise timeout is just one microsecond
+ */
+int64_t compute_timeout(struct race *race, int64_t delay)
+{
+  int64_t timeout=1;
+  int i;
+  /* Racing everything at once, waiting for more bonding connections or
+   * evaluating the ones which answered, get them all going
+   */
+  if (fan_out||race->nr_bond||race->nr_ready) return timeout;
+  for (i=0;i<race->nr_open_sockets;++i) {
+    if (race->sockets[i].fd == race->last_connect_fd) {
+      timeout=delay;
+    }
+  }
+  return timeout;
+}
+
+/* Move the addresses of host h which failed recently behind the
+ * others, keeping their order otherwise.
+ */
+static void sort_addresses(struct race *race, int h)
+{
+  struct lookup *l=race->lookups+h;
+  struct history *hist=race->history+h;
+  const struct addrinfo *ai;
+  struct addrinfo **dead;
+  int i,nr_live=0,nr_dead=0;
+  hist->sorted=1;
+  hist->first_dead=l->nr_addrs;
+  if (!race->cache) return;
+  dead=malloc(l->nr_addrs*sizeof(*dead));
+  if (!dead) return;
+  for (i=l->next;(ai=l->addrs[i]);++i) {
+    if (cache_is_dead(race->cache,ai->ai_addr,ai->ai_addrlen,l->source))
+      dead[nr_dead++]=l->addrs[i];
+    else
+      l->addrs[l->next+nr_live++]=l->addrs[i];
+  }
+  memcpy(l->addrs+l->next+nr_live,dead,nr_dead*sizeof(*dead));
+  hist->first_dead=l->next+nr_live;
+  free(dead);
+}
+
+/* The host to connect to next is the first one in race order which
+ * still has an address left to try. That is either the address it won
+ * with last time, which can be tried before the lookup is done, or one
+ * of the addresses of a finished lookup. Hosts that are slow to resolve
+ * are simply skipped until they are done. Addresses which failed
+ * recently are only tried once all lookups are done and no other
+ * address is left. Returns -1 if there is no such host right now.
+ */
+static int next_host(struct race *race)
+{
+  int k,h,pass;
+  for (pass=0;pass<2;++pass) {
+    for (k=0;k<race->nr_hosts;++k) {
+      struct lookup *l;
+      struct history *hist;
+      h=race->order[k];
+      l=race->lookups+h;
+      hist=race->history+h;
+      if (hist->known&&hist->entry.addr_len&&!hist->cached_tried) return h;
+      if (!l->done||!l->addrs||!l->addrs[l->next]) continue;
+      if (!hist->sorted) sort_addresses(race,h);
+      if (pass||(l->next<hist->first_dead)) return h;
+    }
+    if (race->pending_lookups) break;
+  }
+  return -1;
+}
+
+/* The stagger after trying host h. If we know how fast it answered
+ * last time, there is no point in waiting much longer than that.
+ */
+static int64_t host_stagger(struct race *race, int h)
+{
+  int64_t t,max=stagger;
+  if ((h!=-1)&&host_options&&host_options[h].stagger)
+    max=host_options[h].stagger;
+  if ((h==-1)||!race->history[h].known||!race->history[h].entry.rtt)
+    return max;
+  t=2*(int64_t)race->history[h].entry.rtt;
+  if (t<50000) t=50000;
+  return (t<max)?t:max;
+}
+
+static int same_address(const struct sockaddr *a, socklen_t a_len,
+			const struct sockaddr *b, socklen_t b_len)
+{
+  return (a_len==b_len)&&!memcmp(a,b,a_len);
+}
+
+/* Make room for one more socket */
+static int grow_sockets(struct race *race)
+{
+  if (race->nr_open_sockets==race->sockets_size) {
+    int size=race->sockets_size?2*race->sockets_size:8;
+    struct socket_info *p=realloc(race->sockets,size*sizeof(*p));
+    if (!p) {
+      perror("malloc");
+      return -1;
+    }
+    race->sockets=p;
+    race->sockets_size=size;
+  }
+  return 0;
+}
+
+/* Start a stats record for a connection of host h to addr */
+static void new_attempt(struct race *race, struct socket_info *s,
+			const struct sockaddr *addr, socklen_t addr_len)
+{
+  struct attempt_stats *a=stats_attempt(&race->stats);
+  s->attempt=-1;
+  s->connected=0;
+  if (!a) return;
+  s->attempt=a-race->stats.attempts;
+  a->name=race->lookups[s->host].name;
+  memcpy(&a->addr,addr,addr_len);
+  a->addr_len=addr_len;
+  gettimeofday(&a->start,NULL);
+}
+
+/* Add the connection in s, which is ready to be added at the end of the
+ * sockets, to the race.
+ */
+static void add_socket(struct race *race, struct socket_info *s)
+{
+  /* Connects are only timed with stats, it costs an extra wakeup. A
+   * proxy needs to be told where to connect once it is there.
+   */
+  if (ev_add(race->ev,s->fd,((s->attempt>=0)||s->upstream)?
+	     (EV_READ|EV_WRITE):EV_READ)) {
+    perror("event loop");
+    close(s->fd);
+    return;
+  }
+  gettimeofday(&race->last_connect_time,NULL);
+  s->connect_time=race->last_connect_time;
+  race->last_connect_fd=s->fd;
+  race->last_host=s->host;
+  race->history[s->host].tried=1;
+  ++race->nr_open_sockets;
+}
+
+/* Enter a connection the daemon opened ahead of time for host h, as if
+ * it had just been started, with what the daemon has read of its banner.
+ * If the banner is complete, there is nothing left to race for and it is
+ * used right away.
+ */
+static void add_standby(struct race *race, int fd, int h,
+			const char *banner, size_t banner_len)
+{
+  struct history *hist;
+  struct socket_info *s;
+  if ((h<0)||(h>=race->nr_hosts)||grow_sockets(race)) {
+    close(fd);
+    return;
+  }
+  hist=race->history+h;
+  s=race->sockets+race->nr_open_sockets;
+  s->sock_len=sizeof(s->sock_addr);
+  /* Fails if the connect did not work out */
+  if (getpeername(fd,(struct sockaddr *)&s->sock_addr,&s->sock_len)) {
+    close(fd);
+    return;
+  }
+  s->fd=fd;
+  s->name=(char *)race->lookups[h].name;
+  s->host=h;
+  s->early_sent=0;
+  s->standby=1;
+  s->upstream=0;
+  new_attempt(race,s,(struct sockaddr *)&s->sock_addr,s->sock_len);
+  if (hist->known&&
+      same_address((struct sockaddr *)&s->sock_addr,s->sock_len,
+		   (struct sockaddr *)&hist->entry.addr,hist->entry.addr_len))
+    hist->cached_tried=1;
+  memcpy(s->banner,banner,banner_len);
+  s->banner_len=banner_len;
+  if (banner_len) {
+    int r=banner_check(s->banner,s->banner_len);
+    if (r) {
+      if (attempt_of(race,s)) gettimeofday(&attempt_of(race,s)->banner,NULL);
+      if (r>0) use_connection(race,s);
+      set_result(race,s,"bad-banner");
+      address_failed(race,s);
+      close(fd);
+      return;
+    }
+  }
+  add_socket(race,s);
+}
+
+/* Start a connection to addr from source, returns the socket or -1 */
+static int connect_address(const struct sockaddr *addr, socklen_t addr_len,
+			   const char *source)
+{
+  struct socket_info s;
+  struct addrinfo ai;
+  memset(&ai,0,sizeof(ai));
+  ai.ai_family=addr->sa_family;
+  ai.ai_socktype=SOCK_STREAM;
+  ai.ai_addrlen=addr_len;
+  ai.ai_addr=(struct sockaddr *)addr;
+  try_to_connect(&s,&ai,source,NULL,0);
+  return s.fd;
+}
+
+/* Open a standby connection for the daemon */
+static int connect_standby(const struct sockaddr *addr, socklen_t addr_len)
+{
+  return connect_address(addr,addr_len,NULL);
+}
+
+/* Connect to the next address of host h */
+static void connect_next(struct race *race, int h)
+{
+  struct lookup *l=race->lookups+h;
+  struct history *hist=race->history+h;
+  struct socket_info *s;
+  struct addrinfo cached;
+  const struct addrinfo *ai;
+
+  if (grow_sockets(race)) return;
+
+  if (hist->known&&hist->entry.addr_len&&!hist->cached_tried) {
+    memset(&cached,0,sizeof(cached));
+    cached.ai_family=hist->entry.addr.ss_family;
+    cached.ai_socktype=SOCK_STREAM;
+    cached.ai_addrlen=hist->entry.addr_len;
+    cached.ai_addr=(struct sockaddr *)&hist->entry.addr;
+    hist->cached_tried=1;
+    ai=&cached;
+  } else {
+    ai=l->addrs[l->next++];
+    /* No need to try the cached address twice */
+    if (hist->cached_tried&&
+	same_address(ai->ai_addr,ai->ai_addrlen,
+		     (struct sockaddr *)&hist->entry.addr,hist->entry.addr_len))
+      ai=l->addrs[l->next]?l->addrs[l->next++]:NULL;
+  }
+
+  //fprintf(stderr,"Trying: %s\n",l->name);
+  s=race->sockets+race->nr_open_sockets;
+  s->name=(char *)l->name;
+  s->host=h;
+  s->fd=-1;
+  s->standby=0;
+  s->upstream=upstream_type(l->name);
+  read_early_data(race);
+  if (ai) {
+    new_attempt(race,s,ai->ai_addr,ai->ai_addrlen);
+    /* The proxy gets its request first, the rest follows the win */
+    if (s->upstream)
+      try_to_connect(s,ai,l->source,NULL,0);
+    else
+      try_to_connect(s,ai,l->source,race->early_data,race->early_len);
+    if (s->fd==-1) set_result(race,s,"unreachable");
+  }
+  if (l->addrs&&!l->addrs[l->next]) lookup_free(l);
+  if (s->fd!=-1) add_socket(race,s);
+}
+
+/* Whether host a is tried before host b, which comes first on the
+ * command line.
+ */
+static int goes_before(struct race *race, int winner, int a, int b)
+{
+  if (host_options&&(host_options[a].weight!=host_options[b].weight))
+    return host_options[a].weight>host_options[b].weight;
+  if (!race->cache||(b==winner)) return 0;
+  return (a==winner)||
+    (race->history[a].entry.failures<race->history[b].entry.failures);
+}
+
+/* Decide the order to try the hosts in. Without a cache it is the
+ * order of the command line. With a cache the host which won most
+ * recently goes first, and the rest are ordered by how many races they
+ * have lost since they last won. Weights from a group come before
+ * either.
+ */
+static void order_hosts(struct race *race)
+{
+  int winner=-1;
+  int h,k;
+  for (h=0;h<race->nr_hosts;++h) {
+    struct history *hist=race->history+h;
+    race->order[h]=h;
+    if (race->cache) {
+      hist->known=!cache_get(race->cache,race->lookups[h].name,&hist->entry);
+      /* Not worth jumping the lookup for, it gets its turn after it */
+      if (hist->known&&hist->entry.addr_len&&
+	  cache_is_dead(race->cache,(struct sockaddr *)&hist->entry.addr,
+			hist->entry.addr_len,race->lookups[h].source))
+	hist->entry.addr_len=0;
+    }
+    if (hist->known&&hist->entry.last_success&&!hist->entry.failures&&
+	((winner==-1)||
+	 (hist->entry.last_success>race->history[winner].entry.last_success)))
+      winner=h;
+  }
+  if (!race->cache&&!host_options) return;
+  /* Insertion sort, keeping command line order among equals */
+  for (k=1;k<race->nr_hosts;++k) {
+    int j;
+    h=race->order[k];
+    for (j=k;(j>0)&&goes_before(race,winner,h,race->order[j-1]);--j)
+      race->order[j]=race->order[j-1];
+    race->order[j]=h;
+  }
+}
+
+/* Parse a time with an optional unit of us, ms or s, the default is
+ * milliseconds. Returns the time in microseconds or -1 if the string is
+ * not a valid time.
+ */
+static int64_t parse_time(const char *str)
+{
+  char *end;
+  double t=strtod(str,&end);
+  if ((end==str)||(t<0)) return -1;
+  if (!strcmp(end,"us")) return t;
+  if (!*end||!strcmp(end,"ms")) return t*1000;
+  if (!strcmp(end,"s")) return t*1000000;
+  return -1;
+}
+
+/* Parse a byte count with an optional k or M suffix, returns 0 if the
+ * string is not a valid positive size.
+ */
+static size_t parse_size(const char *str)
+{
+  char *end;
+  unsigned long n;
+  int shift=0;
+  /* strtoul would quietly turn -1 into a huge size */
+  if (strchr(str,'-')) return 0;
+  errno=0;
+  n=strtoul(str,&end,10);
+  if ((end==str)||(errno==ERANGE)) return 0;
+  switch(*end) {
+  case 'k': case 'K': shift=10; ++end; break;
+  case 'm': case 'M': shift=20; ++end; break;
+  }
+  if (*end||(n>(SIZE_MAX>>shift))) return 0;
+  return (size_t)n<<shift;
+}
+
+/* Parse IDLE[,INTERVAL[,COUNT]] for --keepalive. The kernel wants whole
+ * seconds, so unlike other times a bare number is taken as seconds.
+ */
+static int parse_keepalive(const char *arg)
+{
+  int *times[2]={&keepalive_idle,&keepalive_interval};
+  char *copy=strdup(arg);
+  char *p=copy;
+  int i,result=0;
+  if (!copy) return -1;
+  for (i=0;(i<3)&&p;++i) {
+    char *next=strchr(p,',');
+    if (next) *next++=0;
+    if (*p) {
+      if (i<2) {
+	int64_t t=parse_time(p);
+	if (t<0) result=-1;
+	if (!p[strspn(p,"0123456789.")]) t*=1000;
+	*times[i]=(t+999999)/1000000;
+      } else {
+	char *end;
+	keepalive_count=strtol(p,&end,10);
+	if (*end||(keepalive_count<1)) result=-1;
+      }
+    }
+    p=next;
+  }
+  if (p) result=-1;
+  free(copy);
+  return result;
+}
+
+/* Parse RATE[,RATE] for --rate-limit, the second one defaults to the
+ * first.
+ */
+static int parse_rate_limit(const char *arg)
+{
+  const char *comma=strchr(arg,',');
+  char *first=strndup(arg,comma?(size_t)(comma-arg):strlen(arg));
+  if (!first) return -1;
+  rate_limit[0]=parse_size(first);
+  rate_limit[1]=comma?parse_size(comma+1):rate_limit[0];
+  free(first);
+  return (rate_limit[0]&&rate_limit[1])?0:-1;
+}
+
+/* A class of --qos: a name as for the IPQoS of ssh, or the TOS byte.
+ * Returns -1 if it is neither.
+ */
+static int parse_qos_class(const char *str)
+{
+  static const struct {
+    const char *name;
+    int tos;
+  } names[]={
+    { "ef", 0xb8 }, { "le", 0x04 }, { "lowdelay", 0x10 },
+    { "throughput", 0x08 }, { "reliability", 0x04 }, { "none", 0 }
+  };
+  char *end;
+  long n;
+  size_t i;
+  if ((strlen(str)==4)&&!strncmp(str,"af",2)&&
+      (str[2]>='1')&&(str[2]<='4')&&(str[3]>='1')&&(str[3]<='3'))
+    return ((str[2]-'0')*8+(str[3]-'0')*2)<<2;
+  if ((strlen(str)==3)&&!strncmp(str,"cs",2)&&(str[2]>='0')&&(str[2]<='7'))
+    return (str[2]-'0')<<5;
+  for (i=0;i<sizeof(names)/sizeof(*names);++i)
+    if (!strcmp(str,names[i].name)) return names[i].tos;
+  n=strtol(str,&end,0);
+  return ((end==str)||*end||(n<0)||(n>255))?-1:n;
+}
+
+/* Parse INTERACTIVE[,BULK] for --qos, a single class is used for both */
+static int parse_qos(const char *arg)
+{
+  const char *comma=strchr(arg,',');
+  char *first=strndup(arg,comma?(size_t)(comma-arg):strlen(arg));
+  if (!first) return -1;
+  qos[0]=parse_qos_class(first);
+  qos[1]=comma?parse_qos_class(comma+1):qos[0];
+  free(first);
+  return ((qos[0]<0)||(qos[1]<0))?-1:0;
+}
+
+enum {
+  OPT_STAGGER=256,
+  OPT_BANNER_TIMEOUT,
+  OPT_FALLBACK_DELAY,
+  OPT_DEADLINE,
+  OPT_CONFIG,
+  OPT_CACHE,
+  OPT_NODELAY,
+  OPT_SNDBUF,
+  OPT_RCVBUF,
+  OPT_KEEPALIVE,
+  OPT_FASTOPEN,
+  OPT_STATS,
+  OPT_LIVE,
+  OPT_TOP,
+  OPT_DAEMON,
+  OPT_USE_DAEMON,
+  OPT_POOL_SIZE,
+  OPT_POOL_TTL,
+  OPT_POOL_CHECK,
+  OPT_MONITOR,
+  OPT_BOND,
+  OPT_BOND_WAIT,
+  OPT_RESUME,
+  OPT_RESUME_BUFFER,
+  OPT_RESUME_TIMEOUT,
+  OPT_COMPRESS,
+  OPT_RATE_LIMIT,
+  OPT_QOS,
+  OPT_IO_URING,
+  OPT_BUFFER_MAX,
+  OPT_EVALUATE,
+  OPT_FAN_OUT,
+  OPT_RACE_FALLBACK,
+  OPT_GROUPS,
+  OPT_COMPILE_GROUPS
+};
+
+static const struct option long_options[] = {
+  { "splice", no_argument, NULL, 's' },
+  { "io-uring", no_argument, NULL, OPT_IO_URING },
+  { "buffer-size", required_argument, NULL, 'b' },
+  { "buffer-max", required_argument, NULL, OPT_BUFFER_MAX },
+  { "attempt-delay", required_argument, NULL, 'a' },
+  { "stagger", required_argument, NULL, OPT_STAGGER },
+  { "banner-timeout", required_argument, NULL, OPT_BANNER_TIMEOUT },
+  { "evaluate", required_argument, NULL, OPT_EVALUATE },
+  { "fan-out", no_argument, NULL, OPT_FAN_OUT },
+  { "fallback-delay", required_argument, NULL, OPT_FALLBACK_DELAY },
+  { "race-fallback", no_argument, NULL, OPT_RACE_FALLBACK },
+  { "deadline", required_argument, NULL, OPT_DEADLINE },
+  { "config", required_argument, NULL, OPT_CONFIG },
+  { "groups", required_argument, NULL, OPT_GROUPS },
+  { "compile-groups", no_argument, NULL, OPT_COMPILE_GROUPS },
+  { "cache", optional_argument, NULL, OPT_CACHE },
+  { "nodelay", no_argument, NULL, OPT_NODELAY },
+  { "sndbuf", required_argument, NULL, OPT_SNDBUF },
+  { "rcvbuf", required_argument, NULL, OPT_RCVBUF },
+  { "keepalive", optional_argument, NULL, OPT_KEEPALIVE },
+  { "rate-limit", required_argument, NULL, OPT_RATE_LIMIT },
+  { "qos", optional_argument, NULL, OPT_QOS },
+  { "fastopen", no_argument, NULL, OPT_FASTOPEN },
+  { "stats", optional_argument, NULL, OPT_STATS },
+  { "live", optional_argument, NULL, OPT_LIVE },
+  { "top", no_argument, NULL, OPT_TOP },
+  { "daemon", optional_argument, NULL, OPT_DAEMON },
+  { "use-daemon", optional_argument, NULL, OPT_USE_DAEMON },
+  { "pool-size", required_argument, NULL, OPT_POOL_SIZE },
+  { "pool-ttl", required_argument, NULL, OPT_POOL_TTL },
+  { "pool-check", required_argument, NULL, OPT_POOL_CHECK },
+  { "monitor", no_argument, NULL, OPT_MONITOR },
+  { "bond", optional_argument, NULL, OPT_BOND },
+  { "bond-wait", required_argument, NULL, OPT_BOND_WAIT },
+  { "resume", no_argument, NULL, OPT_RESUME },
+  { "resume-buffer", required_argument, NULL, OPT_RESUME_BUFFER },
+  { "resume-timeout", required_argument, NULL, OPT_RESUME_TIMEOUT },
+  { "compress", optional_argument, NULL, OPT_COMPRESS },
+  { NULL, 0, NULL, 0 }
+};
+
+static int read_config(const char *file, int must_exist);
+
+/* Apply one option, from wherever it came. Returns -1 if the value is
+ * not valid for the option.
+ */
+static int set_option(int c, const char *arg)
+{
+  switch(c) {
+  case 's':
+    use_splice=1;
+    break;
+  case OPT_IO_URING:
+    use_uring=1;
+    break;
+  case 'b':
+    buffer_size=parse_size(arg);
+    return buffer_size?0:-1;
+  case OPT_BUFFER_MAX:
+    buffer_max=parse_size(arg);
+    return buffer_max?0:-1;
+  case 'a':
+    return ((attempt_delay=parse_time(arg))<0)?-1:0;
+  case OPT_STAGGER:
+    return ((stagger=parse_time(arg))<0)?-1:0;
+  case OPT_BANNER_TIMEOUT:
+    return ((banner_timeout=parse_time(arg))<0)?-1:0;
+  case OPT_EVALUATE:
+    return ((evaluate_window=parse_time(arg))<0)?-1:0;
+  case OPT_FAN_OUT:
+    fan_out=1;
+    break;
+  case OPT_RACE_FALLBACK:
+    race_fallback=1;
+    break;
+  case OPT_FALLBACK_DELAY:
+    return ((fallback_delay=parse_time(arg))<0)?-1:0;
+  case OPT_DEADLINE:
+    return ((deadline=parse_time(arg))<0)?-1:0;
+  case OPT_CONFIG:
+    return read_config(arg,1);
+  case OPT_GROUPS:
+    free(groups_file);
+    groups_file=strdup(arg);
+    break;
+  case OPT_COMPILE_GROUPS:
+    compile_groups=1;
+    break;
+  case OPT_CACHE:
+    use_cache=1;
+    free(cache_file);
+    cache_file=arg?strdup(arg):NULL;
+    break;
+  case OPT_NODELAY:
+    use_nodelay=1;
+    break;
+  case OPT_SNDBUF:
+    sndbuf=(parse_size(arg)<=INT_MAX)?parse_size(arg):0;
+    return sndbuf?0:-1;
+  case OPT_RCVBUF:
+    rcvbuf=(parse_size(arg)<=INT_MAX)?parse_size(arg):0;
+    return rcvbuf?0:-1;
+  case OPT_KEEPALIVE:
+    keepalive=1;
+    return arg?parse_keepalive(arg):0;
+  case OPT_RATE_LIMIT:
+    return parse_rate_limit(arg);
+  case OPT_QOS:
+    /* The defaults of IPQoS */
+    return parse_qos(arg?arg:"af21,cs1");
+  case OPT_FASTOPEN:
+    use_fastopen=1;
+    break;
+  case OPT_STATS:
+    free(stats_dest);
+    stats_dest=strdup(arg?arg:"stderr");
+    break;
+  case OPT_LIVE:
+    use_live=1;
+    if (arg) {
+      free(live_dir);
+      live_dir=strdup(arg);
+    }
+    break;
+  case OPT_TOP:
+    show_top=1;
+    break;
+  case OPT_DAEMON:
+  case OPT_USE_DAEMON:
+    if (c==OPT_DAEMON) run_daemon=1;
+    else use_daemon=1;
+    if (arg) {
+      free(daemon_socket);
+      daemon_socket=strdup(arg);
+    }
+    break;
+  case OPT_POOL_SIZE: {
+    char *end;
+    pool.size=strtol(arg,&end,10);
+    return (*end||(pool.size<0)||(pool.size>DAEMON_POOL_MAX))?-1:0;
+  }
+  case OPT_POOL_TTL:
+    return ((pool.ttl=parse_time(arg))<=0)?-1:0;
+  case OPT_POOL_CHECK:
+    return ((pool.check=parse_time(arg))<0)?-1:0;
+  case OPT_MONITOR:
+    pool.monitor=1;
+    break;
+  case OPT_BOND: {
+    char *end;
+    if (!arg) {
+      bond=MPX_MAX_PATHS;
+      break;
+    }
+    bond=strtol(arg,&end,10);
+    return (*end||(bond<1)||(bond>MPX_MAX_PATHS))?-1:0;
+  }
+  case OPT_BOND_WAIT:
+    return ((bond_wait=parse_time(arg))<0)?-1:0;
+  case OPT_RESUME:
+    use_resume=1;
+    break;
+  case OPT_RESUME_BUFFER:
+    resume_buffer=parse_size(arg);
+    return (resume_buffer<MPX_MIN_RESUME)?-1:0;
+  case OPT_RESUME_TIMEOUT:
+    return ((resume_timeout=parse_time(arg))<=0)?-1:0;
+  case OPT_COMPRESS:
+    use_compress=1;
+    compress_rtt=arg?parse_time(arg):0;
+    return (compress_rtt<0)?-1:0;
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+/* Apply the long option called name, used for the config file and the
+ * environment. where is used for error messages.
+ */
+static int set_named_option(const char *where, const char *name,
+			    const char *arg)
+{
+  const struct option *o;
+  for (o=long_options;o->name;++o)
+    if (!strcmp(o->name,name)) break;
+  if (!o->name) {
+    fprintf(stderr,"%s: Unknown option: %s\n",where,name);
+    return -1;
+  }
+  if ((o->has_arg==no_argument)&&arg) {
+    fprintf(stderr,"%s: Option %s takes no value\n",where,name);
+    return -1;
+  }
+  if ((o->has_arg==required_argument)&&!arg) {
+    fprintf(stderr,"%s: Option %s needs a value\n",where,name);
+    return -1;
+  }
+  if (set_option(o->val,arg)) {
+    fprintf(stderr,"%s: Invalid value for %s: %s\n",where,name,arg);
+    return -1;
+  }
+  return 0;
+}
+
+/* Read a config file with one "name value" or "name=value" option per
+ * line. A missing file is only an error if must_exist is set.
+ */
+static int read_config(const char *file, int must_exist)
+{
+  char line[1024];
+  int lineno=0;
+  int result=0;
+  FILE *f=fopen(file,"r");
+  if (!f) {
+    if (!must_exist&&(errno==ENOENT)) return 0;
+    perror(file);
+    return -1;
+  }
+  while (fgets(line,sizeof(line),f)) {
+    char where[1100];
+    char *name=line;
+    char *arg;
+    char *end;
+    ++lineno;
+    while (isspace((unsigned char)*name)) ++name;
+    if (!*name||(*name=='#')) continue;
+    for (end=name+strlen(name);(end>name)&&isspace((unsigned char)end[-1]);--end);
+    *end=0;
+    arg=name+strcspn(name," \t=");
+    if (*arg) {
+      *arg++=0;
+      while (isspace((unsigned char)*arg)||(*arg=='=')) ++arg;
+    } else {
+      arg=NULL;
+    }
+    snprintf(where,sizeof(where),"%s:%d",file,lineno);
+    if (set_named_option(where,name,arg)) result=-1;
+  }
+  fclose(f);
+  return result;
+}
+
+/* Read the default config file and the environment variable */
+static int read_defaults(void)
+{
+  const char *home=getenv("HOME");
+  const char *env=getenv("SSH_MULTIPATH_PROXY_OPTIONS");
+  int result=0;
+
+  if (home) {
+    char *file=malloc(strlen(home)+sizeof("/.ssh/multipath-proxy.conf"));
+    if (!file) {
+      perror("malloc");
+      return -1;
+    }
+    sprintf(file,"%s/.ssh/multipath-proxy.conf",home);
+    result=read_config(file,0);
+    free(file);
+  }
+
+  if (env) {
+    char *copy=strdup(env);
+    char *word;
+    if (!copy) {
+      perror("malloc");
+      return -1;
+    }
+    for (word=strtok(copy," \t\n");word;word=strtok(NULL," \t\n")) {
+      char *arg=strchr(word,'=');
+      if (arg) *arg++=0;
+      if (strncmp(word,"--",2)) {
+	fprintf(stderr,"SSH_MULTIPATH_PROXY_OPTIONS: Not a long option: %s\n",
+		word);
+	result=-1;
+	continue;
+      }
+      if (set_named_option("SSH_MULTIPATH_PROXY_OPTIONS",word+2,arg))
+	result=-1;
+    }
+    free(copy);
+  }
+  return result;
+}
+
+/* Apply the options on the command line, and leave argv with the
+ * program name followed by the hosts and the command.
+ */
+static void parse_options(int *argc, char ***argv)
+{
+  int c;
+  /* Start over, the daemon parses the arguments of every session */
+  optind=0;
+  /* The + stops option parsing at the first hostname, so options of
+   * the fallback command are left alone.
+   */
+  while ((c=getopt_long(*argc,*argv,"+sb:a:",long_options,NULL))!=-1) {
+    if (c=='?') {
+      *argc=0;
+      return;
+    }
+    if (set_option(c,optarg)) {
+      /* read_config has already said what was wrong */
+      if (c!=OPT_CONFIG)
+	fprintf(stderr,"%s: Invalid value: %s\n",(*argv)[0],optarg);
+      exit(EXIT_FAILURE);
+    }
+  }
+  /* getopt swallows a "--" right after the options, but we need it to
+   * know where the command starts.
+   */
+  if ((optind>1)&&!strcmp((*argv)[optind-1],"--")) --optind;
+  (*argv)[optind-1]=(*argv)[0];
+  *argv+=optind-1;
+  *argc-=optind-1;
+}
+
+/* ~/.ssh/multipath-proxy.groups, or NULL without a home */
+static char *default_groups_file(void)
+{
+  const char *home=getenv("HOME");
+  char *file;
+  if (!home) return NULL;
+  file=malloc(strlen(home)+sizeof("/.ssh/multipath-proxy.groups"));
+  if (file) sprintf(file,"%s/.ssh/multipath-proxy.groups",home);
+  return file;
+}
+
+/* Replace the name of a group, the only argument, by the hosts and
+ * command of the group, applying its options and filling host_options.
+ * Exits if there is no such group.
+ */
+static void expand_group(int *argc, char ***argv)
+{
+  const char *name=(*argv)[1];
+  char where[1100];
+  char **words,**v;
+  int n,i,nr_hosts=0;
+
+  if (!groups_file) return;
+  n=groups_lookup(groups_file,name,&words);
+  if (n<0) {
+    perror(groups_file);
+    exit(EXIT_FAILURE);
+  }
+  /* Not a group, the usage message will tell */
+  if (!n) return;
+  snprintf(where,sizeof(where),"%s: %s",groups_file,name);
+
+  v=malloc((n+2)*sizeof(*v));
+  host_options=calloc(n,sizeof(*host_options));
+  if (!v||!host_options) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  v[0]=(*argv)[0];
+  for (i=0;i<n;++i) {
+    char *w=words[i];
+    char *arg=strchr(w,'=');
+    struct host_options *o;
+    if (!strcmp(w,"--")) break;
+    if (!strncmp(w,"--",2)) {
+      if (arg) *arg++=0;
+      if (set_named_option(where,w+2,arg)) exit(EXIT_FAILURE);
+      continue;
+    }
+    if (!arg) {
+      v[++nr_hosts]=w;
+      host_options[nr_hosts-1].weight=1;
+      continue;
+    }
+    *arg++=0;
+    if (!nr_hosts) {
+      fprintf(stderr,"%s: %s before the first host\n",where,w);
+      exit(EXIT_FAILURE);
+    }
+    /* The settings are those of the host before them */
+    o=host_options+nr_hosts-1;
+    if (!strcmp(w,"weight")) {
+      char *end;
+      long weight=strtol(arg,&end,10);
+      if (*end||(end==arg)||(weight<0)||(weight>1000000)) goto invalid;
+      o->weight=weight;
+    } else if (!strcmp(w,"stagger")) {
+      if ((o->stagger=parse_time(arg))<=0) goto invalid;
+    } else if (!strcmp(w,"timeout")) {
+      if ((o->banner_timeout=parse_time(arg))<=0) goto invalid;
+    } else {
+      fprintf(stderr,"%s: Unknown host setting: %s\n",where,w);
+      exit(EXIT_FAILURE);
+    }
+    continue;
+  invalid:
+    fprintf(stderr,"%s: Invalid value for %s: %s\n",where,w,arg);
+    exit(EXIT_FAILURE);
+  }
+  *argc=nr_hosts+1;
+  /* The command with the -- in front of it */
+  for (;i<n;++i) v[(*argc)++]=words[i];
+  v[*argc]=NULL;
+  *argv=v;
+}
+
+/* The hosts of a session as one string, which tells the daemon which
+ * sessions can share standby connections.
+ */
+static char *hosts_key(int nr_hosts, char **hosts)
+{
+  size_t len=1;
+  char *key;
+  int h;
+  for (h=0;h<nr_hosts;++h) len+=strlen(hosts[h])+1;
+  key=malloc(len);
+  if (!key) return NULL;
+  *key=0;
+  for (h=0;h<nr_hosts;++h) {
+    if (h) strcat(key," ");
+    strcat(key,hosts[h]);
+  }
+  return key;
+}
+
+int main(int argc, char ** argv)
+{
+  int cmdidx;
+  struct race race;
+  int h;
+  int standby_fd=-1;
+  int standby_host=-1;
+  char *standby_banner=NULL;
+  size_t standby_banner_len=0;
+  int client_argc=argc;
+  char **client_argv=malloc((argc+1)*sizeof(*argv));
+
+  gettimeofday(&start_time,NULL);
+  if (read_defaults()) exit(EXIT_FAILURE);
+
+  /* parse_options rearranges argv, keep a copy to give to the daemon */
+  if (!client_argv) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(client_argv,argv,(argc+1)*sizeof(*argv));
+  parse_options(&argc,&argv);
+
+  if (show_top) {
+    if (!live_dir) live_dir=live_default_dir();
+    exit((live_dir&&!live_top(live_dir))?EXIT_SUCCESS:EXIT_FAILURE);
+  }
+
+  if (run_daemon) {
+    struct daemon_session session;
+    /* Sessions learn from each other through the cache */
+    use_cache=1;
+    if (!daemon_socket) daemon_socket=daemon_default_socket();
+    if (!daemon_socket||
+	daemon_run(daemon_socket,&pool,&session,connect_standby))
+      exit(EXIT_FAILURE);
+    /* Now in a session child, with the stdio of the client. Its options
+     * go on top of those of the daemon.
+     */
+    run_daemon=0;
+    in_daemon=1;
+    gettimeofday(&start_time,NULL);
+    argc=session.argc;
+    argv=session.argv;
+    standby_fd=session.standby_fd;
+    standby_host=session.standby_host;
+    standby_banner=session.banner;
+    standby_banner_len=session.banner_len;
+    notify_fd=session.notify_fd;
+    parse_options(&argc,&argv);
+    if (session.probe) {
+      /* Meant to find the best path quickly, nothing is waiting */
+      probing=1;
+      fan_out=1;
+      race_fallback=0;
+      if (!deadline) deadline=10000000;
+    }
+  }
+
+  if (!groups_file) groups_file=default_groups_file();
+  if (compile_groups)
+    exit((groups_file&&!groups_compile(groups_file))?EXIT_SUCCESS:EXIT_FAILURE);
+  if (argc==2) expand_group(&argc,&argv);
+
+  if (argc < 3) {
+    fprintf(stderr,"Usage: %s [options] <host1>[:port] <host2>[:port] [...] [-- command]\n",argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  for (cmdidx=1;(cmdidx<argc)&&strcmp(argv[cmdidx],"--");++cmdidx);
+  if (cmdidx==1) {
     fprintf(stderr,"%s: At least one host required even with command\n",argv[0]);
     exit(EXIT_FAILURE);
   }
@@ -330,32 +3022,101 @@ int main(int argc, char ** argv)
     fprintf(stderr,"%s: Command must not be empty\n",argv[0]);
     exit(EXIT_FAILURE);
   }
+  /* A probe has no use for the fallback command */
+  if (probing) argc=cmdidx;
 
-  sockets=malloc(sizeof(struct socket_info)*cmdidx);
-  if (!sockets) {
-    perror("malloc");
+  if (use_daemon&&!in_daemon) {
+    char *key=hosts_key(cmdidx-1,argv+1);
+    int r;
+    if (!daemon_socket) daemon_socket=daemon_default_socket();
+    /* Without a daemon we just do it ourselves */
+    if (key&&daemon_socket&&
+	((r=daemon_client(daemon_socket,key,client_argc,client_argv))!=-1))
+      exit(r);
+    free(key);
+  }
+  free(client_argv);
+
+  if (stats_dest&&stats_open(stats_dest)) exit(EXIT_FAILURE);
+
+  memset(&race,0,sizeof(race));
+  race.last_host=-1;
+  race.ev=ev_new();
+  if (!race.ev) {
+    perror("event loop");
     exit(EXIT_FAILURE);
   }
 
   if (setsid()==-1) perror("setsid()");
 
-  for(sockidx=1;sockidx<cmdidx;++sockidx) {
-    while(wait_for_reply(sockets,&open_sockets,last_connect_time,compute_timeout(open_sockets, sockets, last_connect_fd)));
+  /* Look up all hosts at once, so a slow lookup of one host does not
+   * hold back the others.
+   */
+  race.nr_hosts=cmdidx-1;
+  race.lookups=calloc(race.nr_hosts,sizeof(*race.lookups));
+  if (!race.lookups) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (h=0;h<race.nr_hosts;++h) race.lookups[h].name=argv[h+1];
+  race.resolve_fd=lookup_start(race.lookups,race.nr_hosts);
+  if ((race.resolve_fd==-1)||ev_add(race.ev,race.resolve_fd,EV_READ)) {
+    perror("lookup");
+    exit(EXIT_FAILURE);
+  }
+  race.pending_lookups=race.nr_hosts;
 
-    //fprintf(stderr,"Trying: %s\n",argv[sockidx]);
-    sockets[open_sockets].name=argv[sockidx];
-    try_to_connect(sockets+open_sockets);
-    if (sockets[open_sockets].fd!=-1) {
-      gettimeofday(&last_connect_time,NULL);
-      last_connect_fd=sockets[open_sockets].fd;
-      ++open_sockets;
+  /* The fallback command would miss whatever we read from stdin, and a
+   * bonding peer expects frames.
+   */
+  if ((use_resume||use_compress)&&!bond) bond=1;
+  if ((cmdidx<argc)||bond) use_fastopen=0;
+  if (race_fallback&&(cmdidx<argc)) {
+    race.fallback=argv+cmdidx+1;
+    race.fallback_at=timeval_to_int64(start_time)+fallback_delay;
+  }
+
+  if (use_cache) {
+    if (!cache_file) cache_file=cache_default_file();
+    if (cache_file) race.cache=cache_open(cache_file);
+  }
+  race.order=malloc(race.nr_hosts*sizeof(*race.order));
+  race.history=calloc(race.nr_hosts,sizeof(*race.history));
+  if (!race.order||!race.history) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  order_hosts(&race);
+  if (standby_fd!=-1)
+    add_standby(&race,standby_fd,standby_host,standby_banner,standby_banner_len);
+
+  while(1) {
+    int64_t timeout=-1;
+    h=next_host(&race);
+    if (h!=-1) {
+      /* Addresses of the same host are raced with a shorter delay */
+      timeout=compute_timeout(&race,(h==race.last_host)?attempt_delay:host_stagger(&race,race.last_host));
+    } else if (!race.pending_lookups) {
+      break;
     }
+    /* Any event may have changed what should be done next */
+    if (wait_for_reply(&race,timeout)) continue;
+    if (h==-1) break;
+    connect_next(&race,h);
   }
 
-  if(cmdidx<argc) {
+  /* Nobody else left to bond with or to compare */
+  if (race.nr_bond&&!race.nr_open_sockets) use_bond(&race);
+  if (race.nr_ready&&!race.nr_open_sockets) use_fastest(&race,NULL);
+
+  if((cmdidx<argc)&&!race_fallback) {
     int i;
-    /* Wait for up to three seconds before executing a command. */
-    while(wait_for_reply(sockets,&open_sockets,last_connect_time,3000000));
+    /* Wait for a while before executing a command. */
+    while(wait_for_reply(&race,fallback_delay));
+    if (race.nr_bond) use_bond(&race);
+    if (race.nr_ready) use_fastest(&race,NULL);
+    record_race(&race,NULL);
+    report_stats(&race,NULL,1,NULL);
     fprintf(stderr,"Running:");
     for (i=cmdidx+1;argv[i];++i)
       fprintf(stderr," %s",argv[i]);
@@ -366,10 +3127,20 @@ int main(int argc, char ** argv)
   }
 
   /* No more hostnames to try, and no alternative command was found.
-   * Wait indefinitely for a reply on one of the sockets.
+   * Wait indefinitely for a reply on one of the sockets, or the
+   * fallback command racing them.
    */
-  while(wait_for_reply(sockets,&open_sockets,last_connect_time,0));
+  while(1) {
+    if (wait_for_reply(&race,-1)) continue;
+    /* Nothing left to wait for but the fallback command */
+    if (!race.fallback) break;
+    start_fallback(&race);
+  }
+  if (race.nr_bond) use_bond(&race);
+  if (race.nr_ready) use_fastest(&race,NULL);
 
   /* All means of connecting have failed. Return an error. */
+  record_race(&race,NULL);
+  report_stats(&race,NULL,0,NULL);
   return EXIT_FAILURE;
 }
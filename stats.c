@@ -0,0 +1,237 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include "stats.h"
+
+static struct relay_stats own_stats;
+struct relay_stats *relay_stats=&own_stats;
+
+static int stats_fd=-1;
+static struct sockaddr_un stats_addr;
+static int stats_dgram=0;
+
+int stats_open(const char *dest)
+{
+  if (!strcmp(dest,"stderr")) {
+    stats_fd=2;
+  } else if (!strncmp(dest,"unix:",5)) {
+    if (strlen(dest+5)>=sizeof(stats_addr.sun_path)) {
+      fprintf(stderr,"%s: Path too long\n",dest+5);
+      return -1;
+    }
+    memset(&stats_addr,0,sizeof(stats_addr));
+    stats_addr.sun_family=AF_UNIX;
+    strcpy(stats_addr.sun_path,dest+5);
+    stats_fd=socket(AF_UNIX,SOCK_DGRAM,0);
+    if (stats_fd==-1) {
+      perror("socket");
+      return -1;
+    }
+    fcntl(stats_fd,F_SETFD,FD_CLOEXEC);
+    stats_dgram=1;
+  } else {
+    stats_fd=open(dest,O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC,0600);
+    if (stats_fd==-1) {
+      perror(dest);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int stats_enabled(void)
+{
+  return stats_fd!=-1;
+}
+
+struct attempt_stats *stats_attempt(struct session_stats *s)
+{
+  struct attempt_stats *a;
+  if (!stats_enabled()) return NULL;
+  a=realloc(s->attempts,(s->nr_attempts+1)*sizeof(*a));
+  if (!a) return NULL;
+  s->attempts=a;
+  a+=s->nr_attempts++;
+  memset(a,0,sizeof(*a));
+  return a;
+}
+
+/* The report is built in a buffer which grows as needed, however many
+ * candidates there were. If memory runs out the report is dropped
+ * rather than sent as a partial line.
+ */
+struct json {
+  char *buf;
+  size_t len;
+  size_t size;
+  int overflow;
+};
+
+static void json_add(struct json *j, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+  if (j->overflow) return;
+  va_start(ap,fmt);
+  n=vsnprintf(j->buf+j->len,j->size-j->len,fmt,ap);
+  va_end(ap);
+  if ((n>=0)&&((size_t)n>=j->size-j->len)) {
+    size_t size=2*j->size;
+    char *buf;
+    while (size<=j->len+n) size*=2;
+    buf=realloc(j->buf,size);
+    if (!buf) {
+      j->overflow=1;
+      return;
+    }
+    j->buf=buf;
+    j->size=size;
+    va_start(ap,fmt);
+    n=vsnprintf(j->buf+j->len,j->size-j->len,fmt,ap);
+    va_end(ap);
+  }
+  if (n<0) j->overflow=1;
+  else j->len+=n;
+}
+
+static void json_string(struct json *j, const char *s)
+{
+  if (!s) {
+    json_add(j,"null");
+    return;
+  }
+  json_add(j,"\"");
+  for (;*s;++s) {
+    unsigned char c=*s;
+    if ((c=='"')||(c=='\\')) json_add(j,"\\%c",c);
+    else if (c<0x20) json_add(j,"\\u%04x",c);
+    else json_add(j,"%c",c);
+  }
+  json_add(j,"\"");
+}
+
+/* Milliseconds from start to t, or null if t never happened */
+static void json_time(struct json *j, struct timeval start, struct timeval t)
+{
+  if (!t.tv_sec&&!t.tv_usec) {
+    json_add(j,"null");
+    return;
+  }
+  json_add(j,"%.3f",(t.tv_sec-start.tv_sec)*1000.0+
+	   (t.tv_usec-start.tv_usec)/1000.0);
+}
+
+void stats_report(const struct session_stats *s)
+{
+  struct json *j;
+  int i;
+
+  if (!stats_enabled()) return;
+  j=calloc(1,sizeof(*j));
+  if (j) {
+    j->size=8192;
+    j->buf=malloc(j->size);
+  }
+  if (!j||!j->buf) {
+    fprintf(stderr,"Out of memory, no stats for this session\n");
+    free(j);
+    return;
+  }
+
+  json_add(j,"{\"time\":%ld.%06ld,\"pid\":%ld,\"hosts\":[",
+	   (long)s->start.tv_sec,(long)s->start.tv_usec,(long)getpid());
+  for (i=0;i<s->nr_hosts;++i) {
+    json_add(j,"%s{\"name\":",i?",":"");
+    json_string(j,s->hosts[i].name);
+    json_add(j,",\"dns_ms\":");
+    json_time(j,s->start,s->hosts[i].resolved);
+    json_add(j,",\"addresses\":%d}",s->hosts[i].addresses);
+  }
+  json_add(j,"],\"candidates\":[");
+  for (i=0;i<s->nr_attempts;++i) {
+    const struct attempt_stats *a=s->attempts+i;
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    json_add(j,"%s{\"name\":",i?",":"");
+    json_string(j,a->name);
+    if (getnameinfo((const struct sockaddr *)&a->addr,a->addr_len,
+		    host,sizeof(host),port,sizeof(port),
+		    NI_NUMERICHOST|NI_NUMERICSERV)) {
+      json_add(j,",\"address\":null,\"port\":null");
+    } else {
+      json_add(j,",\"address\":");
+      json_string(j,host);
+      json_add(j,",\"port\":%s",port);
+    }
+    json_add(j,",\"start_ms\":");
+    json_time(j,s->start,a->start);
+    json_add(j,",\"connect_ms\":");
+    json_time(j,a->start,a->connected);
+    json_add(j,",\"banner_ms\":");
+    json_time(j,a->start,a->banner);
+    json_add(j,",\"result\":");
+    json_string(j,a->result?a->result:"pending");
+    json_add(j,"}");
+  }
+  json_add(j,"],\"winner\":");
+  json_string(j,(s->winner>=0)?s->attempts[s->winner].name:NULL);
+  json_add(j,",\"fallback\":%s",s->fallback?"true":"false");
+  if (s->relay) {
+    const struct relay_stats *r=s->relay;
+    json_add(j,",\"relay\":{\"duration_ms\":");
+    json_time(j,r->start,r->end);
+    json_add(j,",\"bytes_in\":%llu,\"bytes_out\":%llu,"
+	     "\"reads\":%llu,\"writes\":%llu,\"waits\":%llu,"
+	     "\"short_writes\":%llu,\"high_water_in\":%llu,"
+	     "\"high_water_out\":%llu,\"stalled_in_ms\":%.3f,"
+	     "\"stalled_out_ms\":%.3f}",
+	     (unsigned long long)r->bytes[0],(unsigned long long)r->bytes[1],
+	     (unsigned long long)r->reads,(unsigned long long)r->writes,
+	     (unsigned long long)r->waits,(unsigned long long)r->short_writes,
+	     (unsigned long long)r->high_water[0],
+	     (unsigned long long)r->high_water[1],
+	     r->stalled[0]/1000.0,r->stalled[1]/1000.0);
+  }
+  json_add(j,"}\n");
+
+  if (j->overflow) {
+    fprintf(stderr,"Out of memory, no stats for this session\n");
+  } else if (stats_dgram) {
+    /* Nobody listening is fine, a report too large for it is news */
+    if ((sendto(stats_fd,j->buf,j->len,0,(struct sockaddr *)&stats_addr,
+		sizeof(stats_addr))==-1)&&(errno==EMSGSIZE))
+      fprintf(stderr,"Stats report too large to send, dropped\n");
+  } else {
+    write(stats_fd,j->buf,j->len);
+  }
+  free(j->buf);
+  free(j);
+}
@@ -0,0 +1,96 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+/*
+    Optional timing statistics. With --stats one JSON object per
+    session is written on a single line, describing every lookup and
+    connection attempt of the race and, if the relay ran, how much it
+    moved and how many system calls it took.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+/* Maintained by the relay loops whether or not stats are enabled */
+struct relay_stats {
+  /* stdin to socket and socket to stdout */
+  uint64_t bytes[2];
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t waits;
+  /* The most buffered in each direction at once */
+  uint64_t high_water[2];
+  /* Writes which took less than they were given */
+  uint64_t short_writes;
+  /* Microseconds spent waiting for the destination of each direction
+   * to take more.
+   */
+  uint64_t stalled[2];
+  struct timeval start;
+  struct timeval end;
+};
+
+struct host_stats {
+  const char *name;
+  struct timeval resolved;
+  int addresses;
+};
+
+/* One connection attempt. Times which have not happened are zero. */
+struct attempt_stats {
+  const char *name;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  struct timeval start;
+  struct timeval connected;
+  struct timeval banner;
+  const char *result;
+};
+
+struct session_stats {
+  struct timeval start;
+  struct host_stats *hosts;
+  int nr_hosts;
+  struct attempt_stats *attempts;
+  int nr_attempts;
+  int winner;
+  int fallback;
+  const struct relay_stats *relay;
+};
+
+/* Points to a page shared with --top once live_open has been called */
+extern struct relay_stats *relay_stats;
+
+/* dest is "stderr", "unix:PATH" for a datagram socket, or a file name
+ * to append to. Returns -1 if it can't be opened.
+ */
+int stats_open(const char *dest);
+int stats_enabled(void);
+
+/* Returns a new attempt record, or NULL if stats are disabled */
+struct attempt_stats *stats_attempt(struct session_stats *s);
+
+void stats_report(const struct session_stats *s);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "upstream.h"
+
+static const struct {
+  const char *prefix;
+  int type;
+  const char *port;
+} schemes[] = {
+  { "socks5://", UPSTREAM_SOCKS5, "1080" },
+  { "http-connect://", UPSTREAM_HTTP, "8080" },
+  { NULL, 0, NULL }
+};
+
+int upstream_type(const char *name)
+{
+  int i;
+  for (i=0;schemes[i].prefix;++i)
+    if (!strncmp(name,schemes[i].prefix,strlen(schemes[i].prefix)))
+      return schemes[i].type;
+  return 0;
+}
+
+char *upstream_proxy(char *name, const char **port)
+{
+  int i;
+  for (i=0;schemes[i].prefix;++i)
+    if (!strncmp(name,schemes[i].prefix,strlen(schemes[i].prefix))) {
+      char *proxy=name+strlen(schemes[i].prefix);
+      char *slash=strchr(proxy,'/');
+      if (slash) *slash=0;
+      *port=schemes[i].port;
+      return proxy;
+    }
+  *port="22";
+  return name;
+}
+
+/* Split the host after the / of name into buf, with the brackets of an
+ * IPv6 address and any @source removed. Returns the port, or -1.
+ */
+static int upstream_target(const char *name, char *buf, size_t size)
+{
+  const char *target=strchr(strstr(name,"://")+3,'/');
+  char *p,*port=NULL;
+  long n=22;
+  if (!target||(strlen(target+1)>=size)) return -1;
+  strcpy(buf,target+1);
+  if ((p=strrchr(buf,'@'))) *p=0;
+  if (*buf=='[') {
+    p=strchr(buf,']');
+    if (!p||(p[1]&&(p[1]!=':'))) return -1;
+    if (p[1]) port=p+2;
+    *p=0;
+    memmove(buf,buf+1,strlen(buf));
+  } else if ((p=strrchr(buf,':'))&&(strchr(buf,':')==p)) {
+    *p=0;
+    port=p+1;
+  }
+  if (port) {
+    char *end;
+    n=strtol(port,&end,10);
+    if (*end||(end==port)||(n<1)||(n>65535)) return -1;
+  }
+  return *buf?n:-1;
+}
+
+int upstream_request(const char *name, char *buf, size_t size)
+{
+  char host[256];
+  unsigned char addr[16];
+  unsigned char *p=(unsigned char *)buf;
+  int port=upstream_target(name,host,sizeof(host));
+  int len;
+  if (port==-1) return -1;
+
+  if (upstream_type(name)==UPSTREAM_HTTP) {
+    const char *fmt=strchr(host,':')?
+      "CONNECT [%s]:%d HTTP/1.1\r\nHost: [%s]:%d\r\n\r\n":
+      "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\n\r\n";
+    len=snprintf(buf,size,fmt,host,port,host,port);
+    return ((len<0)||((size_t)len>=size))?-1:len;
+  }
+
+  /* The greeting offering no authentication and the request go out
+   * together, saving a round trip on the way.
+   */
+  if (size<3+4+1+255+2) return -1;
+  *p++=5;
+  *p++=1;
+  *p++=0;
+  *p++=5;
+  *p++=1;
+  *p++=0;
+  if (inet_pton(AF_INET,host,addr)==1) {
+    *p++=1;
+    memcpy(p,addr,4);
+    p+=4;
+  } else if (inet_pton(AF_INET6,host,addr)==1) {
+    *p++=4;
+    memcpy(p,addr,16);
+    p+=16;
+  } else {
+    *p++=3;
+    *p++=strlen(host);
+    memcpy(p,host,strlen(host));
+    p+=strlen(host);
+  }
+  *p++=port>>8;
+  *p++=port&255;
+  return p-(unsigned char *)buf;
+}
+
+int upstream_reply(int type, const char *buf, size_t len)
+{
+  const unsigned char *b=(const unsigned char *)buf;
+  size_t need;
+
+  if (type==UPSTREAM_HTTP) {
+    const char *end;
+    int status;
+    /* Only the status line matters, the headers are skipped */
+    if ((len>=12)&&(strncmp(buf,"HTTP/1.",7)||(buf[8]!=' ')||
+		    (sscanf(buf+9,"%3d",&status)!=1)||(status/100!=2)))
+      return -1;
+    for (end=buf;(end=memchr(end,'\n',len-(end-buf)));++end)
+      if ((end+2<=buf+len)&&(end[1]=='\n')) return end+2-buf;
+      else if ((end+3<=buf+len)&&(end[1]=='\r')&&(end[2]=='\n'))
+	return end+3-buf;
+    return 0;
+  }
+
+  /* The chosen method, then the reply with the bound address */
+  if ((len>=1)&&(b[0]!=5)) return -1;
+  if ((len>=2)&&(b[1]!=0)) return -1;
+  if ((len>=3)&&(b[2]!=5)) return -1;
+  if ((len>=4)&&(b[3]!=0)) return -1;
+  if (len<6) return 0;
+  switch (b[5]) {
+  case 1:
+    need=2+4+4+2;
+    break;
+  case 4:
+    need=2+4+16+2;
+    break;
+  case 3:
+    if (len<7) return 0;
+    need=2+4+1+b[6]+2;
+    break;
+  default:
+    return -1;
+  }
+  return (len<need)?0:(int)need;
+}
@@ -0,0 +1,60 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+/*
+    Candidates reached through a proxy, named
+    socks5://proxy[:port]/host[:port] or
+    http-connect://proxy[:port]/host[:port]. The connection goes to the
+    proxy, which is asked to connect to the host, and once it says it
+    has, the connection is raced like any other. The proxy port is 1080
+    and 8080 by default, the port of the host 22. Proxies asking for
+    authentication are not supported.
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <stddef.h>
+
+#define UPSTREAM_SOCKS5 1
+#define UPSTREAM_HTTP 2
+
+/* The kind of proxy name goes through, 0 for a direct connection */
+int upstream_type(const char *name);
+
+/* Cut name down to the proxy in place and set *port to its default
+ * port. Returns what is left of name, which is all of it for a direct
+ * connection with the default port 22.
+ */
+char *upstream_proxy(char *name, const char **port);
+
+/* Write what asks the proxy of name to connect to the host into buf.
+ * Returns its length, or -1 if the host is not valid.
+ */
+int upstream_request(const char *name, char *buf, size_t size);
+
+/* Check the len bytes the proxy has answered so far. Returns their
+ * length up to the end of the answer once it has arrived and says the
+ * connection was made, 0 if more is needed and -1 if the proxy refused.
+ */
+int upstream_reply(int type, const char *buf, size_t len);
+
+#endif
@@ -0,0 +1,339 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "stats.h"
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_URING
+#endif
+#endif
+
+#ifdef HAVE_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* At most a read and a write per direction are queued at a time */
+#define URING_ENTRIES 8
+
+struct uring {
+  int fd;
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  /* Prepared since the last submit */
+  unsigned queued;
+};
+
+/* A direction of the relay. rd and wr count the bytes read into and
+ * written from buf, which is used as a ring. They are never reset, as
+ * the kernel may be filling the free space while a write drains it.
+ */
+struct uring_dir {
+  int in;
+  int out;
+  char *buf;
+  size_t size;
+  uint64_t rd;
+  uint64_t wr;
+  int reading;
+  int writing;
+  int active;
+  int done;
+};
+
+static void uring_close(struct uring *u)
+{
+  if (u->sqes) munmap(u->sqes,u->sqes_size);
+  if (u->cq_ring&&(u->cq_ring!=u->sq_ring)) munmap(u->cq_ring,u->cq_ring_size);
+  if (u->sq_ring) munmap(u->sq_ring,u->sq_ring_size);
+  close(u->fd);
+}
+
+static void *ring_map(int fd, size_t size, off_t offset)
+{
+  void *p=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,
+	       offset);
+  return (p==MAP_FAILED)?NULL:p;
+}
+
+/* Set up the rings, returns -1 if the kernel has no io_uring */
+static int uring_open(struct uring *u)
+{
+  struct io_uring_params p;
+  char *sq,*cq;
+  memset(&p,0,sizeof(p));
+  memset(u,0,sizeof(*u));
+  u->fd=syscall(__NR_io_uring_setup,URING_ENTRIES,&p);
+  if (u->fd==-1) return -1;
+  fcntl(u->fd,F_SETFD,FD_CLOEXEC);
+  u->sq_ring_size=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  u->cq_ring_size=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features&IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_ring_size>u->sq_ring_size) u->sq_ring_size=u->cq_ring_size;
+    u->cq_ring_size=u->sq_ring_size;
+  }
+  u->sq_ring=ring_map(u->fd,u->sq_ring_size,IORING_OFF_SQ_RING);
+  if (!u->sq_ring) goto fail;
+  if (p.features&IORING_FEAT_SINGLE_MMAP) u->cq_ring=u->sq_ring;
+  else u->cq_ring=ring_map(u->fd,u->cq_ring_size,IORING_OFF_CQ_RING);
+  if (!u->cq_ring) goto fail;
+  u->sqes_size=p.sq_entries*sizeof(struct io_uring_sqe);
+  u->sqes=ring_map(u->fd,u->sqes_size,IORING_OFF_SQES);
+  if (!u->sqes) goto fail;
+  sq=u->sq_ring;
+  cq=u->cq_ring;
+  u->sq_tail=(unsigned *)(sq+p.sq_off.tail);
+  u->sq_mask=*(unsigned *)(sq+p.sq_off.ring_mask);
+  u->sq_array=(unsigned *)(sq+p.sq_off.array);
+  u->cq_head=(unsigned *)(cq+p.cq_off.head);
+  u->cq_tail=(unsigned *)(cq+p.cq_off.tail);
+  u->cq_mask=*(unsigned *)(cq+p.cq_off.ring_mask);
+  u->cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+  return 0;
+ fail:
+  uring_close(u);
+  return -1;
+}
+
+/* Whether the kernel knows all the operations in ops */
+static int uring_supports(struct uring *u, const int *ops, int nr_ops)
+{
+  struct io_uring_probe *probe;
+  size_t size=sizeof(*probe)+256*sizeof(struct io_uring_probe_op);
+  int i,ok;
+  probe=calloc(1,size);
+  if (!probe) return 0;
+  ok=!syscall(__NR_io_uring_register,u->fd,IORING_REGISTER_PROBE,probe,256);
+  for (i=0;ok&&(i<nr_ops);++i)
+    ok=(ops[i]<=probe->last_op)&&
+      (probe->ops[ops[i]].flags&IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+/* Queue a read or write of len bytes at buf, the user data tells the
+ * completion apart. With index>=0 buf is in registered buffer index.
+ */
+static void uring_queue(struct uring *u, int op, int fd, char *buf,
+			size_t len, int index, uint64_t data)
+{
+  unsigned tail=*u->sq_tail;
+  unsigned i=tail&u->sq_mask;
+  struct io_uring_sqe *sqe=u->sqes+i;
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode=op;
+  sqe->fd=fd;
+  sqe->addr=(uintptr_t)buf;
+  sqe->len=len;
+  /* Streams, the offset is ignored */
+  sqe->off=(uint64_t)-1;
+  if (index>=0) sqe->buf_index=index;
+  sqe->user_data=data;
+  u->sq_array[i]=i;
+  __atomic_store_n(u->sq_tail,tail+1,__ATOMIC_RELEASE);
+  ++u->queued;
+}
+
+/* Queue what direction i of dirs can do now */
+static void uring_prepare(struct uring *u, struct uring_dir *dirs, int i,
+			  int fixed)
+{
+  struct uring_dir *d=dirs+i;
+  size_t pos,len;
+  if (d->active&&!d->reading&&(d->rd-d->wr<d->size)) {
+    pos=d->rd%d->size;
+    len=d->size-(d->rd-d->wr);
+    if (len>d->size-pos) len=d->size-pos;
+    uring_queue(u,fixed?IORING_OP_READ_FIXED:IORING_OP_READ,d->in,
+		d->buf+pos,len,fixed?i:-1,i*2);
+    d->reading=1;
+    ++relay_stats->reads;
+  }
+  if (!d->writing&&(d->rd>d->wr)) {
+    pos=d->wr%d->size;
+    len=d->rd-d->wr;
+    if (len>d->size-pos) len=d->size-pos;
+    uring_queue(u,fixed?IORING_OP_WRITE_FIXED:IORING_OP_WRITE,d->out,
+		d->buf+pos,len,fixed?i:-1,i*2+1);
+    d->writing=1;
+    ++relay_stats->writes;
+  }
+}
+
+/* Account for a finished read or write */
+static void uring_complete(struct uring_dir *dirs, uint64_t data, int r)
+{
+  struct uring_dir *d=dirs+(data>>1);
+  if (data&1) {
+    d->writing=0;
+    if ((r==-EINTR)||(r==-EAGAIN)) return;
+    if (r<1) {
+      d->active=0;
+      d->wr=d->rd;
+    } else {
+      d->wr+=r;
+      relay_stats->bytes[data>>1]+=r;
+    }
+  } else {
+    d->reading=0;
+    /* After a failed write whatever comes in is dropped */
+    if (!d->active||(r==-EINTR)||(r==-EAGAIN)) return;
+    if (r<1) {
+      d->active=0;
+    } else {
+      d->rd+=r;
+      if (d->rd-d->wr>relay_stats->high_water[data>>1])
+	relay_stats->high_water[data>>1]=d->rd-d->wr;
+    }
+  }
+}
+
+int uring_loop(int fd, const char *banner, size_t banner_len, size_t size)
+{
+  static const int fixed_ops[]={IORING_OP_READ_FIXED,IORING_OP_WRITE_FIXED};
+  static const int plain_ops[]={IORING_OP_READ,IORING_OP_WRITE};
+  struct uring u;
+  struct uring_dir dirs[2];
+  struct iovec iov[2];
+  int fixed=1;
+  int result=0;
+  long n;
+  int i;
+
+  if (uring_open(&u)) return -2;
+  if (!uring_supports(&u,fixed_ops,2)&&!uring_supports(&u,plain_ops,2)) {
+    uring_close(&u);
+    return -2;
+  }
+  memset(dirs,0,sizeof(dirs));
+  dirs[0].in=0;
+  dirs[0].out=fd;
+  dirs[0].size=size;
+  dirs[1].in=fd;
+  dirs[1].out=1;
+  dirs[1].size=(size<banner_len)?banner_len:size;
+  for (i=0;i<2;++i) {
+    dirs[i].buf=malloc(dirs[i].size);
+    dirs[i].active=1;
+    iov[i].iov_base=dirs[i].buf;
+    iov[i].iov_len=dirs[i].size;
+  }
+  if (!dirs[0].buf||!dirs[1].buf) {
+    perror("malloc");
+    free(dirs[0].buf);
+    free(dirs[1].buf);
+    uring_close(&u);
+    return -1;
+  }
+  memcpy(dirs[1].buf,banner,banner_len);
+  dirs[1].rd=banner_len;
+  /* Registered buffers save mapping the pages for every operation, they
+   * count against RLIMIT_MEMLOCK on older kernels, so they are optional.
+   */
+  if (!uring_supports(&u,fixed_ops,2)||
+      syscall(__NR_io_uring_register,u.fd,IORING_REGISTER_BUFFERS,iov,2))
+    fixed=0;
+  /* Blocking descriptors are waited for in the kernel, non-blocking ones
+   * would just fail with EAGAIN.
+   */
+  fcntl(0,F_SETFL,fcntl(0,F_GETFL)&~O_NONBLOCK);
+  fcntl(1,F_SETFL,fcntl(1,F_GETFL)&~O_NONBLOCK);
+  fcntl(fd,F_SETFL,fcntl(fd,F_GETFL)&~O_NONBLOCK);
+
+  while(1) {
+    unsigned head,tail;
+    for (i=0;i<2;++i) {
+      struct uring_dir *d=dirs+i;
+      if (!d->active&&(d->rd==d->wr)&&!d->writing&&!d->done) {
+	shutdown(d->out,SHUT_WR);
+	if (i==1) close(1);
+	d->done=1;
+      }
+      if (!d->done) uring_prepare(&u,dirs,i,fixed);
+    }
+    if (dirs[0].done&&dirs[1].done) break;
+    ++relay_stats->waits;
+    /* Interrupted, nothing was submitted yet. Otherwise it may have
+     * taken fewer than were queued, the rest go with the next call.
+     */
+    do
+      n=syscall(__NR_io_uring_enter,u.fd,u.queued,1,IORING_ENTER_GETEVENTS,
+		NULL,0);
+    while ((n==-1)&&(errno==EINTR));
+    if (n==-1) {
+      perror("io_uring_enter");
+      result=-1;
+      break;
+    }
+    u.queued-=n;
+    head=*u.cq_head;
+    tail=__atomic_load_n(u.cq_tail,__ATOMIC_ACQUIRE);
+    for (;head!=tail;++head) {
+      struct io_uring_cqe *cqe=u.cqes+(head&u.cq_mask);
+      uring_complete(dirs,cqe->user_data,cqe->res);
+    }
+    __atomic_store_n(u.cq_head,head,__ATOMIC_RELEASE);
+  }
+
+  /* A read still queued, like one from a terminal which has nothing to
+   * say, may go on until the ring is gone. Its buffer is left to the
+   * exit, which follows the relay right away.
+   */
+  uring_close(&u);
+  for (i=0;i<2;++i)
+    if (!dirs[i].reading) free(dirs[i].buf);
+  return result;
+}
+
+#else
+
+int uring_loop(int fd, const char *banner, size_t banner_len, size_t size)
+{
+  (void)fd;
+  (void)banner;
+  (void)banner_len;
+  (void)size;
+  return -2;
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+    ssh-multipath-proxy
+    Copyright (C) 2006  Kasper Dupont
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2, or (at your option)
+    any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+
+
+/*
+    Relay through io_uring on Linux. Every direction keeps a read and
+    a write queued in the kernel, and one system call submits the ones
+    which have to be replaced and waits for the next to finish, instead
+    of a wait, a read and a write for every chunk.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+
+/* Forward bytes between stdio and fd like copy_loop, sending banner to
+ * stdout first, with buffers of size bytes. Returns -2 if io_uring
+ * can't be used, before anything was read, so the caller can still use
+ * another relay.
+ */
+int uring_loop(int fd, const char *banner, size_t banner_len, size_t size);
+
+#endif